@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+#	Whole system benchmark suite
+#
+#	bench.sh [emulator] [results]
+#
+#	Runs a fixed set of headless workloads unthrottled, each bounded by
+#	an instruction limit, and appends one line per workload to the
+#	results file:
+#
+#	workload=<name> instructions=.. emulated_ns=.. host_ns=.. ips=..
+#	emu_ratio=.. max_rss_kb=..
+#
+#	ips is host instructions per second, emu_ratio is emulated ns per
+#	host ns. The ROM images are looked up in the current directory, the
+#	same as the emulator does. Workloads whose ROMs are missing are
+#	skipped.
+#
+#	BENCH_INSNS overrides the per workload instruction limit.
+#
+
+EMU=${1:-./centurion}
+RESULTS=${2:-bench_results.txt}
+INSNS=${BENCH_INSNS:-20000000}
+BENCHDIR=$(dirname "$0")
+
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/centurion-bench.XXXXXX") || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+failed=0
+
+have_roms()
+{
+	for rom in "$@"; do
+		if [ ! -f "$rom" ]; then
+			echo "  skipped, $rom not found"
+			return 1
+		fi
+	done
+	return 0
+}
+
+# run <workload> <console input> <emulator args...>
+run()
+{
+	name=$1
+	input=$2
+	shift 2
+
+	echo "$name: $EMU $*"
+	# The console MUX treats EOF on stdin as the end of emulation, so give
+	# the emulator a pipe that never closes and only carries our input.
+	mkfifo "$TMP/$name.in" || exit 1
+	exec 3<>"$TMP/$name.in"
+	printf "%s" "$input" >&3
+	"$EMU" -U -T "$INSNS" -B "$TMP/report" "$@" <&3 >"$TMP/$name.out" 2>&1
+	exec 3>&-
+	if [ ! -s "$TMP/report" ]; then
+		echo "  failed, see output below"
+		tail -n 20 "$TMP/$name.out"
+		failed=1
+		return
+	fi
+	line="workload=$name $(cat "$TMP/report")"
+	echo "  $line"
+	echo "$line" >>"$RESULTS"
+	rm -f "$TMP/report"
+}
+
+DIAG_ROMS="bootstrap_unscrambled.bin Diag_F1_Rev_1.0.BIN Diag_F2_Rev_1.0.BIN \
+Diag_F3_Rev_1.0.BIN Diag_F4_1133CMD.BIN"
+
+echo "CPU instruction test"
+if have_roms $DIAG_ROMS; then
+	run cpu_test "" -d -S 1
+fi
+
+echo "ROM self test"
+if have_roms $DIAG_ROMS; then
+	# Selected from the auxiliary tests menu
+	run rom_self_test "03" -d -s 1 -S 13
+fi
+
+echo "hellorld"
+if have_roms $DIAG_ROMS; then
+	echo "79 86 23 C8 E5 EC EC EF F2 EC E4 A1 8D 8A 00 00" |
+		xxd -r -p - >"$TMP/hellorld.bin"
+	run hellorld "" -d -A 0x100 -b "$TMP/hellorld.bin"
+fi
+
+echo "Synthetic loop"
+if have_roms bootstrap_unscrambled.bin; then
+	grep -v '^#' "$BENCHDIR/loop.hex" | xxd -r -p - >"$TMP/loop.cbin"
+	# cbin files are read in whole 400 byte sectors
+	dd if=/dev/zero bs=1 count=$((400 - $(wc -c <"$TMP/loop.cbin"))) \
+		>>"$TMP/loop.cbin" 2>/dev/null
+	run loop "" "$TMP/loop.cbin"
+fi
+
+exit $failed
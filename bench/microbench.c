@@ -0,0 +1,321 @@
+/*
+ *	Microbenchmarks for the emulator hot paths
+ *
+ *	Linked against the same objects as the emulator itself (centurion.c
+ *	is built with its main() renamed), so every number here measures
+ *	exactly the code that ships.
+ *
+ *	microbench [filter]
+ *
+ *	Each benchmark is warmed up, then timed over a number of samples.
+ *	The median and 99th percentile cost per operation are reported.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../cpu6.h"
+#include "../diskimg.h"
+#include "../hawk.h"
+#include "../machine.h"
+#include "../mux.h"
+#include "../scheduler.h"
+
+#define WARMUP_RUNS	5
+#define SAMPLES		101
+
+typedef void (*bench_fn)(void *arg, unsigned ops);
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static const char *filter;
+
+/* Run fn for ops operations per sample and report ns/op */
+static void bench(const char *name, bench_fn fn, void *arg, unsigned ops)
+{
+	double sample[SAMPLES];
+	unsigned i;
+
+	if (filter && strstr(name, filter) == NULL)
+		return;
+
+	for (i = 0; i < WARMUP_RUNS; i++)
+		fn(arg, ops);
+
+	for (i = 0; i < SAMPLES; i++) {
+		uint64_t start = now_ns();
+		fn(arg, ops);
+		sample[i] = (double)(now_ns() - start) / ops;
+	}
+	qsort(sample, SAMPLES, sizeof(double), cmp_double);
+
+	printf("%-32s %10u %12.2f %12.2f %12.0f\n", name, ops,
+		sample[SAMPLES / 2], sample[(SAMPLES * 99) / 100],
+		1000000000.0 / sample[SAMPLES / 2]);
+}
+
+/*
+ *	Scheduler churn: N events that reschedule themselves at pseudo
+ *	random intervals. One op is one dispatch.
+ */
+
+struct churn {
+	unsigned count;
+	struct event_t *events;
+	unsigned dispatched;
+	uint32_t seed;
+};
+
+static struct churn *churn_state;
+
+static uint32_t churn_random(struct churn *c)
+{
+	c->seed = c->seed * 1103515245 + 12345;
+	return c->seed >> 8;
+}
+
+static void churn_cb(struct event_t *event, int64_t late_ns)
+{
+	struct churn *c = churn_state;
+
+	c->dispatched++;
+	event->delta_ns = 1000 + churn_random(c) % 100000;
+	schedule_event(event);
+}
+
+static void bench_scheduler(void *arg, unsigned ops)
+{
+	struct churn *c = arg;
+	unsigned i;
+
+	churn_state = c;
+	c->dispatched = 0;
+	for (i = 0; i < c->count; i++) {
+		c->events[i].delta_ns = 1000 + churn_random(c) % 100000;
+		schedule_event(&c->events[i]);
+	}
+	while (c->dispatched < ops) {
+		int64_t next = scheduler_next();
+		if (next > get_current_time())
+			advance_time(next - get_current_time());
+		run_scheduler(get_current_time(), 0);
+	}
+	for (i = 0; i < c->count; i++)
+		cancel_event(&c->events[i]);
+}
+
+static void scheduler_benchmarks(void)
+{
+	static const unsigned sizes[] = { 1, 4, 16, 64, 256 };
+	char name[64];
+	unsigned i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		struct churn c;
+
+		c.count = sizes[i];
+		c.events = calloc(c.count, sizeof(struct event_t));
+		c.seed = 1;
+		for (unsigned e = 0; e < c.count; e++) {
+			c.events[e].name = "churn";
+			c.events[e].callback = churn_cb;
+		}
+		snprintf(name, sizeof(name), "scheduler_churn/%u", c.count);
+		bench(name, bench_scheduler, &c, 100000);
+		free(c.events);
+	}
+}
+
+/*
+ *	Memory path: physical reads and writes through mem_read8/mem_write8
+ */
+
+static void bench_mem_read8(void *arg, unsigned ops)
+{
+	uint32_t base = *(uint32_t *)arg;
+	volatile uint8_t sink;
+	unsigned i;
+
+	for (i = 0; i < ops; i++)
+		sink = mem_read8(base + (i & 0xFF));
+	(void)sink;
+}
+
+static void bench_mem_read8_io(void *arg, unsigned ops)
+{
+	uint32_t addr = *(uint32_t *)arg;
+	volatile uint8_t sink;
+	unsigned i;
+
+	for (i = 0; i < ops; i++)
+		sink = mem_read8(addr);
+	(void)sink;
+}
+
+static void bench_mem_write8(void *arg, unsigned ops)
+{
+	uint32_t base = *(uint32_t *)arg;
+	unsigned i;
+
+	for (i = 0; i < ops; i++)
+		mem_write8(base + (i & 0xFF), i);
+}
+
+static void bench_mem_write8_io(void *arg, unsigned ops)
+{
+	uint32_t addr = *(uint32_t *)arg;
+	unsigned i;
+
+	for (i = 0; i < ops; i++)
+		mem_write8(addr, 0);
+}
+
+static void memory_benchmarks(void)
+{
+	uint32_t ram = 0x10000;
+	uint32_t rom = 0x3FC00;
+	uint32_t io_status = 0x3F200;	/* MUX0 status */
+	uint32_t io_level = 0x3F20A;	/* MUX IRQ level */
+
+	bench("mem_read8/ram", bench_mem_read8, &ram, 1000000);
+	bench("mem_read8/rom", bench_mem_read8, &rom, 1000000);
+	bench("mem_read8/io", bench_mem_read8_io, &io_status, 1000000);
+	bench("mem_write8/ram", bench_mem_write8, &ram, 1000000);
+	bench("mem_write8/io", bench_mem_write8_io, &io_level, 1000000);
+}
+
+/*
+ *	MMU translation, switching context every 32 lookups
+ */
+
+static void bench_mmu_map(void *arg, unsigned ops)
+{
+	volatile uint32_t sink;
+	unsigned i;
+
+	for (i = 0; i < ops; i++) {
+		if ((i & 31) == 0)
+			set_mmu_debug(i >> 5);
+		sink = mmu_map(i * 0x0801);
+	}
+	set_mmu_debug(0);
+	(void)sink;
+}
+
+/*
+ *	Hawk track encode and bit stream decode
+ */
+
+static struct hawk_drive hawk_unit;
+
+static void bench_hawk_buffer_track(void *arg, unsigned ops)
+{
+	unsigned i;
+
+	for (i = 0; i < ops; i++)
+		hawk_buffer_track(&hawk_unit, 0, 0, i & 1);
+}
+
+/* One op is one 400 byte sector */
+static void bench_hawk_read_bits(void *arg, unsigned ops)
+{
+	uint8_t buf[HAWK_SECTOR_BYTES];
+	int32_t data_start = 2 * HAWK_GAP_BITS + 2 * HAWK_SYNC_BITS + 32;
+	unsigned i;
+
+	for (i = 0; i < ops; i++) {
+		hawk_unit.data_ptr = (i % HAWK_SECTS_PER_TRK) * HAWK_RAW_SECTOR_BITS
+			+ data_start;
+		hawk_read_bits(&hawk_unit, HAWK_SECTOR_BYTES * 8, buf);
+	}
+}
+
+static void hawk_benchmarks(void)
+{
+	char name[] = "/tmp/microbench.XXXXXX";
+	char compact[sizeof(name) + 8];
+	uint8_t track[HAWK_SECTS_PER_TRK * HAWK_SECTOR_BYTES];
+	struct disk_image *img;
+	unsigned i;
+	int fd;
+
+	fd = mkstemp(name);
+	if (fd == -1) {
+		perror(name);
+		return;
+	}
+
+	/* Two tracks (cylinder 0, both heads) of non trivial data */
+	for (i = 0; i < sizeof(track); i++)
+		track[i] = i * 7 + (i >> 8);
+	for (i = 0; i < HAWK_NUM_HEADS; i++) {
+		if (write(fd, track, sizeof(track)) != sizeof(track)) {
+			perror("write");
+			close(fd);
+			unlink(name);
+			return;
+		}
+	}
+	close(fd);
+	img = disk_image_open(name);
+	snprintf(compact, sizeof(compact), "%s.compact", name);
+	if (disk_image_compact(name, compact))
+		compact[0] = 0;
+	unlink(name);
+	if (img == NULL) {
+		perror(name);
+		return;
+	}
+
+	hawk_init(&hawk_unit, 0, img, NULL);
+	bench("hawk_buffer_track", bench_hawk_buffer_track, NULL, 100);
+	hawk_buffer_track(&hawk_unit, 0, 0, 0);
+	bench("hawk_read_bits/sector", bench_hawk_read_bits, NULL, 1000);
+	hawk_release(&hawk_unit);
+
+	/* The same tracks, decoded from a compact image on every seek */
+	if (compact[0] == 0)
+		return;
+	img = disk_image_open(compact);
+	unlink(compact);
+	if (img == NULL)
+		return;
+	hawk_init(&hawk_unit, 0, img, NULL);
+	bench("hawk_buffer_track/compact", bench_hawk_buffer_track, NULL, 100);
+	hawk_release(&hawk_unit);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		filter = argv[1];
+
+	machine_bind(machine_create());
+	mux_init();
+	cpu6_init();
+
+	printf("%-32s %10s %12s %12s %12s\n", "benchmark", "ops/sample",
+		"median ns/op", "p99 ns/op", "ops/s");
+	scheduler_benchmarks();
+	memory_benchmarks();
+	bench("mmu_map/context_switch", bench_mmu_map, NULL, 1000000);
+	hawk_benchmarks();
+	return 0;
+}
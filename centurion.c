@@ -9,95 +9,234 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <termios.h>
+#include <sys/mman.h>
 
 #include "centurion.h"
 #include "console.h"
 #include "cpu6.h"
 #include "dma.h"
 #include "dsk.h"
+#include "farm.h"
+#include "host.h"
+#include "log.h"
+#include "machine.h"
 #include "mux.h"
 #include "cbin_load.h"
 #include "scheduler.h"
-
-static unsigned finch;		/* Finch or original FDC */
+#include "script.h"
+#include "snapshot.h"
+#include "stats.h"
 
 volatile unsigned int emulator_done;
-static int64_t cpu_timestamp_ns = 0;
-
-#define TRACE_MEM_RD	1
-#define TRACE_MEM_WR	2
-#define TRACE_MEM_REG	4
-#define TRACE_CPU	8
-#define TRACE_FDC	16
-#define TRACE_CMD	32
-#define TRACE_PARITY	64
-#define TRACE_MUX	128
-#define TRACE_DSK       256
-#define TRACE_SCHEDULER 512
 
 unsigned int trace = 0;
 
-unsigned int switches;
-
-static unsigned diag = 0;
-
 /* 18 bit address space it seems if the top mmu bit is not used. Allocate
    for the case it is for now */
-static uint8_t mem[0x80000];
-static uint8_t memclean[0x80000];
+#define MEM_SIZE	0x80000
+
+/* Pages written since the last checkpoint, one byte per 2K MMU page */
+#define MEM_PAGE_SHIFT	11
+#define MEM_PAGE_SIZE	(1 << MEM_PAGE_SHIFT)
+#define MEM_PAGES	(MEM_SIZE >> MEM_PAGE_SHIFT)
+
+enum display_mode { DISPLAY_OFF, DISPLAY_STATUS, DISPLAY_STDOUT, DISPLAY_FILE };
+
+/*
+ *	The board and the simpler cards emulated in this file. There is one
+ *	per machine, reached through the thread's current machine (see
+ *	machine.h).
+ */
+struct board_state {
+	unsigned stopped;		/* Halted, or console gone */
+	int64_t cpu_timestamp_ns;
+	unsigned switches;		/* Diag card switches */
+	unsigned diag;
+	unsigned finch;			/* Finch or original FDC */
+
+	uint8_t *mem;			/* MEM_SIZE, see share_rom_pages() */
+	uint8_t memclean[MEM_SIZE];
+	uint8_t mem_dirty[MEM_PAGES];
+
+	uint8_t hexdigits;
+	unsigned hexblank;
+	unsigned hexdots[4];
+	unsigned hexpending;		/* Changed since last shown */
+	char hexshown[12];
+	uint64_t hexshown_ns;		/* Host time */
+	enum display_mode display_mode;	/* Where it is shown */
+	FILE *display_fp;		/* DISPLAY_FILE */
+	unsigned display_line_open;	/* Status line needs a newline */
+
+	unsigned hawk_dma;
+
+	/* Floppy controller */
+	uint8_t fd_buf[0x1000];
+	unsigned fd_ptr;
+	unsigned fd_dma;
+	uint8_t fd_status;
+	uint8_t fd_bits;
+
+	/* CMD controller */
+	uint8_t cmdcmd[256];
+	unsigned cmd_ptr;
+	unsigned cmd_dma;
+	uint8_t cmd_status;
+	uint8_t cmd_bits;
+};
+
+static _Thread_local struct board_state *board;
+
+struct board_state *board_create(void)
+{
+	struct board_state *b = calloc(1, sizeof(*b));
+
+	if (b == NULL) {
+		perror("board_create");
+		exit(1);
+	}
+	/* Separately mapped so that ROM pages can be mapped over it */
+	b->mem = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->mem == MAP_FAILED) {
+		perror("board_create");
+		exit(1);
+	}
+	return b;
+}
 
-static uint8_t hexdigits;
-static unsigned hexblank;
-static unsigned hexdots[4];
+void board_destroy(struct board_state *b)
+{
+	if (b->display_fp)
+		fclose(b->display_fp);
+	munmap(b->mem, MEM_SIZE);
+	free(b);
+}
+
+void board_bind(struct board_state *b)
+{
+	board = b;
+}
+
+/*
+ *	The diag card's hex display. Diagnostics rewrite it constantly, so a
+ *	write only changes the state, and the display is shown when it has
+ *	changed, at most every DISPLAY_REFRESH_NS of host time. Each board has
+ *	its own, off until board_set_display() says where. The command line
+ *	puts it on a status line unless -D says otherwise, so that it stays
+ *	out of the console output.
+ */
+#define DISPLAY_REFRESH_NS	100000000ULL
+
+int board_set_display(const char *where)
+{
+	FILE *fp = NULL;
+
+	if (strcmp(where, "off") == 0)
+		board->display_mode = DISPLAY_OFF;
+	else if (strcmp(where, "status") == 0)
+		board->display_mode = DISPLAY_STATUS;
+	else if (strcmp(where, "stdout") == 0)
+		board->display_mode = DISPLAY_STDOUT;
+	else {
+		fp = fopen(where, "a");
+		if (fp == NULL) {
+			perror(where);
+			return -1;
+		}
+		board->display_mode = DISPLAY_FILE;
+	}
+	if (board->display_fp)
+		fclose(board->display_fp);
+	board->display_fp = fp;
+	return 0;
+}
 
 static void hexdisplay(uint16_t addr, uint8_t val)
 {
-	const char *hexstr = "0123456789ABCDEF";
 	uint8_t onoff = addr & 1;
 	if (addr == 0xF110)
-		hexdigits = val;
+		board->hexdigits = val;
 	else if (addr >= 0xF108) {
 		addr -= 0xF108;
 		addr >>= 1;
-		hexdots[addr] = onoff;
+		board->hexdots[addr] = onoff;
 	} else {
-		hexblank = onoff;
+		board->hexblank = onoff;
 	}
-	if (hexblank) {
-		printf("[OFF]\n");
-		return;
+	if (!board->hexpending) {
+		board->hexpending = 1;
+		/* Straight away if it has been quiet */
+		diag_display_update(0);
 	}
-	printf("[");
-	if (hexdots[0])
-		printf("*");
-	else
-		printf(".");
-	printf("%c", hexstr[hexdigits >> 4]);
-	if (hexdots[1])
-		printf("*");
-	else
-		printf(".");
-	if (hexdots[2])
-		printf("*");
-	else
-		printf(".");
-	printf("%c", hexstr[hexdigits & 0x0F]);
-	if (hexdots[3])
-		printf("*");
+}
+
+void diag_display_update(unsigned force)
+{
+	const char *hexstr = "0123456789ABCDEF";
+	uint64_t now;
+	char text[12];
+
+	if (!board->hexpending || board->display_mode == DISPLAY_OFF)
+		return;
+	now = monotonic_time_ns();
+	if (!force && now - board->hexshown_ns < DISPLAY_REFRESH_NS)
+		return;
+	board->hexpending = 0;
+
+	if (board->hexblank)
+		strcpy(text, "[OFF]");
 	else
-		printf(".");
-	printf("]\n");
-	fflush(stdout);
+		snprintf(text, sizeof(text), "[%c%c%c%c%c%c]",
+			 board->hexdots[0] ? '*' : '.',
+			 hexstr[board->hexdigits >> 4],
+			 board->hexdots[1] ? '*' : '.',
+			 board->hexdots[2] ? '*' : '.',
+			 hexstr[board->hexdigits & 0x0F],
+			 board->hexdots[3] ? '*' : '.');
+	/* Flickered and came back */
+	if (strcmp(text, board->hexshown) == 0)
+		return;
+	strcpy(board->hexshown, text);
+	board->hexshown_ns = now;
+
+	switch (board->display_mode) {
+	case DISPLAY_STDOUT:
+		/* After whatever the console printed first */
+		mux_flush();
+		printf("%s\n", text);
+		fflush(stdout);
+		break;
+	case DISPLAY_STATUS:
+		fprintf(stderr, "\r%-8s", text);
+		board->display_line_open = 1;
+		break;
+	case DISPLAY_FILE:
+		fprintf(board->display_fp, "%s\n", text);
+		fflush(board->display_fp);
+		break;
+	case DISPLAY_OFF:
+		break;
+	}
+}
+
+/* Show the final state, on its own line */
+static void display_finish(void)
+{
+	diag_display_update(1);
+	if (board->display_line_open)
+		fputc('\n', stderr);
+	board->display_line_open = 0;
 }
 
 /* A crappy glue, remained from the old monolythic code, still sufficient to work.
  * A proper DMA API needs to be implemented i believe */
-static unsigned hawk_dma;
-
 void hawk_set_dma(unsigned mode)
 {
-	hawk_dma = mode;
+	board->hawk_dma = mode;
 }
 
 /*
@@ -140,33 +279,27 @@ void hawk_set_dma(unsigned mode)
 #define ST_Fin		2
 #define ST_Busy		8
 
-static uint8_t fd_buf[0x1000];
-static unsigned fd_ptr;
-static unsigned fd_dma;
-static uint8_t fd_status;
-static uint8_t fd_bits;
-
 /* Assume ptr is a shared counter - but we don't actually know from
    what we have so far */
 
 static void fdc_dma_in(uint8_t data)
 {
-	if (fd_ptr >= 0x1000) {
+	if (board->fd_ptr >= 0x1000) {
 		fprintf(stderr, "%04X: overlong fdc data %02X\n", data,
 			cpu6_pc());
 		return;
 	}
-	fd_buf[fd_ptr++] = data;
+	board->fd_buf[board->fd_ptr++] = data;
 }
 
 static uint8_t fdc_dma_out(void)
 {
-	if (fd_ptr >= 0x1000) {
+	if (board->fd_ptr >= 0x1000) {
 		fprintf(stderr, "%04X: overlong fdc command read\n",
 			cpu6_pc());
 		return 0xFF;
 	}
-	return fd_buf[fd_ptr++];
+	return board->fd_buf[board->fd_ptr++];
 }
 
 static void fdc_command_execute(uint8_t * p, int len)
@@ -267,30 +400,30 @@ static void finch_command_execute(uint8_t * p, int len)
 static void fdc_dma_in_done(void)
 {
 	unsigned i;
-	if (fd_ptr > 0x0F00 && (trace & TRACE_FDC)) {
-		fprintf(stderr, "fdcmd: %d\n\t", fd_ptr);
-		for (i = 0x0F00; i < fd_ptr; i++) {
-			fprintf(stderr, "%02X ", fd_buf[i]);
-			if (((i & 15) == 15) && i != fd_ptr - 1)
+	if (board->fd_ptr > 0x0F00 && (trace & TRACE_FDC)) {
+		fprintf(stderr, "fdcmd: %d\n\t", board->fd_ptr);
+		for (i = 0x0F00; i < board->fd_ptr; i++) {
+			fprintf(stderr, "%02X ", board->fd_buf[i]);
+			if (((i & 15) == 15) && i != board->fd_ptr - 1)
 				fprintf(stderr, "\n\t");
 		}
-		if (!finch)
-			fdc_command_execute(fd_buf + 0x0F00,
-					    fd_ptr - 0x0F01);
+		if (!board->finch)
+			fdc_command_execute(board->fd_buf + 0x0F00,
+					    board->fd_ptr - 0x0F01);
 		else
-			finch_command_execute(fd_buf + 0x0F00,
-					      fd_ptr - 0x0F01);
+			finch_command_execute(board->fd_buf + 0x0F00,
+					      board->fd_ptr - 0x0F01);
 		fprintf(stderr, "\n");
 	}
-	fd_bits = ST_Fout;
-	fd_dma = 0;
-	fd_status = 0;
+	board->fd_bits = ST_Fout;
+	board->fd_dma = 0;
+	board->fd_status = 0;
 }
 
 static void fdc_dma_out_done(void)
 {
-	fd_bits = ST_Fout;
-	fd_dma = 0;
+	board->fd_bits = ST_Fout;
+	board->fd_dma = 0;
 }
 
 static void fdc_write8(uint8_t data)
@@ -305,37 +438,37 @@ static void fdc_write8(uint8_t data)
 		break;
 	case 0x41:		/* used for reads */
 	case 0x43:		/* used for seek etc */
-		fd_bits = ST_Fin;	/* Fin not busy */
-		fd_ptr = 0x0F00;
-		fd_dma = 1;	/* Command in */
-		fd_status = 0x80;	/*?? */
+		board->fd_bits = ST_Fin;	/* Fin not busy */
+		board->fd_ptr = 0x0F00;
+		board->fd_dma = 1;	/* Command in */
+		board->fd_status = 0x80;	/*?? */
 		break;
 	case 0x44:		/* seems to be reading the command buffer back */
-		fd_bits = ST_Busy | ST_Fout;	/* busy */
-		fd_ptr = 0x0F00;
-		fd_dma = 2;
-		fd_status = 0x00;
+		board->fd_bits = ST_Busy | ST_Fout;	/* busy */
+		board->fd_ptr = 0x0F00;
+		board->fd_dma = 2;
+		board->fd_status = 0x00;
 		break;
 	case 0x45:		/* data follow up */
 		/* Should probably have ST_Busy set at this point ? */
 		/* 1 or 2 ?? */
-		fd_bits = ST_Fin | ST_Busy;	/* Should this be Fout or command based ? */
-		fd_ptr = 0;
-		fd_dma = 2;	/* Data out ? */
-		fd_status = 0x00;	/* Seems to want top bit for error */
+		board->fd_bits = ST_Fin | ST_Busy;	/* Should this be Fout or command based ? */
+		board->fd_ptr = 0;
+		board->fd_dma = 2;	/* Data out ? */
+		board->fd_status = 0x00;	/* Seems to want top bit for error */
 		/* Fake an error on track 5 */
-		if (fd_buf[0x0F02] == 0x83 && fd_buf[0x0F03] == 0x05)
-			fd_status = 0x80;
+		if (board->fd_buf[0x0F02] == 0x83 && board->fd_buf[0x0F03] == 0x05)
+			board->fd_status = 0x80;
 		break;
 	case 0x46:		/* load data into aux memory */
-		fd_bits = ST_Fin;
-		fd_ptr = 0;
-		fd_dma = 1;
+		board->fd_bits = ST_Fin;
+		board->fd_ptr = 0;
+		board->fd_dma = 1;
 		break;
 	case 0x47:		/* retrieve data from aux memory */
-		fd_bits = ST_Fout | ST_Busy;
-		fd_ptr = 0;
-		fd_dma = 2;
+		board->fd_bits = ST_Fout | ST_Busy;
+		board->fd_ptr = 0;
+		board->fd_dma = 2;
 		break;
 	default:
 		fprintf(stderr, "%04X: unknown fdc cmd %02X.\n", cpu6_pc(),
@@ -384,54 +517,48 @@ static void fdc_write8(uint8_t data)
  *	FF terminator (FF 00 ?)
  */
 
-static uint8_t cmdcmd[256];
-static unsigned cmd_ptr;
-static unsigned cmd_dma;
-static uint8_t cmd_status;
-static uint8_t cmd_bits;
-
 static void cmd_dma_cmd_in(uint8_t data)
 {
-	if (cmd_ptr == 256) {
+	if (board->cmd_ptr == 256) {
 		fprintf(stderr, "%04X: overlong cmdc command %02X\n", data,
 			cpu6_pc());
 		return;
 	}
-	cmdcmd[cmd_ptr++] = data;
+	board->cmdcmd[board->cmd_ptr++] = data;
 }
 
 static uint8_t cmd_dma_cmd_out(void)
 {
-	if (cmd_ptr == 256) {
+	if (board->cmd_ptr == 256) {
 		fprintf(stderr, "%04X: overlong cmdc command read\n",
 			cpu6_pc());
 		return 0xFF;
 	}
-	return cmdcmd[cmd_ptr++];
+	return board->cmdcmd[board->cmd_ptr++];
 }
 
 static void cmd_dma_cmd_done(void)
 {
 	unsigned i;
 	if (trace & TRACE_CMD) {
-		fprintf(stderr, "cmdcmd: %d\n\t", cmd_ptr);
-		for (i = 0; i < cmd_ptr; i++) {
-			fprintf(stderr, "%02X ", cmdcmd[i]);
-			if (((i & 15) == 15) && i != cmd_ptr - 1)
+		fprintf(stderr, "cmdcmd: %d\n\t", board->cmd_ptr);
+		for (i = 0; i < board->cmd_ptr; i++) {
+			fprintf(stderr, "%02X ", board->cmdcmd[i]);
+			if (((i & 15) == 15) && i != board->cmd_ptr - 1)
 				fprintf(stderr, "\n\t");
 		}
 		fprintf(stderr, "\n");
 	}
-	cmd_bits = ST_Fout;	/* fin */
-	cmd_dma = 0;
-	cmd_status = 0;
-	cmd_ptr = 0;
+	board->cmd_bits = ST_Fout;	/* fin */
+	board->cmd_dma = 0;
+	board->cmd_status = 0;
+	board->cmd_ptr = 0;
 }
 
 static void cmd_dma_cmd_out_done(void)
 {
-	cmd_bits = ST_Fout;	/* fin on */
-	cmd_dma = 0;
+	board->cmd_bits = ST_Fout;	/* fin on */
+	board->cmd_dma = 0;
 }
 
 /* Subtly different to the FDC or maybe the 41/43 divide is really the same
@@ -443,40 +570,40 @@ static void cmd_write8(uint8_t data)
 		fprintf(stderr, "cmd write %02X\n", data);
 	switch (data) {
 	case 0x00:		/* Mystery - reset state perhaps ? */
-		cmd_bits = ST_Fout;	/* Fout not busy is expected */
+		board->cmd_bits = ST_Fout;	/* Fout not busy is expected */
 		break;
 	case 0x01:		/* Used in the aux memory test */
 	case 0x0F:		/* Used in the aux memory test */
 	case 0x41:		/* 43 41 45 is sometimes a pattern. */
-		cmd_ptr = 0;
+		board->cmd_ptr = 0;
 		break;
 	case 0x43:		/* Run command ?? */
-		cmd_bits = ST_Fin;	/* Fout not busy */
-		cmd_ptr = 0;
-		cmd_dma = 1;	/* Command in */
-		cmd_status = 0x80;	/*?? */
+		board->cmd_bits = ST_Fin;	/* Fout not busy */
+		board->cmd_ptr = 0;
+		board->cmd_dma = 1;	/* Command in */
+		board->cmd_status = 0x80;	/*?? */
 		break;
 	case 0x44:		/* seems to be reading the command buffer back */
-		cmd_bits = ST_Busy | ST_Fout;	/* busy */
-		cmd_ptr = 0;
-		cmd_dma = 3;
-		cmd_status = 0x00;
+		board->cmd_bits = ST_Busy | ST_Fout;	/* busy */
+		board->cmd_ptr = 0;
+		board->cmd_dma = 3;
+		board->cmd_status = 0x00;
 		break;
 	case 0x45:		/* data follow up */
-		cmd_bits = ST_Fout;	/* ?? suspect this depends on the command */
-		cmd_ptr = 0;
-		cmd_dma = 2;	/* Data out ? */
-		cmd_status = 0x00;	/* Seems to want top bit for error */
+		board->cmd_bits = ST_Fout;	/* ?? suspect this depends on the command */
+		board->cmd_ptr = 0;
+		board->cmd_dma = 2;	/* Data out ? */
+		board->cmd_status = 0x00;	/* Seems to want top bit for error */
 		break;
 	case 0x46:		/* load data into aux memory */
-		fd_bits = ST_Fin;
-		fd_ptr = 0;
-		fd_dma = 1;
+		board->fd_bits = ST_Fin;
+		board->fd_ptr = 0;
+		board->fd_dma = 1;
 		break;
 	case 0x47:		/* retrieve data from aux memory */
-		fd_bits = ST_Fout | ST_Busy;
-		fd_ptr = 0;
-		fd_dma = 2;
+		board->fd_bits = ST_Fout | ST_Busy;
+		board->fd_ptr = 0;
+		board->fd_dma = 2;
 		break;
 	default:
 		fprintf(stderr, "%04X: unknown cmd cmd %02X.\n", cpu6_pc(),
@@ -489,31 +616,31 @@ static uint8_t io_read8(uint16_t addr)
 {
 	if (addr == 0xF800) {
 		if (trace & TRACE_FDC)
-			fprintf(stderr, "fd status %02X\n", fd_status);
-		return fd_status;
+			fprintf(stderr, "fd status %02X\n", board->fd_status);
+		return board->fd_status;
 	}
 	if (addr == 0xF801) {
 		if (trace & TRACE_FDC)
-			fprintf(stderr, "fd bits %02X\n", fd_bits);
-		return fd_bits;
+			fprintf(stderr, "fd bits %02X\n", board->fd_bits);
+		return board->fd_bits;
 	}
 	if (addr == 0xF808) {
 		if (trace & TRACE_CMD)
-			fprintf(stderr, "cmd status %02X\n", cmd_status);
-		return cmd_status;
+			fprintf(stderr, "cmd status %02X\n", board->cmd_status);
+		return board->cmd_status;
 	}
 	if (addr == 0xF809) {
 		if (trace & TRACE_CMD)
-			fprintf(stderr, "cmd bits %02X\n", cmd_bits);
-		return cmd_bits;
+			fprintf(stderr, "cmd bits %02X\n", board->cmd_bits);
+		return board->cmd_bits;
 	}
 	if (addr == 0xF110)
-		return switches;
+		return board->switches;
 	if (addr >= 0xF140 && addr <= 0xF14F)
 		return dsk_read(addr, trace & TRACE_DSK);
-	if (addr >= 0xF200 && addr <= 0xF21F)
+	if (addr >= 0xF200 && addr <= 0xF2FF)
 		return mux_read(addr, trace & TRACE_MUX);
-	fprintf(stderr, "%04X: Unknown I/O read %04X\n", cpu6_pc(), addr);
+	LOG_WARN_PC(TRACE_IO, "Unknown I/O read %04X", addr);
 	return 0;
 }
 
@@ -531,19 +658,18 @@ static void io_write8(uint16_t addr, uint8_t val)
 	} else if (addr >= 0xF140 && addr <= 0xF14F) {
 		dsk_write(addr, val, trace & TRACE_DSK);
 		return;
-	} else if (addr >= 0xF200 && addr <= 0xF21F) {
+	} else if (addr >= 0xF200 && addr <= 0xF2FF) {
 		mux_write(addr, val, trace & TRACE_MUX);
 		return;
 	} else
-		fprintf(stderr, "%04X: Unknown I/O write %04X %02X\n",
-			cpu6_pc(), addr, val);
+		LOG_WARN_PC(TRACE_IO, "Unknown I/O write %04X %02X", addr, val);
 }
 
 static uint32_t remap(uint32_t addr)
 {
 	addr &= 0x3FFFF;
 	/* We need to fix up the fact the 1K diag RAM appear twice */
-	if (diag && addr >= 0x0BC00 && addr <= 0x0BFFF)
+	if (board->diag && addr >= 0x0BC00 && addr <= 0x0BFFF)
 		addr -= 0x400;
 	return addr;
 }
@@ -558,16 +684,16 @@ static uint8_t do_mem_read8(uint32_t addr, int debug)
 		else
 			return io_read8(addr & 0xFFFF);
 	} else {
-		if (diag && addr >= 0x8000)
+		if (board->diag && addr >= 0x8000)
 			parity_off = 1;
 		addr = remap(addr);
 		if (addr >= 0x3F000)
 			parity_off = 1;
-		if (memclean[addr] || parity_off)
-			return mem[addr];
+		if (board->memclean[addr] || parity_off)
+			return board->mem[addr];
 		if (trace & TRACE_PARITY)
 			fprintf(stderr, "PARITY\n");
-		return mem[addr];
+		return board->mem[addr];
 	}
 }
 
@@ -576,7 +702,7 @@ uint8_t mem_read8(uint32_t addr)
 	// Extremely simple timing model where we assume each CPU memory
 	// access takes exactly 3 cycles (600ns), and the microcode is
 	// never doing things between memory accesses.
-	cpu_timestamp_ns += 600;
+	board->cpu_timestamp_ns += 600;
 
 	uint8_t r = do_mem_read8(addr, 0);
 	if (trace & TRACE_MEM_RD)
@@ -599,18 +725,19 @@ uint16_t mem_read16_debug(uint32_t addr)
 static void mem_do_write8(uint32_t addr, uint8_t val)
 {
 	addr = remap(addr);
-	memclean[addr] = 1;
-	mem[addr] = val;
+	board->memclean[addr] = 1;
+	board->mem[addr] = val;
+	board->mem_dirty[addr >> MEM_PAGE_SHIFT] = 1;
 }
 
 void mem_write8(uint32_t addr, uint8_t val)
 {
-	if (diag && addr >= 0x08000 && addr < 0x0B800) {
-		fprintf(stderr, "%04X: Write to ROM [%05X]\n", cpu6_pc(), addr);
+	if (board->diag && addr >= 0x08000 && addr < 0x0B800) {
+		LOG_WARN_PC(TRACE_MEM_WR, "Write to ROM [%05X]", addr);
 		return;
 	}
 	if (addr >= 0x3FC00) {
-		fprintf(stderr, "%04X: Write to ROM [%05X]\n", cpu6_pc(), addr);
+		LOG_WARN_PC(TRACE_MEM_WR, "Write to ROM [%05X]", addr);
 		return;
 	}
 	if (trace & TRACE_MEM_WR)
@@ -640,36 +767,495 @@ void mem_write16_debug(uint32_t addr, uint16_t val)
 }
 
 int64_t get_current_time() {
-	return cpu_timestamp_ns;
+	return board->cpu_timestamp_ns;
 }
 
 void advance_time(uint64_t nanoseconds) {
-	cpu_timestamp_ns += nanoseconds;
+	board->cpu_timestamp_ns += nanoseconds;
 }
 
 void halt_system(void)
 {
+	mux_flush();
+	log_flush();
+	diag_display_update(1);
 	printf("System halted at %04X\n", cpu6_pc());
-	emulator_done = 1;
+	stop_system();
 }
 
-static void load_rom(const char *name, uint32_t addr, uint16_t len)
+/* Stop this machine only, emulator_done stops everything */
+void stop_system(void)
+{
+	mux_flush();
+	diag_display_update(1);
+	board->stopped = 1;
+}
+
+/*
+ *	ROM images are read once per process and shared by every machine
+ *	that loads them.
+ */
+struct rom_image {
+	struct rom_image *next;
+	char *name;
+	uint8_t *data;
+	size_t len;
+};
+
+static struct rom_image *rom_images;
+static pthread_mutex_t rom_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct rom_image *rom_lookup(const char *name)
 {
-	FILE *fp = fopen(name, "rb");
+	struct rom_image *rom;
+	FILE *fp;
+	long len;
+
+	pthread_mutex_lock(&rom_lock);
+	for (rom = rom_images; rom != NULL; rom = rom->next)
+		if (strcmp(rom->name, name) == 0)
+			goto out;
+
+	fp = fopen(name, "rb");
 	if (fp == NULL) {
 		perror(name);
 		exit(1);
 	}
-	if (len == 0) {
-		fseek(fp, 0L, SEEK_END);
-		len = ftell(fp);
-		rewind(fp);
+	fseek(fp, 0L, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	rom = calloc(1, sizeof(*rom));
+	if (rom == NULL || (rom->data = malloc(len)) == NULL ||
+	    (rom->name = strdup(name)) == NULL) {
+		perror(name);
+		exit(1);
 	}
-	if (fread(mem + addr, len, 1, fp) != 1) {
+	rom->len = len;
+	if (len && fread(rom->data, len, 1, fp) != 1) {
 		fprintf(stderr, "%s: read error.\n", name);
 		exit(1);
 	}
 	fclose(fp);
+	rom->next = rom_images;
+	rom_images = rom;
+out:
+	pthread_mutex_unlock(&rom_lock);
+	return rom;
+}
+
+/*
+ *	The host pages of memory that hold ROM are mapped copy on write from
+ *	one unlinked file of page images, so every machine in the process
+ *	with the same ROMs at the same place shares a single copy. A machine
+ *	only gets its own copy of a page if it writes to it, which the CPU
+ *	can't do but the debugger can. A restored machine shares the pages
+ *	too, if some machine in the process has loaded the same ROMs.
+ */
+struct rom_page {
+	struct rom_page *next;
+	uint32_t addr;			/* Where it is in memory */
+	off_t offset;			/* and in rom_page_fd */
+	const uint8_t *data;		/* Read-only view of it */
+};
+
+static struct rom_page *rom_pages;
+static int rom_page_fd = -1;
+static off_t rom_page_end;
+
+/* Called with rom_lock held */
+static struct rom_page *rom_page_add(uint32_t addr, size_t size)
+{
+	struct rom_page *rp = calloc(1, sizeof(*rp));
+	FILE *fp;
+
+	if (rp == NULL)
+		return NULL;
+	if (rom_page_fd == -1) {
+		fp = tmpfile();
+		if (fp == NULL || (rom_page_fd = dup(fileno(fp))) == -1) {
+			free(rp);
+			return NULL;
+		}
+		fclose(fp);
+	}
+	rp->addr = addr;
+	rp->offset = rom_page_end;
+	if (pwrite(rom_page_fd, board->mem + addr, size, rp->offset) != size) {
+		free(rp);
+		return NULL;
+	}
+	rp->data = mmap(NULL, size, PROT_READ, MAP_SHARED, rom_page_fd, rp->offset);
+	if (rp->data == MAP_FAILED) {
+		free(rp);
+		return NULL;
+	}
+	rom_page_end += size;
+	rp->next = rom_pages;
+	rom_pages = rp;
+	return rp;
+}
+
+/* Called with rom_lock held. Anything that fails leaves the private copy. */
+static void rom_page_map(struct rom_page *rp, size_t size)
+{
+	if (mmap(board->mem + rp->addr, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_FIXED, rom_page_fd, rp->offset) == MAP_FAILED)
+		perror("rom_page_map");
+}
+
+/* Share the pages of [addr, addr + len), which have just had ROM loaded */
+static void share_rom_pages(uint32_t addr, uint32_t len)
+{
+	size_t size = sysconf(_SC_PAGESIZE);
+	uint32_t page;
+
+	pthread_mutex_lock(&rom_lock);
+	for (page = addr & ~(size - 1); page < addr + len; page += size) {
+		struct rom_page *rp;
+
+		for (rp = rom_pages; rp; rp = rp->next)
+			if (rp->addr == page && memcmp(rp->data, board->mem + page, size) == 0)
+				break;
+		if (rp == NULL)
+			rp = rom_page_add(page, size);
+		if (rp)
+			rom_page_map(rp, size);
+	}
+	pthread_mutex_unlock(&rom_lock);
+}
+
+/* After a restore: share whatever still matches a known ROM page */
+static void reshare_rom_pages(void)
+{
+	size_t size = sysconf(_SC_PAGESIZE);
+	struct rom_page *rp;
+
+	pthread_mutex_lock(&rom_lock);
+	for (rp = rom_pages; rp; rp = rp->next)
+		if (memcmp(rp->data, board->mem + rp->addr, size) == 0)
+			rom_page_map(rp, size);
+	pthread_mutex_unlock(&rom_lock);
+}
+
+void load_rom(const char *name, uint32_t addr, uint16_t len)
+{
+	const struct rom_image *rom = rom_lookup(name);
+
+	if (len == 0)
+		len = rom->len;
+	if (rom->len < len || addr + len > MEM_SIZE) {
+		fprintf(stderr, "%s: read error.\n", name);
+		exit(1);
+	}
+	memcpy(board->mem + addr, rom->data, len);
+	share_rom_pages(addr, len);
+}
+
+/* The bootstrap ROM, plus the diag card ROMs when it is fitted */
+void load_standard_roms(void)
+{
+	load_rom("bootstrap_unscrambled.bin", 0x3FC00, 0x0200);
+	if (board->diag) {
+		load_rom("Diag_F1_Rev_1.0.BIN", 0x08000, 0x0800);
+		load_rom("Diag_F2_Rev_1.0.BIN", 0x08800, 0x0800);
+		load_rom("Diag_F3_Rev_1.0.BIN", 0x09000, 0x0800);
+		load_rom("Diag_F4_1133CMD.BIN", 0x09800, 0x0800);
+	}
+}
+
+/* Load a program and set the machine up to enter it the way its loader would */
+void boot_program(const char *boot_file, unsigned binary, uint16_t load_addr,
+		  uint16_t entry_addr)
+{
+	if (boot_file != NULL) {
+		if (binary) {
+			if (load_addr == 0) {
+				fprintf(stderr, "raw binary needs a load address\n");
+				exit(1);
+			}
+			load_rom(boot_file, load_addr, 0);
+			if (entry_addr == 0) {
+				// by default, enter at first byte of binary
+				entry_addr = load_addr;
+			}
+			printf("Raw Binary %s loaded to %04hx; entry at %04hx\n\n",
+				boot_file, load_addr, entry_addr);
+		} else {
+			entry_addr = cbin_load(boot_file, load_addr);
+		}
+	}
+
+	if (entry_addr != 0) {
+		set_pc_debug(entry_addr);
+
+		if (binary) {
+			// Standard launch args from bootstrap ROM
+			regpair_write_debug(S, 0x1000);   // Stack
+		} else {
+			// Standard launch args from WIPL:
+			regpair_write_debug(S, 0xEA35);   // Stack
+			regpair_write_debug(Z, 0);        // Disk Number
+			regpair_write_debug(A, 0x00C5);   // AL= mux0 config?
+		}
+	}
+}
+
+void board_configure(unsigned diag, unsigned switches, unsigned finch)
+{
+	board->diag = diag;
+	board->switches = switches;
+	board->finch = finch;
+}
+
+unsigned board_stopped(void)
+{
+	return board->stopped;
+}
+
+/*
+ *	Snapshot support for the board itself: memory, the clock, and the
+ *	floppy and CMD controllers that live in this file.
+ *
+ *	A full snapshot stores all of memory. An incremental one stores only
+ *	the pages written since the previous checkpoint, as MEMP sections of
+ *	a page number followed by the page of mem and of memclean.
+ */
+struct board_snapshot {
+	int64_t cpu_timestamp_ns;
+	uint32_t hawk_dma;
+	uint32_t diag;
+	uint32_t finch;
+	uint32_t switches;
+	uint32_t hexblank;
+	uint32_t hexdots[4];
+	uint8_t hexdigits;
+	uint8_t fd_status;
+	uint8_t fd_bits;
+	uint8_t cmd_status;
+	uint8_t cmd_bits;
+	uint8_t pad[3];
+	uint32_t fd_ptr;
+	uint32_t fd_dma;
+	uint32_t cmd_ptr;
+	uint32_t cmd_dma;
+	uint8_t fd_buf[0x1000];
+	uint8_t cmdcmd[256];
+};
+
+struct mem_page_snapshot {
+	uint32_t page;
+	uint32_t pad;
+	uint8_t data[MEM_PAGE_SIZE];
+	uint8_t clean[MEM_PAGE_SIZE];
+};
+
+void board_save_state(struct snapshot *s)
+{
+	static struct board_snapshot bs;
+
+	memset(&bs, 0, sizeof(bs));
+	bs.cpu_timestamp_ns = board->cpu_timestamp_ns;
+	bs.hawk_dma = board->hawk_dma;
+	bs.diag = board->diag;
+	bs.finch = board->finch;
+	bs.switches = board->switches;
+	bs.hexblank = board->hexblank;
+	memcpy(bs.hexdots, board->hexdots, sizeof(board->hexdots));
+	bs.hexdigits = board->hexdigits;
+	bs.fd_status = board->fd_status;
+	bs.fd_bits = board->fd_bits;
+	bs.cmd_status = board->cmd_status;
+	bs.cmd_bits = board->cmd_bits;
+	bs.fd_ptr = board->fd_ptr;
+	bs.fd_dma = board->fd_dma;
+	bs.cmd_ptr = board->cmd_ptr;
+	bs.cmd_dma = board->cmd_dma;
+	memcpy(bs.fd_buf, board->fd_buf, sizeof(board->fd_buf));
+	memcpy(bs.cmdcmd, board->cmdcmd, sizeof(board->cmdcmd));
+	snapshot_write_section(s, "BRD ", &bs, sizeof(bs));
+
+	if (s->base == NULL) {
+		snapshot_write_section(s, "MEM ", board->mem, MEM_SIZE);
+		snapshot_write_section(s, "MEMC", board->memclean, sizeof(board->memclean));
+	} else {
+		static struct mem_page_snapshot page;
+		unsigned i;
+
+		for (i = 0; i < MEM_PAGES; i++) {
+			if (!board->mem_dirty[i])
+				continue;
+			page.page = i;
+			memcpy(page.data, board->mem + (i << MEM_PAGE_SHIFT), MEM_PAGE_SIZE);
+			memcpy(page.clean, board->memclean + (i << MEM_PAGE_SHIFT),
+			       MEM_PAGE_SIZE);
+			snapshot_write_section(s, "MEMP", &page, sizeof(page));
+		}
+	}
+}
+
+/* The checkpoint is safely on disk, the next one only needs what changes */
+void board_checkpoint_saved(void)
+{
+	memset(board->mem_dirty, 0, sizeof(board->mem_dirty));
+}
+
+int board_load_state(struct snapshot *s)
+{
+	static struct board_snapshot bs;
+
+	if (snapshot_read_section(s, "BRD ", &bs, sizeof(bs)))
+		return -1;
+	if (s->base == NULL) {
+		if (snapshot_read_section(s, "MEM ", board->mem, MEM_SIZE) ||
+		    snapshot_read_section(s, "MEMC", board->memclean, sizeof(board->memclean)))
+			return -1;
+	} else {
+		/* Applied on top of the base, which has already been loaded */
+		const struct mem_page_snapshot *page;
+		uint32_t len;
+		size_t pos = 0;
+
+		while ((page = snapshot_next_section(s, "MEMP", &len, &pos))) {
+			if (len != sizeof(*page) || page->page >= MEM_PAGES) {
+				fprintf(stderr, "%s: bad memory page\n", s->name);
+				return -1;
+			}
+			memcpy(board->mem + (page->page << MEM_PAGE_SHIFT), page->data,
+			       MEM_PAGE_SIZE);
+			memcpy(board->memclean + (page->page << MEM_PAGE_SHIFT),
+			       page->clean, MEM_PAGE_SIZE);
+		}
+	}
+	reshare_rom_pages();
+	/* Whatever was restored is the base for the next checkpoint */
+	memset(board->mem_dirty, 0, sizeof(board->mem_dirty));
+	board->cpu_timestamp_ns = bs.cpu_timestamp_ns;
+	board->hawk_dma = bs.hawk_dma;
+	board->diag = bs.diag;
+	board->finch = bs.finch;
+	board->switches = bs.switches;
+	board->hexblank = bs.hexblank;
+	memcpy(board->hexdots, bs.hexdots, sizeof(board->hexdots));
+	board->hexdigits = bs.hexdigits;
+	board->hexpending = 1;
+	board->fd_status = bs.fd_status;
+	board->fd_bits = bs.fd_bits;
+	board->cmd_status = bs.cmd_status;
+	board->cmd_bits = bs.cmd_bits;
+	board->fd_ptr = bs.fd_ptr;
+	board->fd_dma = bs.fd_dma;
+	board->cmd_ptr = bs.cmd_ptr;
+	board->cmd_dma = bs.cmd_dma;
+	memcpy(board->fd_buf, bs.fd_buf, sizeof(board->fd_buf));
+	memcpy(board->cmdcmd, bs.cmdcmd, sizeof(board->cmdcmd));
+	return 0;
+}
+
+/* One instruction on the current machine, with the DMA and devices it drives */
+void machine_step(void)
+{
+	cpu6_execute_one(trace & TRACE_CPU);
+	if (cpu6_halted())
+		halt_system();
+	/* Service DMA */
+	if (board->hawk_dma) {
+		while(dma_write_active()) {
+			// Advance time to next scheduler event
+			int64_t next = scheduler_next();
+			if (next == -1) {
+				/* Only this machine is broken */
+				LOG_ERROR(TRACE_DSK, "DMA stalled");
+				stop_system();
+				return;
+			}
+			if (next > board->cpu_timestamp_ns)
+				board->cpu_timestamp_ns = next;
+			run_scheduler(board->cpu_timestamp_ns, trace & TRACE_SCHEDULER);
+		}
+		hawk_dma_done();
+	}
+	/* Floppy controller command host to controller */
+	if (board->fd_dma == 1) {
+		if (dma_write_active())
+			fdc_dma_in(dma_write_cycle());
+		else
+			fdc_dma_in_done();
+	}
+	if (board->fd_dma == 2) {
+		if (dma_read_cycle(fdc_dma_out()))
+			fdc_dma_out_done();
+	}
+	if (board->cmd_dma == 1) {
+		if (dma_write_active())
+			cmd_dma_cmd_in(dma_write_cycle());
+		else
+			cmd_dma_cmd_done();
+	}
+	if (board->cmd_dma == 3) {
+		if (dma_read_cycle(cmd_dma_cmd_out()))
+			cmd_dma_cmd_out_done();
+	}
+	/* Update peripherals state */
+	mux_poll(trace & TRACE_MUX);
+
+	run_scheduler(board->cpu_timestamp_ns, trace & TRACE_SCHEDULER);
+}
+
+/*
+ *	Periodic checkpoints <file>.0, <file>.1, ... Every CHECKPOINT_FULL_EVERY
+ *	one is a full snapshot, the others only hold the pages written since
+ *	the previous one, which keeps restore chains short. After one fails
+ *	to save the next is full, as there is nothing to build on. Once a full
+ *	one is safely on disk the chain before it is deleted, so no more than
+ *	CHECKPOINT_FULL_EVERY files are kept.
+ */
+#define CHECKPOINT_FULL_EVERY	16
+
+static void write_checkpoint(const char *name, unsigned n)
+{
+	static unsigned failed;
+	static unsigned chain_start;
+	char path[4096], base[4096];
+	unsigned full = !(n % CHECKPOINT_FULL_EVERY) || failed;
+
+	snprintf(path, sizeof(path), "%s.%u", name, n);
+	snprintf(base, sizeof(base), "%s.%u", name, n - 1);
+	failed = snapshot_checkpoint(path, full ? NULL : base) != 0;
+	if (failed || !full)
+		return;
+	for (; chain_start < n; chain_start++) {
+		snprintf(base, sizeof(base), "%s.%u", name, chain_start);
+		unlink(base);
+	}
+}
+
+/* SIGUSR1 asks for a snapshot at the next instruction boundary */
+static volatile sig_atomic_t snapshot_requested;
+
+static void snapshot_signal(int sig)
+{
+	snapshot_requested = 1;
+}
+
+/* Append a one line, machine readable summary of the run to a file */
+static void write_run_report(const char *name, long long instructions,
+			     uint64_t host_ns)
+{
+	FILE *fp = fopen(name, "a");
+	if (fp == NULL) {
+		perror(name);
+		return;
+	}
+	if (host_ns == 0)
+		host_ns = 1;
+	fprintf(fp, "instructions=%lld emulated_ns=%lld host_ns=%llu "
+		"ips=%.0f emu_ratio=%.4f max_rss_kb=%ld\n",
+		instructions, (long long)board->cpu_timestamp_ns,
+		(unsigned long long)host_ns,
+		instructions * (ONE_SECOND_NS / host_ns),
+		(double)board->cpu_timestamp_ns / host_ns,
+		host_peak_rss_kb());
+	fclose(fp);
 }
 
 void usage(void)
@@ -680,16 +1266,35 @@ void usage(void)
 		"When supplied, bootfile will be loaded as centurion binary (default) OR raw binary\n"
 		"\n"
 		"Options:\n"
+		" -a <rate>    MUX rate: [<unit>:]<baud> or [<unit>:]unlimited\n"
 		" -b           bootfile is raw binary\n"
+		" -c <cards>   MUX cards fitted, a list of 4 and 8 (default 4)\n"
+		" -C <secs>    checkpoint every <secs> emulated seconds (needs -W)\n"
 		" -A <addr>    bootfile will be loaded at offset <addr>\n"
-		" -E <addr>    entry point for binary"
+		" -B <file>    append run statistics to <file> on exit\n"
+		" -E <addr>    entry point for binary\n"
+		" -k <path>    serve live statistics on Unix socket <path>\n"
 		" -d           emulate DIAG card\n"
+		" -D <where>   show the diag display: status (default), stdout, <file> or off\n"
+		" -f <file>    farm mode: run the test cases in <file> in parallel\n"
 		" -F           emulate a finch drive\n"
-		" -l <port>    Listen for telnet on the given <port> number\n"
+		" -H <file>    host every machine described in <file>, see readme\n"
+		" -l <port>    serve MUX unit n for telnet on <port> + n\n"
+		" -L <file>    restore the machine from snapshot <file> instead of booting\n"
+		" -M <mode>    speed: realtime, <multiplier>, catchup[:<ms>], warp[:<ms>]\n"
+		"              or unthrottled\n"
+		" -p           give every MUX unit but MUX0 a pseudo terminal\n"
+		" -P           print timing instrumentation to stderr on exit\n"
+		" -r <file>    replay MUX input recorded with -w, unthrottled\n"
 		" -s <value>   set CPU switches as a decimal value. Switch 1-4 are Sense\n"
 		" -S <value>   set diag switches as decimal value (only effective with `-d`)\n"
 		" -t <value>   enable enable system trace to stderr. See readme for values\n"
 		" -T <value>   Exit after executing <value> instructions\n"
+		" -U           run unthrottled (as fast as the host allows)\n"
+		" -v <level>   show messages up to error, warn (default), info or debug\n"
+		" -W <file>    write a snapshot to <file> on exit and on SIGUSR1\n"
+		" -w <file>    record all MUX input to <file>\n"
+		" -x <file>    drive the MUX from script <file> instead of a terminal\n"
 	);
 	exit(1);
 }
@@ -705,6 +1310,105 @@ uint16_t parse_address(char *arg, char* arg_name) {
 	return load_addr;
 }
 
+/*
+ *	-M realtime		emulated time follows the wall clock (default)
+ *	-M <n>			n emulated seconds per second
+ *	-M catchup[:<ms>]	real time, making up as much as <ms> (default
+ *				1000) of lag after a host stall
+ *	-M unthrottled		as fast as the host allows, like -U
+ *	-M warp[:<ms>]		real time, but unthrottled while a disk
+ *				command runs or the MUX has been quiet for
+ *				<ms> (default 500) of emulated time
+ *
+ *	Returns 1 for unthrottled.
+ */
+static int64_t warp_quiet_ns;
+
+static unsigned parse_speed(const char *arg)
+{
+	char *end;
+	double n;
+
+	if (strcmp(arg, "unthrottled") == 0)
+		return 1;
+	if (strncmp(arg, "warp", 4) == 0) {
+		n = 500;
+		end = "";
+		if (arg[4] == ':')
+			n = strtod(arg + 5, &end);
+		else if (arg[4])
+			usage();
+		if (*end || n <= 0)
+			usage();
+		warp_quiet_ns = n * ONE_MILISECOND_NS;
+		return 0;
+	}
+	warp_quiet_ns = 0;
+	if (strcmp(arg, "realtime") == 0)
+		return 0;
+	if (strncmp(arg, "catchup", 7) == 0) {
+		n = 1000;
+		end = "";
+		if (arg[7] == ':')
+			n = strtod(arg + 8, &end);
+		else if (arg[7])
+			usage();
+		if (*end || n < 0)
+			usage();
+		throttle_set_max_lag(n * ONE_MILISECOND_NS);
+		return 0;
+	}
+	n = strtod(arg, &end);
+	if (*end || n <= 0)
+		usage();
+	throttle_set_speed(n);
+	return 0;
+}
+
+/* Nobody would notice the machine running flat out */
+static unsigned warp_now(void)
+{
+	return dsk_busy() ||
+		board->cpu_timestamp_ns - mux_last_activity() >= warp_quiet_ns;
+}
+
+/* -a [<unit>:]<baud>|unlimited, every unit if none is given */
+static void parse_baud(const char *arg)
+{
+	const char *colon = strchr(arg, ':');
+	char *end;
+	long unit = -1, baud;
+
+	if (colon) {
+		unit = strtol(arg, &end, 10);
+		if (end != colon || unit < 0 || unit >= NUM_MUX_UNITS)
+			usage();
+		arg = colon + 1;
+	}
+	if (strcmp(arg, "unlimited") == 0)
+		baud = MUX_BAUD_UNLIMITED;
+	else {
+		baud = strtol(arg, &end, 10);
+		if (*end || baud <= 0)
+			usage();
+	}
+	mux_set_host_baud(unit, baud);
+}
+
+/* -v error, warn, info or debug, or the number of one */
+static unsigned parse_level(const char *arg)
+{
+	static const char *levels[] = { "error", "warn", "info", "debug" };
+	unsigned i;
+
+	for (i = 0; i < 4; i++)
+		if (strcmp(arg, levels[i]) == 0 ||
+		    (arg[0] == '0' + i && arg[1] == 0))
+			return i;
+	usage();
+	return 0;
+}
+
 /* attaches an external file to a mux */
 void extern_init(char* arg)
 {
@@ -734,7 +1438,7 @@ void extern_init(char* arg)
 			}
 		}
 
-		mux_attach(3, 1, fn, fn);
+		mux_attach(3, MUX_MODE_RAW, fn, fn);
 	} else {
 		printf("Failed to attach %s\n", arg);
 	}
@@ -745,15 +1449,39 @@ int main(int argc, char *argv[])
 	int opt;
 	unsigned binary = 0;
 	unsigned port = 0;
+	unsigned pty = 0;
+	unsigned unthrottled = 0;
+	unsigned verbosity = LOG_LEVEL_WARN;
+	char *report_file = NULL;
+	char *stats_socket = NULL;
+	char *restore_file = NULL;
+	char *snapshot_file = NULL;
+	char *farm_file = NULL;
+	char *host_file = NULL;
+	char *record_file = NULL;
+	char *replay_file = NULL;
+	char *script_file = NULL;
+	char *display = NULL;
+	int exit_code = -1;
+	int64_t checkpoint_ns = 0;
+	int64_t deadline_ns = 0;
+	int64_t next_checkpoint_ns = 0;
+	int64_t next_throttle_ns = 0;
+	int64_t next_display_ns = 0;
+	unsigned warping = 0;
+	unsigned checkpoint_count = 0;
+	unsigned instrumentation = 0;
+	uint64_t host_start_ns;
 	long long terminate_at = 0;
 	long long instruction_count = 0;
 	uint16_t load_addr = 0;
 	uint16_t entry_addr = 0;
 	char* boot_file = NULL;
 
+	machine_bind(machine_create());
 	mux_init();
 
-	while ((opt = getopt(argc, argv, "b::A:E:dFl:s:S:t:T:m:")) != -1) {
+	while ((opt = getopt(argc, argv, "a:b::A:B:c:C:D:E:df:FH:k:l:L:M:pPr:s:S:t:T:Uv:W:w:x:m:")) != -1) {
 		switch (opt) {
 		case 'b':
 			binary = 1;
@@ -761,25 +1489,58 @@ int main(int argc, char *argv[])
 		case 'A':
 			load_addr = parse_address(optarg, "Load");
 			break;
+		case 'B':
+			report_file = optarg;
+			break;
+		case 'C':
+			checkpoint_ns = atof(optarg) * ONE_SECOND_NS;
+			break;
+		case 'D':
+			display = optarg;
+			break;
 		case 'E':
 			entry_addr = parse_address(optarg, "Entry");
 			break;
 		case 'd':
-			diag = 1;
+			board->diag = 1;
+			break;
+		case 'f':
+			farm_file = optarg;
 			break;
 		case 'F':
-			finch = 1;
+			board->finch = 1;
+			break;
+		case 'H':
+			host_file = optarg;
+			break;
+		case 'k':
+			stats_socket = optarg;
 			break;
 		case 'l':
 			port = atoi(optarg);
 			break;
+		case 'L':
+			restore_file = optarg;
+			break;
+		case 'M':
+			unthrottled = parse_speed(optarg);
+			break;
+		case 'p':
+			pty = 1;
+			break;
+		case 'P':
+			instrumentation = 1;
+			break;
+		case 'r':
+			replay_file = optarg;
+			break;
 		case 's':
 			/* CPU switches */
 			cpu6_set_switches(atoi(optarg));
 			break;
 		case 'S':
 			/* Diag switches */
-			switches = atoi(optarg);
+			board->switches = atoi(optarg);
 			break;
 		case 't':
 			trace = atoi(optarg);
@@ -787,6 +1548,28 @@ int main(int argc, char *argv[])
 		case 'T':
 			terminate_at = atol(optarg);
 			break;
+		case 'U':
+			unthrottled = 1;
+			break;
+		case 'v':
+			verbosity = parse_level(optarg);
+			break;
+		case 'W':
+			snapshot_file = optarg;
+			break;
+		case 'w':
+			record_file = optarg;
+			break;
+		case 'x':
+			script_file = optarg;
+			break;
+		case 'a':
+			parse_baud(optarg);
+			break;
+		case 'c':
+			if (mux_configure(optarg))
+				exit(1);
+			break;
 		case 'm':
 			extern_init(optarg);
 			break;
@@ -800,110 +1583,166 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
-	if (port == 0)
+	log_init(verbosity, trace);
+
+	if (host_file) {
+		/* Every machine comes from the configuration file */
+		if (boot_file || farm_file || restore_file || port || pty ||
+		    record_file || replay_file || script_file)
+			usage();
+		return host_run(host_file, unthrottled);
+	}
+
+	/* Farm children would all share the one status line */
+	if (board_set_display(display ? display : farm_file ? "off" : "status"))
+		exit(1);
+
+	if (farm_file) {
+		/* Each farm child gets its own console. The children would
+		   all write the same snapshot files. */
+		if (port || pty || record_file || replay_file || script_file ||
+		    snapshot_file)
+			usage();
+	} else if (replay_file) {
+		/* Input only comes from the log, output still goes to stdout */
+		if (record_file || script_file || mux_replay(replay_file))
+			exit(1);
+		mux_attach(0, MUX_MODE_CONSOLE, -1, STDOUT_FILENO);
+		unthrottled = 1;
+	} else if (script_file) {
+		/* The script does the typing, no terminal needed */
+		if (port || script_load(script_file))
+			exit(1);
+		mux_attach(0, MUX_MODE_CONSOLE, -1, STDOUT_FILENO);
+	} else if (port == 0)
 		tty_init();
+	else if (pty)
+		/* Every unit is already somebody's */
+		usage();
 	else
 		net_init(port);
 
-	load_rom("bootstrap_unscrambled.bin", 0x3FC00, 0x0200);
-	if (diag) {
-		load_rom("Diag_F1_Rev_1.0.BIN", 0x08000, 0x0800);
-		load_rom("Diag_F2_Rev_1.0.BIN", 0x08800, 0x0800);
-		load_rom("Diag_F3_Rev_1.0.BIN", 0x09000, 0x0800);
-		load_rom("Diag_F4_1133CMD.BIN", 0x09800, 0x0800);
+	if (pty) {
+		unsigned unit;
+
+		/* Not the console, or a device from -m */
+		for (unit = 1; unit < mux_units(); unit++)
+			if (mux_get_in_fd(unit) == -1 && pty_attach(unit))
+				exit(1);
 	}
 
+	if (record_file && mux_record(record_file))
+		exit(1);
+
 	dsk_init();
-	cpu6_init();
 
-	if (boot_file != NULL) {
-		if (binary) {
-			if (load_addr == 0) {
-				fprintf(stderr, "raw binary needs a load address\n");
-				exit(1);
-			}
-			load_rom(boot_file, load_addr, 0);
-			if (entry_addr == 0) {
-				// by default, enter at first byte of binary
-				entry_addr = load_addr;
-			}
-			printf("Raw Binary %s loaded to %04hx; entry at %04hx\n\n",
-				boot_file, load_addr, entry_addr);
-		} else {
-			entry_addr = cbin_load(boot_file, load_addr);
-		}
+	if (restore_file != NULL) {
+		/* ROMs, RAM and CPU all come from the snapshot */
+		if (boot_file != NULL)
+			usage();
+		if (snapshot_load(restore_file))
+			exit(1);
+	} else {
+		load_standard_roms();
+		cpu6_init();
 	}
 
-	if (entry_addr != 0) {
-		set_pc_debug(entry_addr);
+	boot_program(boot_file, binary, load_addr, entry_addr);
 
-		if (binary) {
-			// Standard launch args from bootstrap ROM
-			regpair_write_debug(S, 0x1000);   // Stack
-		} else {
-			// Standard launch args from WIPL:
-			regpair_write_debug(S, 0xEA35);   // Stack
-			regpair_write_debug(Z, 0);        // Disk Number
-			regpair_write_debug(A, 0x00C5);   // AL= mux0 config?
-		}
+	if (farm_file) {
+		struct farm_case fc;
+		int exit_code;
+
+		if (!farm_run(farm_file, &fc, &exit_code))
+			return exit_code;
+		/* From here on, a child running one case */
+		board->switches = fc.switches;
+		if (fc.timeout_ns)
+			deadline_ns = board->cpu_timestamp_ns + fc.timeout_ns;
+		unthrottled = 1;
+		stats_socket = NULL;
+	}
+
+	stats_init();
+	if (stats_socket)
+		stats_listen(stats_socket);
+
+	if (snapshot_file)
+		signal(SIGUSR1, snapshot_signal);
+	if (checkpoint_ns) {
+		if (snapshot_file == NULL)
+			usage();
+		next_checkpoint_ns = board->cpu_timestamp_ns;
 	}
 
-	throttle_init();
-	throttle_set_speed(1.0);
-
-	while (!emulator_done) {
-		cpu6_execute_one(trace & TRACE_CPU);
-		if (cpu6_halted())
-			halt_system();
-		/* Service DMA */
-		if (hawk_dma) {
-			while(dma_write_active()) {
-				// Advance time to next scheduler event
-				int64_t next = scheduler_next();
-				if (next == -1) {
-					fprintf(stderr, "DMA stalled\n");
-					exit(-1);
-				}
-				if (next > cpu_timestamp_ns)
-					cpu_timestamp_ns = next;
-				run_scheduler(cpu_timestamp_ns, trace & TRACE_SCHEDULER);
+	throttle_init(board->cpu_timestamp_ns);
+	host_start_ns = monotonic_time_ns();
+
+	while (!emulator_done && !board->stopped) {
+		machine_step();
+		if (!unthrottled && board->cpu_timestamp_ns >= next_throttle_ns) {
+			if (warp_quiet_ns && warp_now()) {
+				warping = 1;
+				next_throttle_ns = board->cpu_timestamp_ns + THROTTLE_CHECK_NS;
+			} else {
+				/* Pace from here, not from before the warp */
+				if (warping)
+					throttle_init(board->cpu_timestamp_ns);
+				warping = 0;
+				next_throttle_ns = throttle_emulation(board->cpu_timestamp_ns);
 			}
-			hawk_dma_done();
-		}
-		/* Floppy controller command host to controller */
-		if (fd_dma == 1) {
-			if (dma_write_active())
-				fdc_dma_in(dma_write_cycle());
-			else
-				fdc_dma_in_done();
-		}
-		if (fd_dma == 2) {
-			if (dma_read_cycle(fdc_dma_out()))
-				fdc_dma_out_done();
+			STAT_SET(warping, warping);
 		}
-		if (cmd_dma == 1) {
-			if (dma_write_active())
-				cmd_dma_cmd_in(dma_write_cycle());
-			else
-				cmd_dma_cmd_done();
+		if (board->hexpending && board->cpu_timestamp_ns >= next_display_ns) {
+			/* Held back, and the guest may never write it again */
+			diag_display_update(0);
+			next_display_ns = board->cpu_timestamp_ns + THROTTLE_CHECK_NS;
 		}
-		if (cmd_dma == 3) {
-			if (dma_read_cycle(cmd_dma_cmd_out()))
-				cmd_dma_cmd_out_done();
-		}
-		/* Update peripherals state */
-		mux_poll(trace & TRACE_MUX);
-
-		run_scheduler(cpu_timestamp_ns, trace & TRACE_SCHEDULER);
-		throttle_emulation(cpu_timestamp_ns);
+		if (script_file && (exit_code = script_poll()) >= 0)
+			break;
 
 		instruction_count++;
+		STAT_SET(instructions, instruction_count);
+		STAT_SET(emulated_ns, board->cpu_timestamp_ns);
+		if (snapshot_requested) {
+			snapshot_requested = 0;
+			snapshot_save(snapshot_file);
+		}
+		if (checkpoint_ns && board->cpu_timestamp_ns >= next_checkpoint_ns) {
+			write_checkpoint(snapshot_file, checkpoint_count++);
+			next_checkpoint_ns += checkpoint_ns;
+		}
 		if (terminate_at && instruction_count >= terminate_at) {
+			mux_flush();
+			display_finish();
 			printf("\nTerminated after %lli instructions\n", instruction_count);
 			if (trace)
 				fprintf(stderr, "Terminated after %lli instructions\n", instruction_count);
 			break;
 		}
+		if (deadline_ns && board->cpu_timestamp_ns >= deadline_ns) {
+			/* A farm case that never finished */
+			mux_flush();
+			display_finish();
+			printf("\nTimed out after %lli instructions\n", instruction_count);
+			exit_code = FARM_TIMEOUT_EXIT;
+			break;
+		}
 	}
-	return 0;
+	mux_flush();
+	log_flush();
+	display_finish();
+	mux_record_end();
+	if (snapshot_file)
+		snapshot_save(snapshot_file);
+	if (instrumentation) {
+		scheduler_report(stderr);
+		cpu6_report(stderr);
+	}
+	if (report_file)
+		write_run_report(report_file, instruction_count,
+				 monotonic_time_ns() - host_start_ns);
+	if (script_file && exit_code < 0)
+		exit_code = script_result();
+	return exit_code < 0 ? 0 : exit_code;
 }
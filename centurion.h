@@ -1 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
 extern volatile unsigned int emulator_done;
+
+struct board_state;
+
+struct board_state *board_create(void);
+void board_destroy(struct board_state *b);
+void board_bind(struct board_state *b);
+void board_configure(unsigned diag, unsigned switches, unsigned finch);
+/* Where the diag display goes: stdout, status, off or a file */
+int board_set_display(const char *where);
+unsigned board_stopped(void);
+
+void load_rom(const char *name, uint32_t addr, uint16_t len);
+void load_standard_roms(void);
+void boot_program(const char *boot_file, unsigned binary, uint16_t load_addr,
+		  uint16_t entry_addr);
+
+void machine_step(void);
+void stop_system(void);
+/* Show the diag display if it changed, unless it was shown just now */
+void diag_display_update(unsigned force);
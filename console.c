@@ -1,19 +1,29 @@
+/* posix_openpt() and friends are XSI */
+#define _XOPEN_SOURCE 600
+
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termios.h>
 #include <unistd.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
 #include <time.h>
 
 #include "centurion.h"
 #include "console.h"
+#include "log.h"
 #include "mux.h"
 #include "scheduler.h"
+#include "stats.h"
 
 static struct termios saved_term, term;
 
@@ -46,41 +56,222 @@ void tty_init(void)
 		tcsetattr(0, TCSADRAIN, &term);
 	}
 
-        mux_attach(0, 0, STDIN_FILENO, STDOUT_FILENO);
+        mux_attach(0, MUX_MODE_CONSOLE, STDIN_FILENO, STDOUT_FILENO);
 }
 
-void net_init(unsigned short port)
+/*
+ *	Terminal server
+ *
+ *	Every MUX unit not already attached to something gets a listener on
+ *	port + unit. Clients are accepted whenever they turn up, from
+ *	mux_poll_fds(), and the unit behaves as a disconnected line while
+ *	nobody is there. A new client on a busy port replaces the old one.
+ */
+static unsigned short net_port;		/* 0 without a terminal server */
+static int listen_fd[NUM_MUX_UNITS];
+static int conn_fd[NUM_MUX_UNITS];
+
+static int net_listen(unsigned short port)
 {
 	struct sockaddr_in sin;
-        int sock_fd, io_fd;
+	int fd, on = 1;
 
-	sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sock_fd == -1) {
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1) {
 		perror("socket");
 		exit(1);
 	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
 	sin.sin_addr.s_addr = htonl(0x7F000001);
 	sin.sin_port = htons(port);
-	if (bind(sock_fd, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
-		perror("bind");
+	if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+		fprintf(stderr, "port %u: %s\n", port, strerror(errno));
 		exit(1);
 	}
-	/* TODO set reuseaddr */
-	listen(sock_fd, 1);
+	listen(fd, 1);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+static void net_accept(unsigned unit)
+{
+	int fd = accept(listen_fd[unit], NULL, NULL);
+
+	if (fd == -1)
+		return;
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	mux_attach(unit, MUX_MODE_REMOTE, fd, fd);
+	if (conn_fd[unit] != -1)
+		close(conn_fd[unit]);
+	conn_fd[unit] = fd;
+}
+
+/* Add the listener for unit to the select set */
+static int net_poll_set(unsigned unit, fd_set *i, int max_fd)
+{
+	/* The MUX lets go of a client that hung up */
+	if (conn_fd[unit] != -1 && mux_get_in_fd(unit) != conn_fd[unit]) {
+		close(conn_fd[unit]);
+		conn_fd[unit] = -1;
+	}
+	if (listen_fd[unit] == -1)
+		return max_fd;
+	FD_SET(listen_fd[unit], i);
+	return listen_fd[unit] >= max_fd ? listen_fd[unit] + 1 : max_fd;
+}
+
+void net_init(unsigned short port)
+{
+	int unit;
+
+	/* A client going away mustn't take the emulator with it */
+	signal(SIGPIPE, SIG_IGN);
 
-	printf("[Waiting terminal connection...]\n");
+	net_port = port;
+	for (unit = 0; unit < NUM_MUX_UNITS; unit++) {
+		listen_fd[unit] = -1;
+		conn_fd[unit] = -1;
+	}
+	for (unit = 0; unit < mux_units(); unit++) {
+		/* Already a file or device (-m) */
+		if (mux_get_in_fd(unit) != -1)
+			continue;
+		listen_fd[unit] = net_listen(port + unit);
+		mux_attach(unit, MUX_MODE_REMOTE, -1, -1);
+	}
+	printf("[MUX0-%u on ports %u-%u]\n", mux_units() - 1, port, port + mux_units() - 1);
 	fflush(stdout);
+}
+
+/*
+ *	Pseudo terminals
+ *
+ *	The unit gets the master side. The emulator keeps the slave open as
+ *	well, so that terminal programs can come and go on it without the
+ *	master ever seeing a hang-up, and output sent while nobody is there
+ *	waits in the pty until it fills up. Both are closed along with the
+ *	MUX.
+ */
+int pty_attach(unsigned unit)
+{
+	struct termios t;
+	int master, slave;
+	char *name = NULL;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1 || grantpt(master) || unlockpt(master) ||
+	    (name = ptsname(master)) == NULL) {
+		perror("pty");
+		if (master != -1)
+			close(master);
+		return -1;
+	}
+	slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave == -1) {
+		perror(name);
+		close(master);
+		return -1;
+	}
+	/* Raw, as cfmakeraw() would, which isn't XSI */
+	if (tcgetattr(slave, &t) == 0) {
+		t.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR |
+			       ICRNL | IXON);
+		t.c_oflag &= ~OPOST;
+		t.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+		t.c_cflag &= ~(CSIZE | PARENB);
+		t.c_cflag |= CS8;
+		tcsetattr(slave, TCSANOW, &t);
+	}
+	fcntl(master, F_SETFL, O_NONBLOCK);
+
+	mux_attach_pty(unit, master, slave);
+	printf("[MUX%u on %s]\n", unit, name);
+	fflush(stdout);
+	return 0;
+}
+
+/*
+ *	Statistics endpoint
+ *
+ *	A Unix domain socket served by its own thread. Each connection gets
+ *	a snapshot of the counters and is closed again, so something like
+ *	"nc -U <path>" is enough to watch a running emulator.
+ */
+static const char *stats_path;
+static const struct emu_stats *stats_source;
+
+static void stats_cleanup(void)
+{
+	unlink(stats_path);
+}
+
+static void *stats_thread(void *arg)
+{
+	int sock_fd = *(int *)arg;
+	char buf[8192];
 
-	io_fd = accept(sock_fd, NULL, NULL);
-	if (io_fd == -1) {
-		perror("accept");
+	while (1) {
+		int fd = accept(sock_fd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("stats accept");
+			return NULL;
+		}
+		size_t len = stats_format(stats_source, buf, sizeof(buf));
+		size_t done = 0;
+		/* A reader that has already gone mustn't SIGPIPE the emulator */
+		while (done < len) {
+			ssize_t r = send(fd, buf + done, len - done, MSG_NOSIGNAL);
+			if (r == -1) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EPIPE && errno != ECONNRESET)
+					perror("stats write");
+				break;
+			}
+			done += r;
+		}
+		close(fd);
+	}
+}
+
+void stats_listen(const char *path)
+{
+	static int sock_fd;
+	struct sockaddr_un sun;
+	pthread_t thread;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		exit(1);
+	}
+	sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock_fd == -1) {
+		perror("socket");
+		exit(1);
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	/* A stale socket from an earlier run would make bind fail */
+	unlink(path);
+	if (bind(sock_fd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+		perror(path);
 		exit(1);
 	}
-	close(sock_fd);
-	fcntl(io_fd, F_SETFL, FNDELAY);
+	listen(sock_fd, 4);
+	stats_path = path;
+	stats_source = stats;
+	atexit(stats_cleanup);
 
-        mux_attach(0, 0, io_fd, io_fd);
+	if (pthread_create(&thread, NULL, stats_thread, &sock_fd)) {
+		fprintf(stderr, "Failed to start statistics thread\n");
+		exit(1);
+	}
+	pthread_detach(thread);
 }
 
 static int select_wrapper(int maxfd, fd_set* i, fd_set* o)
@@ -103,12 +294,14 @@ void mux_poll_fds(unsigned trace)
 {
 	fd_set i;
 	int max_fd = 0;
+	uint64_t set;
 	int unit;
 
 	FD_ZERO(&i);
 
-	for (unit = 0; unit < NUM_MUX_UNITS; unit++) {
-		int ifd = mux_get_in_poll_fd(unit);
+	/* Only units attached to something have anything to look at */
+	for (set = mux_attached(); set; set &= set - 1) {
+		int ifd = mux_get_in_poll_fd(__builtin_ctzll(set));
 
 		if (ifd == -1)
 			continue;
@@ -116,20 +309,77 @@ void mux_poll_fds(unsigned trace)
 		if (ifd >= max_fd)
 			max_fd = ifd + 1;
 	}
+	if (net_port)
+		for (unit = 0; unit < mux_units(); unit++)
+			max_fd = net_poll_set(unit, &i, max_fd);
 
 	if (max_fd > 0) {
 	 	if (select_wrapper(max_fd, &i, NULL) == -1)
 			return;
 	}
 
-	for (unit = 0; unit < NUM_MUX_UNITS; unit++) {
-		int ifd = mux_get_in_fd(unit);
+	for (set = mux_attached(); set; set &= set - 1) {
+		int ifd = mux_get_in_fd(__builtin_ctzll(set));
 
-		if (ifd != -1 && FD_ISSET(ifd, &i))
-			mux_set_read_ready(unit, trace);
+		if (FD_ISSET(ifd, &i))
+			mux_set_read_ready(__builtin_ctzll(set), trace);
 	}
+	if (net_port)
+		for (unit = 0; unit < mux_units(); unit++)
+			if (listen_fd[unit] != -1 && FD_ISSET(listen_fd[unit], &i))
+				net_accept(unit);
 }
 
+/*
+ *	Write the buffered output of every unit, with one writev() for all
+ *	the units sharing an fd. Whatever a non-blocking fd doesn't take
+ *	stays buffered for next time.
+ */
+void mux_flush_fds(void)
+{
+	struct iovec iov[NUM_MUX_UNITS];
+	struct MuxUnit *who[NUM_MUX_UNITS];
+	uint64_t done = 0;
+	int unit, other, n, i;
+	ssize_t r, total;
+
+	for (unit = 0; unit < mux_units(); unit++) {
+		struct MuxUnit *u = mux_get_unit(unit);
+
+		if (u->tx_len == 0 || (done & (1ULL << unit)))
+			continue;
+		n = 0;
+		total = 0;
+		for (other = unit; other < mux_units(); other++) {
+			struct MuxUnit *o = mux_get_unit(other);
+
+			if (o->tx_len == 0 || o->out_fd != u->out_fd)
+				continue;
+			iov[n].iov_base = o->tx_buf;
+			iov[n].iov_len = o->tx_len;
+			who[n++] = o;
+			total += o->tx_len;
+			done |= 1ULL << other;
+		}
+
+		/* Keep the emulator's own messages in order */
+		if (u->out_fd == STDOUT_FILENO)
+			fflush(stdout);
+		r = writev(u->out_fd, iov, n);
+		/* Nothing more can go to an fd that is gone */
+		if (r == -1)
+			r = errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ?
+				0 : total;
+		for (i = 0; i < n; i++) {
+			unsigned len = who[i]->tx_len;
+			unsigned sent = r < len ? r : len;
+
+			memmove(who[i]->tx_buf, who[i]->tx_buf + sent, len - sent);
+			who[i]->tx_len -= sent;
+			r -= sent;
+		}
+	}
+}
 
 // Get's the current time from the OS (in nanoseconds)
 uint64_t monotonic_time_ns() {
@@ -138,34 +388,62 @@ uint64_t monotonic_time_ns() {
 	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
+// Peak resident set size of the emulator process (in kilobytes)
+long host_peak_rss_kb(void) {
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		return 0;
+	return ru.ru_maxrss;
+}
+
 
 static uint64_t throttle_start_time;
-static float throttle_speed;
+static uint64_t throttle_start_emulated;
+static float throttle_speed = 1.0;
+static int64_t throttle_max_lag = THROTTLE_MAX_LAG_NS;
 
-void throttle_init() {
+// start_time_ns is the emulated time to pace from, non zero after a
+// snapshot has been restored
+void throttle_init(uint64_t start_time_ns) {
 	throttle_start_time = monotonic_time_ns();
+	throttle_start_emulated = start_time_ns;
 }
 
 void throttle_set_speed(float speed) {
 	throttle_speed = speed;
 }
 
-// Stall emulation if running faster than realtime
-void throttle_emulation(uint64_t expected_time_ns) {
+void throttle_set_max_lag(int64_t lag_ns) {
+	throttle_max_lag = lag_ns;
+}
+
+// Stall emulation if running faster than realtime. Returns the emulated
+// time at which the clock is next worth looking at.
+uint64_t throttle_emulation(uint64_t expected_time_ns) {
 	uint64_t now = monotonic_time_ns();
-	uint64_t adjusted_target = expected_time_ns / throttle_speed;
+	uint64_t adjusted_target = (expected_time_ns - throttle_start_emulated) / throttle_speed;
 	int64_t delta_ns = (throttle_start_time + adjusted_target) - now;
 
+	STAT_SET(throttle_lag_ns, -delta_ns);
+
 	// We don't want to sleep if the delta is less than 5ms
 	if (delta_ns > (5 * ONE_MILISECOND_NS)) {
 		struct timespec delta;
+
+		// The guest is idle as far as the host can tell
+		mux_flush();
+		log_flush();
+
 		delta.tv_sec = delta_ns / 1000000000ULL;
 		delta.tv_nsec = delta_ns % 1000000000ULL;
 
 		// sometimes nanosecond returns early, so loop until it finishes
 		while (nanosleep(&delta, &delta));
-	} else if (delta_ns < -(50 * ONE_MILISECOND_NS)) {
-		// If have lagged by too much, we forgive the time
-		//throttle_start_time += delta_ns;
+	} else if (-delta_ns > throttle_max_lag) {
+		// If have lagged by too much, we forgive the time over the
+		// limit rather than sprint to make it all up
+		throttle_start_time += -delta_ns - throttle_max_lag;
 	}
+	return expected_time_ns + THROTTLE_CHECK_NS;
 }
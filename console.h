@@ -4,7 +4,19 @@
 
 void tty_init(void);
 void net_init(unsigned short port);
+/* Give unit a new pseudo terminal, and print the path to open */
+int pty_attach(unsigned unit);
+void stats_listen(const char *path);
 
-void throttle_emulation(uint64_t expected_time_ns);
-void throttle_init();
+uint64_t monotonic_time_ns();
+long host_peak_rss_kb(void);
+
+/* Emulated time between looks at the host clock */
+#define THROTTLE_CHECK_NS	100000
+/* Lag made up after a stall unless throttle_set_max_lag() says otherwise */
+#define THROTTLE_MAX_LAG_NS	50000000
+
+uint64_t throttle_emulation(uint64_t expected_time_ns);
+void throttle_init(uint64_t start_time_ns);
 void throttle_set_speed(float speed);
+void throttle_set_max_lag(int64_t lag_ns);
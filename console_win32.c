@@ -7,6 +7,8 @@
 #include <windows.h>
 
 #include "console.h"
+#include "farm.h"
+#include "host.h"
 #include "mux.h"
 
 static HANDLE hStdin, hStdout;
@@ -58,6 +60,18 @@ void net_init(unsigned short port)
         abort();
 }
 
+int pty_attach(unsigned unit)
+{
+        fprintf(stderr, "Pseudo terminals are not implemented on Win32\n");
+        abort();
+}
+
+void stats_listen(const char *path)
+{
+        fprintf(stderr, "Statistics socket is not implemented yet on Win32\n");
+        abort();
+}
+
 unsigned int tty_check_writable(int fd)
 {
         return 1;
@@ -96,7 +110,7 @@ void mux_poll_fds(unsigned trace)
 {
 	int unit;
 
-	for (unit = 0; unit < NUM_MUX_UNITS; unit++) {
+	for (unit = 0; unit < mux_units(); unit++) {
 		int ifd = mux_get_in_poll_fd(unit);
 
                 if (ifd != -1 && tty_check_readable(ifd))
@@ -104,15 +118,60 @@ void mux_poll_fds(unsigned trace)
 	}
 }
 
+void mux_flush_fds(void)
+{
+	int unit;
+
+	for (unit = 0; unit < mux_units(); unit++) {
+		struct MuxUnit *u = mux_get_unit(unit);
+
+		if (u->tx_len == 0)
+			continue;
+		if (u->out_fd == STDOUT_FILENO)
+			fflush(stdout);
+		write(u->out_fd, u->tx_buf, u->tx_len);
+		u->tx_len = 0;
+	}
+}
+
+uint64_t monotonic_time_ns() {
+        LARGE_INTEGER freq, count;
 
-void throttle_emulation(uint64_t expected_time_ns) {
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&count);
+        return (uint64_t)(count.QuadPart * (1000000000.0 / freq.QuadPart));
+}
+
+long host_peak_rss_kb(void) {
+        // Unimplemented
+        return 0;
+}
+
+uint64_t throttle_emulation(uint64_t expected_time_ns) {
         // Unimplemented
+        return expected_time_ns + THROTTLE_CHECK_NS;
 }
 
-void throttle_init() {
+void throttle_init(uint64_t start_time_ns) {
         // Unimplemented
 }
 
 void throttle_set_speed(float speed) {
         // Unimplemented
-}
\ No newline at end of file
+}
+
+void throttle_set_max_lag(int64_t lag_ns) {
+        // Unimplemented
+}
+
+int farm_run(const char *path, struct farm_case *c, int *exit_code) {
+        // Unimplemented, needs fork()
+        fprintf(stderr, "Farm mode is not supported on this platform\n");
+        exit(1);
+}
+
+int host_run(const char *config, unsigned unthrottled) {
+        // Unimplemented, needs poll() and sockets
+        fprintf(stderr, "Host mode is not supported on this platform\n");
+        exit(1);
+}
@@ -21,41 +21,82 @@
 #include <string.h>
 
 #include "cbin.h"
+#include "centurion.h"
 #include "cpu6.h"
 #include "disassemble.h"
+#include "log.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "stats.h"
 
-static uint8_t cpu_ipl = 0;	/* IPL 0-15 */
-static uint8_t cpu_mmu = 0;	/* MMU tag 0-7 */
-static uint16_t pc;
-static uint16_t exec_pc;	/* PC at instruction fetch */
-static uint8_t op;
-static uint8_t alu_out;
-static uint8_t switches = 0xF0;
-static uint8_t int_enable;
-static unsigned halted;
-static unsigned pending_ipl_mask = 0;
+/*
+ *	Everything the CPU card holds. There is one per machine, reached
+ *	through the thread's current machine (see machine.h).
+ */
+struct cpu6_state {
+	uint8_t cpu_ipl;	/* IPL 0-15 */
+	uint8_t cpu_mmu;	/* MMU tag 0-7 */
+	uint16_t pc;
+	uint16_t exec_pc;	/* PC at instruction fetch */
+	uint8_t op;
+	uint8_t alu_out;
+	uint8_t switches;
+	uint8_t int_enable;
+	unsigned halted;
+	unsigned pending_ipl_mask;
+
+	/* Interrupt timing instrumentation */
+	int64_t irq_asserted_ns[16];	/* When each pending IPL was raised */
+	struct histogram irq_latency[16];
+	int64_t di_ns;			/* When interrupts were disabled */
+	struct histogram di_time;
+
+	uint16_t dma_addr;
+	uint16_t dma_count;
+	uint8_t dma_mode;
+	uint8_t dma_enable;
+	uint8_t dma_mystery;	/* We don't know what this reg on the AM2901 is
+				   about */
+
+	/* SRAM on the CPU card */
+	uint8_t cpu_sram[256];
+	uint8_t mmu[8][32];
+
+	// Standing in for some internal microcode state
+	unsigned twobit_cached_reg;
+};
+
+static _Thread_local struct cpu6_state *cpu;
 
 #define BS1	0x01
 #define BS2	0x02
 #define BS3	0x04
 #define BS4	0x08
 
-static uint16_t dma_addr;
-static uint16_t dma_count;
-static uint8_t dma_mode;
-static uint8_t dma_enable;
-static uint8_t dma_mystery;	/* We don't know what this reg on the AM2901 is
-				   about */
+struct cpu6_state *cpu6_create(void)
+{
+	struct cpu6_state *s = calloc(1, sizeof(*s));
+
+	if (s == NULL) {
+		perror("cpu6_create");
+		exit(1);
+	}
+	s->switches = 0xF0;
+	s->di_ns = -1;
+	return s;
+}
 
-/* SRAM on the CPU card */
-static uint8_t cpu_sram[256];
-static uint8_t mmu[8][32];
+void cpu6_destroy(struct cpu6_state *s)
+{
+	free(s);
+}
 
-// Standing in for some internal microcode state
-static unsigned twobit_cached_reg = 0;
+void cpu6_bind(struct cpu6_state *s)
+{
+	cpu = s;
+}
 
 static void mmu_mem_write8(uint16_t addr, uint8_t val);
-static uint32_t mmu_map(uint16_t addr);
 static void logic_flags16(unsigned r);
 
 /*
@@ -64,23 +105,23 @@ static void logic_flags16(unsigned r);
 
 int dma_read_cycle(uint8_t byte)
 {
-	if (dma_enable == 0)
+	if (cpu->dma_enable == 0)
 		return 1;
 	/* DMA is done when it incs to 0 */
-	if (++dma_count == 0) {
-		dma_enable = 0;
+	if (++cpu->dma_count == 0) {
+		cpu->dma_enable = 0;
 		return 1;
 	}
-	if (dma_enable) {
+	if (cpu->dma_enable) {
 /*		fprintf(stderr, "%04X: DMA %04X <- %02X\n", dma_count, dma_addr, byte); */
-		mem_write8(dma_addr++, byte);
+		mem_write8(cpu->dma_addr++, byte);
 	}
 	return 0;
 }
 
 int dma_write_active(void)
 {
-	if (dma_enable == 1)
+	if (cpu->dma_enable == 1)
 		return 1;
 	return 0;
 }
@@ -88,31 +129,32 @@ int dma_write_active(void)
 uint8_t dma_write_cycle(void)
 {
 	uint8_t r;
-	if (dma_enable == 0) {
-		fprintf(stderr, "DMA write cycle with no DMA\n");
-		exit(1);
+	if (cpu->dma_enable == 0) {
+		LOG_ERROR(TRACE_CPU, "DMA write cycle with no DMA");
+		stop_system();
+		return 0;
 	}
-	r = mmu_mem_read8(dma_addr++);
-	dma_count++;
-	if (dma_count == 0)
-		dma_enable = 0;
+	r = mmu_mem_read8(cpu->dma_addr++);
+	cpu->dma_count++;
+	if (cpu->dma_count == 0)
+		cpu->dma_enable = 0;
 	return r;
 }
 
 uint16_t cpu6_dma_count(void) {
-	return ~dma_count;
+	return ~cpu->dma_count;
 }
 
 void cpu6_dma_write(uint8_t byte) {
 	/* DMA is done when it incs to 0 */
-	if (dma_enable == 0) {
+	if (cpu->dma_enable == 0) {
 		return;
 	}
-	if (dma_enable) {
-		mem_write8(dma_addr++, byte);
+	if (cpu->dma_enable) {
+		mem_write8(cpu->dma_addr++, byte);
 	}
-	if (++dma_count == 0xffff) {
-		dma_enable = 0;
+	if (++cpu->dma_count == 0xffff) {
+		cpu->dma_enable = 0;
 	}
 }
 
@@ -140,21 +182,21 @@ void cpu6_dma_write(uint8_t byte) {
 uint8_t mmu_mem_read8(uint16_t addr)
 {
 	if (addr < 0x0100)
-		return cpu_sram[addr];
+		return cpu->cpu_sram[addr];
 	return mem_read8(mmu_map(addr));
 }
 
 uint8_t mmu_mem_read8_debug(uint16_t addr)
 {
 	if (addr < 0x0100)
-		return cpu_sram[addr];
+		return cpu->cpu_sram[addr];
 	return mem_read8_debug(mmu_map(addr));
 }
 
 static void mmu_mem_write8(uint16_t addr, uint8_t val)
 {
 	if (addr < 0x0100)
-		cpu_sram[addr] = val;
+		cpu->cpu_sram[addr] = val;
 	else
 		mem_write8(mmu_map(addr), val);
 }
@@ -192,36 +234,36 @@ static void mmu_mem_write16(uint16_t addr, uint16_t val)
 uint8_t fetch(void)
 {
 	/* Do the pc++ after so that tracing is right */
-	uint8_t r = mmu_mem_read8(pc);
-	pc++;
+	uint8_t r = mmu_mem_read8(cpu->pc);
+	cpu->pc++;
 	return r;
 }
 
 uint16_t fetch16(void)
 {
 	uint16_t r;
-	r = mmu_mem_read8(pc) << 8;
-	pc++;
-	r |= mmu_mem_read8(pc);
-	pc++;
+	r = mmu_mem_read8(cpu->pc) << 8;
+	cpu->pc++;
+	r |= mmu_mem_read8(cpu->pc);
+	cpu->pc++;
 	return r;
 }
 
 uint16_t fetch_literal(unsigned length)
 {
-	uint16_t addr = pc;
-	pc += length;
+	uint16_t addr = cpu->pc;
+	cpu->pc += length;
 	return addr;
 }
 
 static uint8_t reg_read(uint8_t r)
 {
-	return mmu_mem_read8((cpu_ipl << 4) | r);
+	return mmu_mem_read8((cpu->cpu_ipl << 4) | r);
 }
 
 static void reg_write(uint8_t r, uint8_t v)
 {
-	mmu_mem_write8((cpu_ipl << 4) | r, v);
+	mmu_mem_write8((cpu->cpu_ipl << 4) | r, v);
 }
 
 /*
@@ -232,14 +274,14 @@ static void reg_write(uint8_t r, uint8_t v)
 
 static uint16_t regpair_addr(uint8_t r)
 {
-	return r + (cpu_ipl << 4);
+	return r + (cpu->cpu_ipl << 4);
 }
 
 static uint16_t regpair_read(uint8_t r)
 {
 	if (r > 15) {
 		fprintf(stderr, "Bad regpair encoding %02X %02X %04X\n",
-			op, r, exec_pc);
+			cpu->op, r, cpu->exec_pc);
 		exit(1);
 	}
 	return (reg_read((r | 1) ^ 1) << 8) | reg_read((r ^ 1));
@@ -248,8 +290,8 @@ static uint16_t regpair_read(uint8_t r)
 static void regpair_write(uint8_t r, uint16_t v)
 {
 	if (r > 15) {
-		fprintf(stderr, "Bad regpair encoding %02X %04X\n", op,
-			exec_pc);
+		fprintf(stderr, "Bad regpair encoding %02X %04X\n", cpu->op,
+			cpu->exec_pc);
 		exit(1);
 	}
 	reg_write((r | 1) ^ 1, v >> 8);
@@ -326,9 +368,9 @@ static uint16_t get_twobit(unsigned mode, unsigned idx, unsigned len) {
 		// This mode is complicated because it tries to merge two mode 2s into a single byte
 		if (idx == 1 && mode == 0xa) {
 			// previous twobit already fetched our regbyte
-			regs = twobit_cached_reg;
+			regs = cpu->twobit_cached_reg;
 		} else {
-			twobit_cached_reg = regs = fetch();
+			cpu->twobit_cached_reg = regs = fetch();
 		}
 		if (idx == 0)
 			regs >>= 4;
@@ -357,11 +399,11 @@ static uint16_t get_twobit(unsigned mode, unsigned idx, unsigned len) {
  *	microcode initializes the MMU for IPL0 at boot.
  */
 
-static uint32_t mmu_map(uint16_t addr)
+uint32_t mmu_map(uint16_t addr)
 {
 /*	fprintf(stderr, "MMU %X is [%X] -> %X\n", addr, addr >> 11,  (mmu[(addr >> 11)] << 11) |(addr & 0x7FF)); */
 	/* FIXME: add tag in to shift bank */
-	return (mmu[cpu_mmu][(addr >> 11)] << 11) + (addr & 0x07FF);
+	return (cpu->mmu[cpu->cpu_mmu][(addr >> 11)] << 11) + (addr & 0x07FF);
 }
 
 /*
@@ -402,7 +444,7 @@ static int mmu_transfer_op(void)
 		break;
 		default:
 			// microcode suggests these are illegal (will trap)
-			fprintf(stderr, "%04X: Illegal 2E op %02X\n", cpu6_pc(), op);
+			fprintf(stderr, "%04X: Illegal 2E op %02X\n", cpu6_pc(), cpu->op);
 			return 0;
 	}
 
@@ -415,13 +457,13 @@ static int mmu_transfer_op(void)
 	case 0x00:
 		while(len--) {
 			assert(base < 8 && offset < 0x20);
-			mmu[base][offset++] = mmu_mem_read8(addr++);
+			cpu->mmu[base][offset++] = mmu_mem_read8(addr++);
 		}
 		break;
 	case 0x10:
 		while(len--) {
 			assert(base < 8 && offset < 0x20);
-			val = mmu[base][offset++];
+			val = cpu->mmu[base][offset++];
 			mmu_mem_write8(addr++, val);
 
 			// We know this has some flag effects because 8130 relies upon it setting
@@ -461,7 +503,7 @@ static void cbin_load_segment(uint16_t sa, uint16_t load_offset, unsigned trace)
 	        	cpu6_pc(), sa, type, len, addr, load_offset);
 
         sa += 4;
-	alu_out &= ~ALU_L;
+	cpu->alu_out &= ~ALU_L;
 
         switch (type)
 	{
@@ -477,7 +519,7 @@ static void cbin_load_segment(uint16_t sa, uint16_t load_offset, unsigned trace)
             // Apply fixups
             if (len % 2 == 1){
                 fprintf(stderr, "%04X: loadseg: FIXUPS record must have even length; have %u\n", cpu6_pc(), len);
-                alu_out |= ALU_F;
+                cpu->alu_out |= ALU_F;
             } else {
                 uint16_t offset = load_offset + addr;
 
@@ -493,7 +535,7 @@ static void cbin_load_segment(uint16_t sa, uint16_t load_offset, unsigned trace)
             break;
         default:
             fprintf(stderr, "%04X: unknown cbin segment type %02x\n", cpu6_pc(), type);
-            alu_out |= ALU_F;
+            cpu->alu_out |= ALU_F;
 	}
 
 	checksum = 0x0100 - checksum;
@@ -501,7 +543,7 @@ static void cbin_load_segment(uint16_t sa, uint16_t load_offset, unsigned trace)
 	if (checksum != expected) {
 		fprintf(stderr, "%04X: loadseg checksum error: %08X vs %08X\n",
 		        cpu6_pc(), checksum, expected);
-		alu_out |= ALU_F;
+		cpu->alu_out |= ALU_F;
 	}
 
 	// According to sjsoftware, this instruction always provides these values
@@ -533,7 +575,7 @@ static int block_op(int inst, unsigned trace)
 	uint8_t chr;
 
 	// clear the fault flag
-	alu_out &= ~ALU_F;
+	cpu->alu_out &= ~ALU_F;
 
 	// memset only reads the source once
 	if ((op & 0xF0) == 0x90)
@@ -545,7 +587,7 @@ static int block_op(int inst, unsigned trace)
 			chr = fetch();
 		} else {
 			// This gets it's chr from somewhere else. Probally a register?
-			fprintf(stderr, "Unsupported 67 2x memchr at %x\n", exec_pc);
+			fprintf(stderr, "Unsupported 67 2x memchr at %x\n", cpu->exec_pc);
 			exit(-1);
 		}
 	}
@@ -577,7 +619,7 @@ static int block_op(int inst, unsigned trace)
 			da++;
 		};
 		// No match
-		alu_out |= ALU_F;
+		cpu->alu_out |= ALU_F;
 		return 0;
 	case 0x40:
 		while(dst_len--) {
@@ -599,11 +641,11 @@ static int block_op(int inst, unsigned trace)
 		};
 		return 0;
 	case 0x80:
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 		while (dst_len--) {
 			if(mmu_mem_read8(da++) !=
 				mmu_mem_read8(sa++)) {
-				alu_out &= ~ALU_V;
+				cpu->alu_out &= ~ALU_V;
 				break;
 			}
 		}
@@ -646,7 +688,7 @@ static int bignum_sub(int a_len, int b_len, uint64_t a_addr, uint16_t b_addr, in
 	// b = a - b
 	if (a_len > b_len) {
 		// No idea what it should do here. Trap? overflow and set the FAULT flag?
-		fprintf(stderr, "unsupported SUBBIG at %04X\n", exec_pc);
+		fprintf(stderr, "unsupported SUBBIG at %04X\n", cpu->exec_pc);
 		exit(-1);
 	}
 
@@ -690,9 +732,9 @@ static int bignum_sub(int a_len, int b_len, uint64_t a_addr, uint16_t b_addr, in
 	//fprintf(stderr, "%s %lx - %lx == %lx\n", write_back ? "SUBBIG" : "CMPBIG", b_big, a_big, result_big);
 
 	sub_flags(result | zero_acc, a_val, b_val);
-	alu_out &= ~ALU_L;
+	cpu->alu_out &= ~ALU_L;
 	if (borrow == 0)
-		alu_out |= ALU_L;
+		cpu->alu_out |= ALU_L;
 
 	return 0;
 }
@@ -753,11 +795,11 @@ static int bignum_op(void) {
 		// I'm kind of guessing here, but it seems to do this?
 		unsigned actual_width = strlen(buffer);
 		if (actual_width > dest_width) {
-			alu_out = ALU_F;
+			cpu->alu_out = ALU_F;
 			return 0;
 		}
 
-		alu_out = 0;
+		cpu->alu_out = 0;
 
 		for (int i=0; i<actual_width; i++) {
 			mmu_mem_write8(dst_addr+i, buffer[i] | 0x80);
@@ -792,16 +834,16 @@ static int bignum_op(void) {
 		uint64_t result = strtol(buffer, &end_ptr, a_size + 1);
 
 		if (end_ptr == NULL) {
-			alu_out = ALU_F;
+			cpu->alu_out = ALU_F;
 			return 0;
 		}
-		alu_out = 0;
+		cpu->alu_out = 0;
 
 		// Guessing that this might set some flags?
 		if (result == 0)
-			alu_out |= ALU_V;
+			cpu->alu_out |= ALU_V;
 		if (((int64_t)result) < 0)
-			alu_out |= ALU_M;
+			cpu->alu_out |= ALU_M;
 
 		for (int i = b_size-1; i >= 0; i--) {
 			mmu_mem_write8(dst_addr + i, result & 0xff);
@@ -833,11 +875,11 @@ static int bignum_op(void) {
  */
 static void ldflags(unsigned r)
 {
-	alu_out &= ~(ALU_M | ALU_V);
+	cpu->alu_out &= ~(ALU_M | ALU_V);
 	if (r & 0x80)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 	if ((r & 0xFF) == 0)
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 }
 
 /*
@@ -852,21 +894,21 @@ static void ldflags(unsigned r)
  */
 static void arith_flags(unsigned r, uint8_t a, uint8_t b)
 {
-	alu_out &= ~(ALU_F | ALU_M | ALU_V);
+	cpu->alu_out &= ~(ALU_F | ALU_M | ALU_V);
 	if ((r & 0xFF) == 0)
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 	if (r & 0x80)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 /*	if ((r ^ d) & 0x80)
 		alu_out |= ALU_F; */
 
 	/* Overflow for addition is (!r & x & m) | (r & !x & !m) */
 	if (r & 0x80) {
 		if (!((a | b) & 0x80))
-			alu_out |= ALU_F;
+			cpu->alu_out |= ALU_F;
 	} else {
 		if (a & b & 0x80)
-			alu_out |= ALU_F;
+			cpu->alu_out |= ALU_F;
 	}
 }
 
@@ -876,17 +918,17 @@ static void arith_flags(unsigned r, uint8_t a, uint8_t b)
  */
 static void sub_flags(uint8_t r, uint8_t a, uint8_t b)
 {
-	alu_out &= ~(ALU_F | ALU_M | ALU_V);
+	cpu->alu_out &= ~(ALU_F | ALU_M | ALU_V);
 	if ((r & 0xFF) == 0)
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 	if (r & 0x80)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 	if (a & 0x80) {
 		if (!((b | r) & 0x80))
-        		alu_out |= ALU_F;;
+        		cpu->alu_out |= ALU_F;;
        	} else {
        		if (b & r & 0x80)
-       			alu_out |= ALU_F;;
+       			cpu->alu_out |= ALU_F;;
 	}
 }
 
@@ -898,11 +940,11 @@ static void sub_flags(uint8_t r, uint8_t a, uint8_t b)
  */
 static void logic_flags(unsigned r)
 {
-	alu_out &= ~(ALU_M | ALU_V);
+	cpu->alu_out &= ~(ALU_M | ALU_V);
 	if (r & 0x80)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 	if (!(r & 0xFF))
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 }
 
 /*
@@ -915,13 +957,13 @@ static void logic_flags(unsigned r)
  */
 static void shift_flags(unsigned c, unsigned r)
 {
-	alu_out &= ~(ALU_L | ALU_M | ALU_V);
+	cpu->alu_out &= ~(ALU_L | ALU_M | ALU_V);
 	if ((r & 0xFF) == 0)
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 	if (c)
-		alu_out |= ALU_L;
+		cpu->alu_out |= ALU_L;
 	if (r & 0x80)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 }
 
 /*
@@ -932,11 +974,11 @@ static void shift_flags(unsigned c, unsigned r)
  */
 static void ldflags16(unsigned r)
 {
-	alu_out &= ~(ALU_M | ALU_V);
+	cpu->alu_out &= ~(ALU_M | ALU_V);
 	if (r & 0x8000)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 	if ((r & 0xFFFF) == 0)
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 }
 
 /*
@@ -951,11 +993,11 @@ static void ldflags16(unsigned r)
  */
 static void arith_flags16(unsigned r, uint16_t a, uint16_t b)
 {
-	alu_out &= ~(ALU_F | ALU_M | ALU_V);
+	cpu->alu_out &= ~(ALU_F | ALU_M | ALU_V);
 	if ((r & 0xFFFF) == 0)
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 	if (r & 0x8000)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 	/* If the result is negative but both inputs were positive then
 	   we overflowed */
 /* 	if ((r ^ d) & 0x8000)
@@ -963,10 +1005,10 @@ static void arith_flags16(unsigned r, uint16_t a, uint16_t b)
 	/* Overflow for addition is (!r & x & m) | (r & !x & !m) */
 	if (r & 0x8000) {
 		if (!((a | b) & 0x8000))
-			alu_out |= ALU_F;
+			cpu->alu_out |= ALU_F;
 	} else {
 		if (a & b & 0x8000)
-			alu_out |= ALU_F;
+			cpu->alu_out |= ALU_F;
 	}
 }
 
@@ -976,17 +1018,17 @@ static void arith_flags16(unsigned r, uint16_t a, uint16_t b)
  */
 static void sub_flags16(uint16_t r, uint16_t a, uint16_t b)
 {
-	alu_out &= ~(ALU_F | ALU_M | ALU_V);
+	cpu->alu_out &= ~(ALU_F | ALU_M | ALU_V);
 	if ((r & 0xFFFF) == 0)
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 	if (r & 0x8000)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 	if (a & 0x8000) {
 		if (!((b | r) & 0x8000))
-        		alu_out |= ALU_F;;
+        		cpu->alu_out |= ALU_F;;
        	} else {
        		if (b & r & 0x8000)
-       			alu_out |= ALU_F;;
+       			cpu->alu_out |= ALU_F;;
 	}
 }
 
@@ -998,11 +1040,11 @@ static void sub_flags16(uint16_t r, uint16_t a, uint16_t b)
  */
 static void logic_flags16(unsigned r)
 {
-	alu_out &= ~(ALU_M | ALU_V);
+	cpu->alu_out &= ~(ALU_M | ALU_V);
 	if (r & 0x8000)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 	if (!(r & 0xFFFF))
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 }
 
 /*
@@ -1015,13 +1057,13 @@ static void logic_flags16(unsigned r)
  */
 static void shift_flags16(unsigned c, unsigned r)
 {
-	alu_out &= ~(ALU_L | ALU_M | ALU_V);
+	cpu->alu_out &= ~(ALU_L | ALU_M | ALU_V);
 	if ((r & 0xFFFF) == 0)
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 	if (c)
-		alu_out |= ALU_L;
+		cpu->alu_out |= ALU_L;
 	if (r & 0x8000)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 }
 
 
@@ -1046,23 +1088,23 @@ static int dec(unsigned reg, unsigned val)
 {
 	uint8_t r = reg_read(reg) - val;
 	reg_write(reg, r);
-	alu_out &= ~(ALU_L | ALU_V | ALU_M | ALU_F);
+	cpu->alu_out &= ~(ALU_L | ALU_V | ALU_M | ALU_F);
 	if (r == 0)
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 	if (r & 0x80)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 	return 0;
 }
 
 static int clr(unsigned reg, unsigned v)
 {
 	reg_write(reg, v);
-	alu_out &= ~(ALU_F | ALU_L | ALU_M);
+	cpu->alu_out &= ~(ALU_F | ALU_L | ALU_M);
 	if (v == 0)
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 	else
 		/* Gets us past the tests but is probably wrong */
-		alu_out ^= ALU_V;
+		cpu->alu_out ^= ALU_V;
 	return 0;
 }
 
@@ -1107,12 +1149,12 @@ static int sll(unsigned reg, unsigned count)
 	while (count--) {
 		v = r << 1;
 		shift_flags((r & 0x80), v);
-		alu_out &= ~ALU_F;
+		cpu->alu_out &= ~ALU_F;
 		/* So annoying C lacks a ^^ operator */
-		switch (alu_out & (ALU_L | ALU_M)) {
+		switch (cpu->alu_out & (ALU_L | ALU_M)) {
 		case ALU_L:
 		case ALU_M:
-			alu_out |= ALU_F;
+			cpu->alu_out |= ALU_F;
 			break;
 		}
 		r = v;
@@ -1133,7 +1175,7 @@ static int rrc(unsigned reg, unsigned count)
 		c = r & 1;
 
 		r >>= 1;
-		r |= (alu_out & ALU_L) ? 0x80 : 0;
+		r |= (cpu->alu_out & ALU_L) ? 0x80 : 0;
 
 		shift_flags(c, r);
 	}
@@ -1150,15 +1192,15 @@ static int rlc(unsigned reg, unsigned count)
 	while (count--) {
 		c = r & 0x80;
 		r <<= 1;
-		r |= (alu_out & ALU_L) ? 1 : 0;
+		r |= (cpu->alu_out & ALU_L) ? 1 : 0;
 
 		shift_flags(c, r);
-		alu_out &= ~ALU_F;
+		cpu->alu_out &= ~ALU_F;
 		/* So annoying C lacks a ^^ operator */
-		switch (alu_out & (ALU_L | ALU_M)) {
+		switch (cpu->alu_out & (ALU_L | ALU_M)) {
 		case ALU_L:
 		case ALU_M:
-			alu_out |= ALU_F;
+			cpu->alu_out |= ALU_F;
 			break;
 		}
 	}
@@ -1175,9 +1217,9 @@ static int add(unsigned dst, unsigned src)
 	uint16_t s = reg_read(src);
 	reg_write(dst, d + s);
 	arith_flags(d + s, d, s);
-	alu_out &= ~ALU_L;
+	cpu->alu_out &= ~ALU_L;
 	if ((s + d) & 0x100)
-		alu_out |= ALU_L;
+		cpu->alu_out |= ALU_L;
 	return 0;
 }
 
@@ -1191,9 +1233,9 @@ static int sub(unsigned dst, unsigned src)
 	unsigned r =  s - d;
 	reg_write(dst, r);
 	sub_flags(r, s, d);
-	alu_out &= ~ALU_L;
+	cpu->alu_out &= ~ALU_L;
 	if (d <= s)
-		alu_out |= ALU_L;
+		cpu->alu_out |= ALU_L;
 	return 0;
 }
 
@@ -1244,20 +1286,20 @@ static uint16_t inc16(uint16_t a, uint16_t imm)
 static uint16_t dec16(uint16_t a, uint16_t imm)
 {
 	uint16_t r = a - imm;
-	alu_out &= ~(ALU_L | ALU_V | ALU_M | ALU_F);
+	cpu->alu_out &= ~(ALU_L | ALU_V | ALU_M | ALU_F);
 	if ((r & 0xFFFF) == 0)
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 	if (r & 0x8000)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 	return r;
 }
 
 /* Assume behaviour matches CLR */
 static uint16_t clr16(uint16_t a, uint16_t imm)
 {
-	alu_out &= ~(ALU_F | ALU_L | ALU_M);
+	cpu->alu_out &= ~(ALU_F | ALU_L | ALU_M);
 /*	if (imm == 0) */
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 	return imm;
 }
 
@@ -1291,12 +1333,12 @@ static uint16_t sll16(uint16_t a, uint16_t count)
 	while (count--) {
 		v = r << 1;
 		shift_flags16((r & 0x8000), v);
-		alu_out &= ~ALU_F;
+		cpu->alu_out &= ~ALU_F;
 		/* So annoying C lacks a ^^ operator */
-		switch (alu_out & (ALU_L | ALU_M)) {
+		switch (cpu->alu_out & (ALU_L | ALU_M)) {
 		case ALU_L:
 		case ALU_M:
-			alu_out |= ALU_F;
+			cpu->alu_out |= ALU_F;
 			break;
 		}
 		r = v;
@@ -1313,7 +1355,7 @@ static uint16_t rrc16(uint16_t a, uint16_t count)
 		c = r & 1;
 
 		r >>= 1;
-		r |= (alu_out & ALU_L) ? 0x8000 : 0;
+		r |= (cpu->alu_out & ALU_L) ? 0x8000 : 0;
 
 		shift_flags16(c, r);
 	}
@@ -1329,15 +1371,15 @@ static uint16_t rlc16(uint16_t a, uint16_t count)
 		c = r & 0x8000;
 
 		r <<= 1;
-		r |= (alu_out & ALU_L) ? 1 : 0;
+		r |= (cpu->alu_out & ALU_L) ? 1 : 0;
 
 		shift_flags16(c, r);
-		alu_out &= ~ALU_F;
+		cpu->alu_out &= ~ALU_F;
 		/* So annoying C lacks a ^^ operator */
-		switch (alu_out & (ALU_L | ALU_M)) {
+		switch (cpu->alu_out & (ALU_L | ALU_M)) {
 		case ALU_L:
 		case ALU_M:
-			alu_out |= ALU_F;
+			cpu->alu_out |= ALU_F;
 			break;
 		}
 	}
@@ -1353,13 +1395,13 @@ static int mul16(unsigned dsta, unsigned a, unsigned b)
 	mmu_mem_write16(dsta, r & 0xffff);
 
 	// These flags are a total guess
-	alu_out &= ~(ALU_F | ALU_M | ALU_V);
+	cpu->alu_out &= ~(ALU_F | ALU_M | ALU_V);
 	if (sign)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 	if ((r & 0xffff) == 0)
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 	if (sign != expected_sign || r > 0xffff)
-		alu_out |= ALU_F;
+		cpu->alu_out |= ALU_F;
 
 	return 0;
 }
@@ -1373,13 +1415,13 @@ static int div16(unsigned dsta, unsigned a, unsigned b)
 	mmu_mem_write16(dsta, r & 0xffff);
 
 	// These flags are a total guess
-	alu_out &= ~(ALU_F | ALU_M | ALU_V);
+	cpu->alu_out &= ~(ALU_F | ALU_M | ALU_V);
 	if (sign)
-		alu_out |= ALU_M;
+		cpu->alu_out |= ALU_M;
 	if ((r & 0xffff) == 0)
-		alu_out |= ALU_V;
+		cpu->alu_out |= ALU_V;
 	if (sign != expected_sign || r > 0xffff)
-		alu_out |= ALU_F;
+		cpu->alu_out |= ALU_F;
 
 	return 0;
 }
@@ -1388,9 +1430,9 @@ static int add16(unsigned dsta, unsigned a, unsigned b)
 {
 	mmu_mem_write16(dsta, a + b);
 	arith_flags16(a + b, a, b);
-	alu_out &= ~ALU_L;
+	cpu->alu_out &= ~ALU_L;
 	if ((b + a) & 0x10000)
-		alu_out |= ALU_L;
+		cpu->alu_out |= ALU_L;
 	return 0;
 }
 
@@ -1399,9 +1441,9 @@ static int sub16(unsigned dsta, unsigned a, unsigned b)
 	unsigned r = b - a;
 	mmu_mem_write16(dsta, r);
 	sub_flags16(r, b, a);
-	alu_out &= ~ALU_L;
+	cpu->alu_out &= ~ALU_L;
 	if (a <= b)
-		alu_out |= ALU_L;
+		cpu->alu_out |= ALU_L;
 	return 0;
 }
 
@@ -1467,7 +1509,7 @@ static uint16_t indexed_address(unsigned size)
 		break;
 	default:
 		fprintf(stderr, "Unknown indexing mode %02X at %04X\n",
-			idx, exec_pc);
+			idx, cpu->exec_pc);
 		exit(1);
 	}
 	if (idx & 0x04)
@@ -1482,28 +1524,28 @@ static uint16_t decode_address(unsigned size, unsigned mode)
 
 	switch (mode) {
 	case 0:
-		addr = pc;
-		pc += size;
+		addr = cpu->pc;
+		cpu->pc += size;
 		indir = 0;
 		break;
 	case 1:
-		addr = pc;
-		pc += 2;
+		addr = cpu->pc;
+		cpu->pc += 2;
 		indir = 1;
 		break;
 	case 2:
-		addr = pc;
-		pc += 2;
+		addr = cpu->pc;
+		cpu->pc += 2;
 		indir = 2;
 		break;
 	case 3:
 		addr = (int8_t) fetch();
-		addr += pc;
+		addr += cpu->pc;
 		indir = 0;
 		break;
 	case 4:
 		addr = (int8_t) fetch();
-		addr += pc;
+		addr += cpu->pc;
 		indir = 1;
 		break;
 	case 5:
@@ -1514,7 +1556,7 @@ static uint16_t decode_address(unsigned size, unsigned mode)
 	case 6:
 	case 7:
 		fprintf(stderr, "unknown address indexing %X at %04X\n",
-			mode, exec_pc);
+			mode, cpu->exec_pc);
 		exit(1);
 		break;
 	default:
@@ -1537,64 +1579,64 @@ static int branch_op(void)
 	unsigned t;
 	int8_t off;
 
-	switch (op & 0x0F) {
+	switch (cpu->op & 0x0F) {
 	case 0:		/* BL   Branch if link is set */
-		t = (alu_out & ALU_L);
+		t = (cpu->alu_out & ALU_L);
 		break;
 	case 1:		/* BNL  Branch if link is not set */
-		t = !(alu_out & ALU_L);
+		t = !(cpu->alu_out & ALU_L);
 		break;
 	case 2:		/* BF   Branch if fault is set */
-		t = (alu_out & ALU_F);
+		t = (cpu->alu_out & ALU_F);
 		break;
 	case 3:		/* BNF  Branch if fault is not set */
-		t = !(alu_out & ALU_F);
+		t = !(cpu->alu_out & ALU_F);
 		break;
 	case 4:		/* BZ   Branch if zero */
-		t = (alu_out & ALU_V);
+		t = (cpu->alu_out & ALU_V);
 		break;
 	case 5:		/* BNZ  Branch if non zero */
-		t = !(alu_out & ALU_V);
+		t = !(cpu->alu_out & ALU_V);
 		break;
 	case 6:		/* BM   Branch if minus */
-		t = alu_out & ALU_M;
+		t = cpu->alu_out & ALU_M;
 		break;
 	case 7:		/* BP   Branch if plus */
-		t = !(alu_out & ALU_M);
+		t = !(cpu->alu_out & ALU_M);
 		break;
 	case 8:		/* BGZ  Branch if greater than zero */
 		/* Branch if both M and V are zero */
-		t = !(alu_out & (ALU_M | ALU_V));
+		t = !(cpu->alu_out & (ALU_M | ALU_V));
 		break;
 	case 9:		/* BLE  Branch if less than or equal to zero */
-		t = alu_out & (ALU_M | ALU_V);
+		t = cpu->alu_out & (ALU_M | ALU_V);
 		break;
 	case 10:		/* BS1  */
-		t = (switches & BS1);
+		t = (cpu->switches & BS1);
 		break;
 	case 11:		/* BS2 */
-		t = (switches & BS2);
+		t = (cpu->switches & BS2);
 		break;
 	case 12:		/* BS3 */
-		t = (switches & BS3);
+		t = (cpu->switches & BS3);
 		break;
 	case 13:		/* BS4 */
-		t = (switches & BS4);
+		t = (cpu->switches & BS4);
 		break;
 	case 14:
 		/* Branch if interrupts enabled.
 		 * Was BTM - branch on teletype mark - on CPU4 */
-		t = int_enable;
+		t = cpu->int_enable;
 		break;
 	case 15:		/* B?? - branch of IL1 AH bit 0 set (see B6/C6) */
-		t = cpu_sram[0x10] & 0x01;
+		t = cpu->cpu_sram[0x10] & 0x01;
 		break;
 	}
 	/* We'll keep pc and reg separate until we know if/how it fits memory */
 	off = fetch();
 	/* Offset is applied after fetch leaves PC at next instruction */
 	if (t) {
-		pc += off;
+		cpu->pc += off;
 		return 18;
 	}
 	return 9;
@@ -1617,20 +1659,20 @@ static void switch_ipl(unsigned new_ipl, unsigned mode)
 	 *  3-0     Memory MAP aka MMU aka Page Table Base
 	 */
 
-	unsigned old_ipl = cpu_ipl;
+	unsigned old_ipl = cpu->cpu_ipl;
 	if (mode != SWITCH_IPL_RETURN_MODIFIED) {
 		// Save pc
-		regpair_write(P, pc);
+		regpair_write(P, cpu->pc);
 
 		// Save flags and MAP
-		reg_write(CL, alu_out | cpu_mmu);
+		reg_write(CL, cpu->alu_out | cpu->cpu_mmu);
 	}
-	cpu_ipl = new_ipl;
+	cpu->cpu_ipl = new_ipl;
 
 	// We are now on the new level
 
 	// restore pc
-	pc = regpair_read(P);
+	cpu->pc = regpair_read(P);
 
 	if (mode == SWITCH_IPL_INTERRUPT) {
 		// Save previous IPL, so we can return later
@@ -1639,44 +1681,48 @@ static void switch_ipl(unsigned new_ipl, unsigned mode)
 
 	uint8_t cl = reg_read(CL);
 	// Restore flags
-	alu_out = cl & (ALU_L | ALU_F | ALU_M | ALU_V);
+	cpu->alu_out = cl & (ALU_L | ALU_F | ALU_M | ALU_V);
 
 	// Restore memory MAP
-	cpu_mmu = cl & 0x7;
+	cpu->cpu_mmu = cl & 0x7;
 }
 
 /* Low operations - not all known */
 static int low_op(void)
 {
-	switch (op) {
+	switch (cpu->op) {
 	case 0x00:		/* HALT */
-		halted = 1;
+		cpu->halted = 1;
 		break;
 	case 0x01:		/* NOP */
 		return 4;
 	case 0x02:		/* SF   Set Fault */
-		alu_out |= ALU_F;
+		cpu->alu_out |= ALU_F;
 		break;
 	case 0x03:		/* RF   Reset Fault */
-		alu_out &= ~ALU_F;
+		cpu->alu_out &= ~ALU_F;
 		break;
 	case 0x04:		/* EI   Enable Interrupts */
-		int_enable = 1;
+		if (!cpu->int_enable && cpu->di_ns >= 0)
+			histogram_add(&cpu->di_time, get_current_time() - cpu->di_ns);
+		cpu->int_enable = 1;
 		break;
 	case 0x05:		/* DI   Disable Interrupts */
-		int_enable = 0;
+		if (cpu->int_enable)
+			cpu->di_ns = get_current_time();
+		cpu->int_enable = 0;
 		return 8;
 	case 0x06:		/* SL   Set Link */
-		alu_out |= ALU_L;
+		cpu->alu_out |= ALU_L;
 		break;
 	case 0x07:		/* RL   Clear Link */
-		alu_out &= ~ALU_L;
+		cpu->alu_out &= ~ALU_L;
 		break;
 	case 0x08:		/* CL   Complement Link */
-		alu_out ^= ALU_L;
+		cpu->alu_out ^= ALU_L;
 		break;
 	case 0x09:		/* RSR  Return from subroutine */
-		pc = regpair_read(X);
+		cpu->pc = regpair_read(X);
 		regpair_write(X, pop());
 		break;
 	case 0x0A:		/* RI   Return from interrupt */
@@ -1692,7 +1738,7 @@ static int low_op(void)
 		break;
 	case 0x0D:
 		/* No flag effects */
-		regpair_write(X, pc);
+		regpair_write(X, cpu->pc);
 		break;
 		/*
 		 * "..0x0E ought to be a long (but not infinite) loop.
@@ -1714,10 +1760,10 @@ static int low_op(void)
 		 */
 		{
 			uint16_t new_x, new_pc;
-			regpair_write(P, pc);
+			regpair_write(P, cpu->pc);
 			popbyte();	/* Skips one */
 			new_x = pop();	/* Loads X */
-			cpu_ipl = popbyte();	/* Loads new IL */
+			cpu->cpu_ipl = popbyte();	/* Loads new IL */
 			/* X is set off the stack and S is propagated */
 			new_pc = regpair_read(X);
 			{
@@ -1726,10 +1772,10 @@ static int low_op(void)
 				// Syscalls sometimes return results as flags
 
 				/* We flip MMU context after all the POP cases */
-				cpu_mmu = byte & 0x07;
+				cpu->cpu_mmu = byte & 0x07;
 			}
 			regpair_write(X, new_x);
-			pc = new_pc;
+			cpu->pc = new_pc;
 			return 0;
 		}
 	}
@@ -1745,14 +1791,14 @@ static int low_op(void)
 static int jsys_op(void)
 {
 	uint8_t arg = fetch();
-	pushbyte(alu_out | cpu_mmu);  // Push CCR and Page Table Base
-	pushbyte(cpu_ipl & 0xf);      // Push current level
+	pushbyte(cpu->alu_out | cpu->cpu_mmu);  // Push CCR and Page Table Base
+	pushbyte(cpu->cpu_ipl & 0xf);      // Push current level
 	push(regpair_read(X));        // Push X
-	regpair_write(X, pc);         // X <- PC
+	regpair_write(X, cpu->pc);         // X <- PC
 
 	pushbyte(arg);                // Push arg
-	cpu_mmu = 0;                  // Switch to mmu bank 0
-	pc = 0x100;                   // jump to 0x100
+	cpu->cpu_mmu = 0;                  // Switch to mmu bank 0
+	cpu->pc = 0x100;                   // jump to 0x100
 	return 0;
 }
 
@@ -1761,45 +1807,45 @@ static int dma_op(void)
 {
 	unsigned rp;
 	/* operations 2Fxx */
-	op = fetch();
-	rp = (op >> 4);
+	cpu->op = fetch();
+	rp = (cpu->op >> 4);
 
-	switch (op & 0x0F) {
+	switch (cpu->op & 0x0F) {
 	case 0:
-		dma_addr = regpair_read(rp);
+		cpu->dma_addr = regpair_read(rp);
 		break;
 	case 1:
-		regpair_write(rp, dma_addr);
+		regpair_write(rp, cpu->dma_addr);
 		break;
 	case 2:
-		dma_count = regpair_read(rp);
+		cpu->dma_count = regpair_read(rp);
 		break;
 	case 3:
-		regpair_write(rp, dma_count);
+		regpair_write(rp, cpu->dma_count);
 		break;
 	case 4:
-		dma_mode = rp;
+		cpu->dma_mode = rp;
 		break;
 	case 5:	/* From the microcode analysis */
-		dma_mode = regpair_read(rp);
+		cpu->dma_mode = regpair_read(rp);
 		break;
 	case 6:
-		dma_enable = 1;
+		cpu->dma_enable = 1;
 		break;
 	case 7:	/* From microcode */
-		dma_enable = 0;
+		cpu->dma_enable = 0;
 		break;
 	/* 8-9 read/write some kind of unknown byte status register */
 	case 8:
-		dma_mystery = reg_read(rp);
+		cpu->dma_mystery = reg_read(rp);
 		break;
 	case 9:
-		reg_write(rp, dma_mystery);
+		reg_write(rp, cpu->dma_mystery);
 		break;
 	/* A-F are not used */
 	default:
 		fprintf(stderr, "Unknown DMA operations 2F%02X at %04X\n",
-			op, exec_pc);
+			cpu->op, cpu->exec_pc);
 		exit(1);
 		break;
 	}
@@ -1822,17 +1868,17 @@ static int dma_op(void)
 static int jump_op(void)
 {
 	uint16_t new_pc;
-	if (op == 0x76) {	/* syscall is a mystery */
-		uint8_t old_ipl = cpu_ipl;
+	if (cpu->op == 0x76) {	/* syscall is a mystery */
+		uint8_t old_ipl = cpu->cpu_ipl;
 		unsigned old_s = regpair_read(S);
-		cpu_ipl = 15;
+		cpu->cpu_ipl = 15;
 		/* Unclear if this also occurs */
 		/* Also seems to propagate S but can't be sure */
 		regpair_write(S, old_s);
 		reg_write(CH, old_ipl);
 		return 0;
 	}
-	if (op == 0x7E) {
+	if (cpu->op == 0x7E) {
 		/* Push a block of registers given the last register to push
 		   and the count */
 		uint8_t r = fetch();
@@ -1852,7 +1898,7 @@ static int jump_op(void)
 		regpair_write(S, addr);
 		return 0;
 	}
-	if (op == 0x7F) {
+	if (cpu->op == 0x7F) {
 		/* Pop a block of registers given the first register and count */
 		uint8_t r = fetch();
 		uint8_t c = (r & 0x0F) + 1;
@@ -1869,24 +1915,24 @@ static int jump_op(void)
 	}
 	/* We don't know what 0x70 does (it's invalid but I'd guess it jumps
 	   to the following byte */
-	new_pc = decode_address(2, op & 0x07);
-	if (op & 0x08) {
+	new_pc = decode_address(2, cpu->op & 0x07);
+	if (cpu->op & 0x08) {
 		/* Subroutine calls are a hybrid of the classic call/ret and
 		   branch/link. The old X is stacked, X is set to the new
 		   return address and then we jump */
 		push(regpair_read(X));
-		regpair_write(X, pc);
+		regpair_write(X, cpu->pc);
 		/* This is specifically stated in the EE200 manual */
 		regpair_write(P, new_pc);
 	}
-	pc = new_pc;
+	cpu->pc = new_pc;
 	return 0;
 }
 
 static int stcc(void)
 {
 	uint16_t addr = fetch16();
-	mmu_mem_write8(addr, alu_out);
+	mmu_mem_write8(addr, cpu->alu_out);
 	return 0;
 }
 
@@ -1896,9 +1942,9 @@ static int stcc(void)
 static int x_op(void)
 {
 	/* Valid modes 0-5 */
-	uint16_t addr = decode_address(2, op & 7);
+	uint16_t addr = decode_address(2, cpu->op & 7);
 	uint16_t r;
-	if (op & 0x08) {
+	if (cpu->op & 0x08) {
 		r = regpair_read(X);
 		mmu_mem_write16(addr, r);
 		ldflags16(r);
@@ -1912,10 +1958,10 @@ static int x_op(void)
 
 static int loadbyte_op(void)
 {
-	uint16_t addr = decode_address(1, op & 0x0F);
+	uint16_t addr = decode_address(1, cpu->op & 0x0F);
 	uint8_t r = mmu_mem_read8(addr);
 
-	if (op & 0x40)
+	if (cpu->op & 0x40)
 		reg_write(BL, r);
 	else
 		reg_write(AL, r);
@@ -1925,10 +1971,10 @@ static int loadbyte_op(void)
 
 static int loadword_op(void)
 {
-	uint16_t addr = decode_address(2, op & 0x0F);
+	uint16_t addr = decode_address(2, cpu->op & 0x0F);
 	uint16_t r = mmu_mem_read16(addr);
 
-	if (op & 0x40)
+	if (cpu->op & 0x40)
 		regpair_write(B, r);
 	else
 		regpair_write(A, r);
@@ -1938,10 +1984,10 @@ static int loadword_op(void)
 
 static int storebyte_op(void)
 {
-	uint16_t addr = decode_address(1, op & 0x0F);
+	uint16_t addr = decode_address(1, cpu->op & 0x0F);
 	uint8_t r;
 
-	if (op & 0x40)
+	if (cpu->op & 0x40)
 		r = reg_read(BL);
 	else
 		r = reg_read(AL);
@@ -1953,10 +1999,10 @@ static int storebyte_op(void)
 
 static int storeword_op(void)
 {
-	uint16_t addr = decode_address(2, op & 0x0F);
+	uint16_t addr = decode_address(2, cpu->op & 0x0F);
 	uint16_t r;
 
-	if (op & 0x40)
+	if (cpu->op & 0x40)
 		r = regpair_read(B);
 	else
 		r = regpair_read(A);
@@ -2014,7 +2060,7 @@ static int cpu6_il_mov(void)
 	uint8_t ipl = byte2 >> 4;
 	uint8_t r = byte2 & 0x0F;
 
-	if (op == 0xd7) {
+	if (cpu->op == 0xd7) {
 		cpu6_il_storebyte(ipl, (r | 1) ^ 1, AH);
 		cpu6_il_storebyte(ipl, r ^ 1, AL);
 	} else {
@@ -2062,7 +2108,7 @@ static int store16() {
 
 static int loadstore_op(void)
 {
-	switch (op & 0x30) {
+	switch (cpu->op & 0x30) {
 	case 0x00:
 		return loadbyte_op();
 	case 0x10:
@@ -2081,13 +2127,13 @@ static int misc2x_op(void)
 {
 	unsigned low = 0;
 	unsigned reg = AL;
-	if (!(op & 8)) {
+	if (!(cpu->op & 8)) {
 		reg = fetch();
 		low = reg & 0x0F;
 		reg >>= 4;
 	}
 
-	switch (op) {
+	switch (cpu->op) {
 	case 0x20:
 		return inc(reg, low + 1);
 	case 0x21:
@@ -2171,18 +2217,18 @@ static uint16_t misc3x_op_impl(unsigned op, uint16_t val, unsigned imm)
 static int misc3x_op(void)
 {
 	// Special cases that don't fit general pattern
-	if (op == 0x3E) {
+	if (cpu->op == 0x3E) {
 		regpair_write(X, inc16(regpair_read(X), 1));
 		return 0;
 	}
-	if (op == 0x3F) {
+	if (cpu->op == 0x3F) {
 		regpair_write(X, dec16(regpair_read(X), 1));
 		return 0;
 	}
 
-	if (op & 8) {
+	if (cpu->op & 8) {
 		// Implicit ops that work on A
-		regpair_write(A, misc3x_op_impl(op, regpair_read(A), 0));
+		regpair_write(A, misc3x_op_impl(cpu->op, regpair_read(A), 0));
 		return 0;
 	}
 
@@ -2191,7 +2237,7 @@ static int misc3x_op(void)
 	unsigned reg = (opn >> 4) & 0xe;
 	if ((opn & 0x10) == 0) {
 		// If register is even, operate on register
-		regpair_write(reg, misc3x_op_impl(op, regpair_read(reg), imm));
+		regpair_write(reg, misc3x_op_impl(cpu->op, regpair_read(reg), imm));
 		return 0;
 	}
 
@@ -2200,7 +2246,7 @@ static int misc3x_op(void)
 	if (reg != A) {	// indexed
 		addr += regpair_read(reg);
 	}
-	uint16_t result = misc3x_op_impl(op, mmu_mem_read16(addr), imm);
+	uint16_t result = misc3x_op_impl(cpu->op, mmu_mem_read16(addr), imm);
 	mmu_mem_write16(addr, result);
 	return 0;
 }
@@ -2210,12 +2256,12 @@ static int misc3x_op(void)
 static int alu4x_op(void)
 {
 	unsigned src, dst;
-	if ((!(op & 0x08))) {
+	if ((!(cpu->op & 0x08))) {
 		dst = fetch();
 		src = dst >> 4;
 		dst &= 0x0F;
 	}
-	switch (op) {
+	switch (cpu->op) {
 	case 0x40:		/* add */
 		return add(dst, src);
 	case 0x41:		/* sub */
@@ -2242,8 +2288,8 @@ static int alu4x_op(void)
 		return mov(BL, AL);
 	case 0x4E:		/* unused */
 	case 0x4F:		/* unused */
-		fprintf(stderr, "Unknown ALU4 op %02X at %04X\n", op,
-			exec_pc);
+		fprintf(stderr, "Unknown ALU4 op %02X at %04X\n", cpu->op,
+			cpu->exec_pc);
 		exit(1);
 		return 0;
 	default:
@@ -2272,13 +2318,13 @@ static int alu5x_op(void)
 	uint16_t dsta;
 	uint16_t movv; // move value is usually source.
 	               // But when is a choice of a memory operand, mov ignores everything else.
-	if (!(op & 0x08)) {
+	if (!(cpu->op & 0x08)) {
 		dst = fetch();
 		src = dst >> 4;
 		movv = b = regpair_read(src & 0x0E);
 		dsta = regpair_addr(dst & 0x0E);
 		a = regpair_read(dst & 0XE);
-		if (op <= 0x55) {
+		if (cpu->op <= 0x55) {
 			switch(dst & 0x11) {
 			case 0x00: // dst_reg <- src_reg
 				break;
@@ -2304,7 +2350,7 @@ static int alu5x_op(void)
 		movv = b = regpair_read(A);
 		dsta = regpair_addr(B);
 	}
-	switch (op) {
+	switch (cpu->op) {
 	case 0x50:		/* add */
 		return add16(dsta, a, b);
 	case 0x51:		/* sub */
@@ -2319,8 +2365,8 @@ static int alu5x_op(void)
 		return mov16(dsta, movv);
 	case 0x56:		/* unused */
 	case 0x57:		/* unused */
-		fprintf(stderr, "Unknown ALU5 op %02X at %04X\n", op,
-			exec_pc);
+		fprintf(stderr, "Unknown ALU5 op %02X at %04X\n", cpu->op,
+			cpu->exec_pc);
 		exit(1);
 		return 0;
 	case 0x58:
@@ -2381,13 +2427,13 @@ static int muldiv_op() {
 		break;
 	}
 
-	switch (op) {
+	switch (cpu->op) {
 	case 0x77: // 16bit Multiply
 		return mul16(dsta, a, b);
 	case 0x78: // 16bit Divide
 		return div16(dsta, a, b);
 	}
-	fprintf(stderr, "Unknown MULDIV op %02X at %04X\n", op, exec_pc);
+	fprintf(stderr, "Unknown MULDIV op %02X at %04X\n", cpu->op, cpu->exec_pc);
 	exit(1);
 }
 
@@ -2398,12 +2444,12 @@ static int muldiv_op() {
  * Disassembly of LOAD hints that it might disable the timer decrementer
  */
 static int semaphore_op(void) {
-	switch(op) {
+	switch(cpu->op) {
 	case 0xB6:
-		cpu_sram[0x10] = 0xff;
+		cpu->cpu_sram[0x10] = 0xff;
 		return 0;
 	case 0xC6:
-		cpu_sram[0x10] = 0x00;
+		cpu->cpu_sram[0x10] = 0x00;
 		return 0;
 	}
 	fprintf(stderr, "semop: internal\n");
@@ -2420,113 +2466,139 @@ static char *flagcode(void)
 {
 	static char buf[6];
 	strcpy(buf, "-----");
-	if (alu_out & ALU_F)
+	if (cpu->alu_out & ALU_F)
 		*buf = 'F';
-	if (alu_out & ALU_L)
+	if (cpu->alu_out & ALU_L)
 		buf[2] = 'L';
-	if (alu_out & ALU_M)
+	if (cpu->alu_out & ALU_M)
 		buf[3] = 'M';
-	if (alu_out & ALU_V)
+	if (cpu->alu_out & ALU_V)
 		buf[4] = 'V';
 	return buf;
 }
 
 void cpu6_interrupt(unsigned trace)
 {
-	unsigned old_ipl = cpu_ipl;
+	unsigned old_ipl = cpu->cpu_ipl;
 	unsigned pending_ipl;
 
-	if (int_enable == 0)
+	if (cpu->int_enable == 0)
 		return;
 
-	pending_ipl = pending_ipl_mask == 0 ? 0 : 31 - __builtin_clz(pending_ipl_mask);
+	pending_ipl = cpu->pending_ipl_mask == 0 ? 0 : 31 - __builtin_clz(cpu->pending_ipl_mask);
 
-	if (pending_ipl > cpu_ipl) {
-		halted = 0;
+	if (pending_ipl > cpu->cpu_ipl) {
+		STAT_INC(irq_taken[pending_ipl]);
+		histogram_add(&cpu->irq_latency[pending_ipl],
+			get_current_time() - cpu->irq_asserted_ns[pending_ipl]);
+		cpu->halted = 0;
 		switch_ipl(pending_ipl, SWITCH_IPL_RETURN);
 
 		if (trace)
 			fprintf(stderr,
 				"Interrupt %X: New PC = %04X, previous IPL %X\n",
-				cpu_ipl, pc, old_ipl);
+				cpu->cpu_ipl, cpu->pc, old_ipl);
 	}
 }
 
 // Not quite accurate to real hardware, but hopefully close enough
 void cpu_assert_irq(unsigned ipl) {
-	pending_ipl_mask |= 1 << ipl;
+	if (!(cpu->pending_ipl_mask & (1 << ipl))) {
+		STAT_INC(irq_raised[ipl]);
+		cpu->irq_asserted_ns[ipl] = get_current_time();
+	}
+	cpu->pending_ipl_mask |= 1 << ipl;
 }
 
 void cpu_deassert_irq(unsigned ipl) {
-	pending_ipl_mask &= ~(1 << ipl);
+	cpu->pending_ipl_mask &= ~(1 << ipl);
 }
 
 unsigned cpu6_execute_one(unsigned trace)
 {
 	cpu6_interrupt(trace);
-	exec_pc = pc;
+	cpu->exec_pc = cpu->pc;
 
 	if (trace)
-		fprintf(stderr, "CPU %04X: ", pc);
-	op = fetch();
+		fprintf(stderr, "CPU %04X: ", cpu->pc);
+	cpu->op = fetch();
 	if (trace) {
 		fprintf(stderr,
 			"%02X %s A:%04X  B:%04X X:%04X Y:%04X Z:%04X S:%04X C:%04X LVL:%x MAP:%x | ",
-			op, flagcode(), regpair_read(A), regpair_read(B),
+			cpu->op, flagcode(), regpair_read(A), regpair_read(B),
 			regpair_read(X), regpair_read(Y), regpair_read(Z),
-			regpair_read(S), regpair_read(C), cpu_ipl, cpu_mmu);
-		disassemble(op);
+			regpair_read(S), regpair_read(C), cpu->cpu_ipl, cpu->cpu_mmu);
+		disassemble(cpu->op);
 	}
-	if (op < 0x10)
+	if (cpu->op < 0x10)
 		return low_op();
-	if (op < 0x20)
+	if (cpu->op < 0x20)
 		return branch_op();
 	/* 20-5F is sort of ALU stuff but other things seem to have been shoved
 	   into the same space */
-	if (op < 0x30)
+	if (cpu->op < 0x30)
 		return misc2x_op();
-	if (op < 0x40)
+	if (cpu->op < 0x40)
 		return misc3x_op();
-	if (op == 0x46)
+	if (cpu->op == 0x46)
 		return bignum_op();
-	if (op == 0x47)
+	if (cpu->op == 0x47)
 		return block_op(0x47, trace);
-	if (op < 0x50)
+	if (cpu->op < 0x50)
 		return alu4x_op();
-	if (op == 0x66)
+	if (cpu->op == 0x66)
 		return jsys_op();
-	if (op < 0x60)
+	if (cpu->op < 0x60)
 		return alu5x_op();
-	if (op == 0x67)
+	if (cpu->op == 0x67)
 		return block_op(0x67, trace);
-	if (op == 0x6f)
+	if (cpu->op == 0x6f)
 		return stcc();
-	if (op < 0x70)
+	if (cpu->op < 0x70)
 		return x_op();
-	if (op == 0x77 || op == 0x78)
+	if (cpu->op == 0x77 || cpu->op == 0x78)
 		return muldiv_op();
-	if (op < 0x80)
+	if (cpu->op < 0x80)
 		return jump_op();
-	if (op == 0xb6 || op == 0xc6)
+	if (cpu->op == 0xb6 || cpu->op == 0xc6)
 		return semaphore_op();
-	if (op == 0xd6)
+	if (cpu->op == 0xd6)
 		return store16();
-	if (op == 0xd7 || op == 0xe6)
+	if (cpu->op == 0xd7 || cpu->op == 0xe6)
 		return cpu6_il_mov();
-	if (op == 0xf6)
+	if (cpu->op == 0xf6)
 		return cpu6_indexed_loadstore();
-	if (op == 0xf7)
+	if (cpu->op == 0xf7)
 		return memcpy16();
 	return loadstore_op();
 }
 
+/* Interrupt latency (assertion to dispatch) per IPL, and DI to EI time */
+void cpu6_report(FILE *fp)
+{
+	char name[48];
+	unsigned ipl;
+
+	for (ipl = 0; ipl < 16; ipl++) {
+		if (cpu->irq_latency[ipl].count == 0)
+			continue;
+		snprintf(name, sizeof(name), "IPL %u interrupt latency", ipl);
+		histogram_print(fp, name, &cpu->irq_latency[ipl]);
+	}
+	histogram_print(fp, "Interrupts disabled (DI to EI)", &cpu->di_time);
+}
+
 uint16_t cpu6_pc(void)
 {
-	return exec_pc;
+	return cpu->exec_pc;
 }
 
 void set_pc_debug(uint16_t new_pc) {
-	pc = new_pc;
+	cpu->pc = new_pc;
+}
+
+void set_mmu_debug(uint8_t new_mmu) {
+	cpu->cpu_mmu = new_mmu & 0x07;
 }
 
 void reg_write_debug(uint8_t r, uint8_t v) {
@@ -2539,12 +2611,12 @@ void regpair_write_debug(uint8_t r, uint16_t v) {
 
 void cpu6_set_switches(unsigned v)
 {
-	switches = v;
+	cpu->switches = v;
 }
 
 unsigned cpu6_halted(void)
 {
-	return halted;
+	return cpu->halted;
 }
 
 /*
@@ -2556,11 +2628,94 @@ unsigned cpu6_halted(void)
  */
 void cpu6_init(void)
 {
-	uint8_t *mp = mmu[0];
+	uint8_t *mp = cpu->mmu[0];
 	unsigned i = 0;
 	for (i = 0; i < 30; i++)
 		*mp++ = i;
 	*mp++ = 0x7E;
 	*mp = 0x7F;
-	pc = 0xFC00;
+	cpu->pc = 0xFC00;
+}
+
+/*
+ *	Snapshot support
+ */
+struct cpu6_snapshot {
+	uint8_t cpu_ipl;
+	uint8_t cpu_mmu;
+	uint16_t pc;
+	uint16_t exec_pc;
+	uint8_t op;
+	uint8_t alu_out;
+	uint8_t switches;
+	uint8_t int_enable;
+	uint8_t halted;
+	uint8_t dma_mode;
+	uint32_t pending_ipl_mask;
+	uint16_t dma_addr;
+	uint16_t dma_count;
+	uint8_t dma_enable;
+	uint8_t dma_mystery;
+	uint8_t cpu_sram[256];
+	uint8_t mmu[8][32];
+	uint32_t twobit_cached_reg;
+	int64_t irq_asserted_ns[16];
+	int64_t di_ns;
+};
+
+void cpu6_save_state(struct snapshot *s)
+{
+	struct cpu6_snapshot cs;
+
+	memset(&cs, 0, sizeof(cs));
+	cs.cpu_ipl = cpu->cpu_ipl;
+	cs.cpu_mmu = cpu->cpu_mmu;
+	cs.pc = cpu->pc;
+	cs.exec_pc = cpu->exec_pc;
+	cs.op = cpu->op;
+	cs.alu_out = cpu->alu_out;
+	cs.switches = cpu->switches;
+	cs.int_enable = cpu->int_enable;
+	cs.halted = cpu->halted;
+	cs.pending_ipl_mask = cpu->pending_ipl_mask;
+	cs.dma_addr = cpu->dma_addr;
+	cs.dma_count = cpu->dma_count;
+	cs.dma_mode = cpu->dma_mode;
+	cs.dma_enable = cpu->dma_enable;
+	cs.dma_mystery = cpu->dma_mystery;
+	memcpy(cs.cpu_sram, cpu->cpu_sram, sizeof(cpu->cpu_sram));
+	memcpy(cs.mmu, cpu->mmu, sizeof(cpu->mmu));
+	cs.twobit_cached_reg = cpu->twobit_cached_reg;
+	memcpy(cs.irq_asserted_ns, cpu->irq_asserted_ns, sizeof(cpu->irq_asserted_ns));
+	cs.di_ns = cpu->di_ns;
+	snapshot_write_section(s, "CPU6", &cs, sizeof(cs));
+}
+
+int cpu6_load_state(struct snapshot *s)
+{
+	struct cpu6_snapshot cs;
+
+	if (snapshot_read_section(s, "CPU6", &cs, sizeof(cs)))
+		return -1;
+	cpu->cpu_ipl = cs.cpu_ipl;
+	cpu->cpu_mmu = cs.cpu_mmu;
+	cpu->pc = cs.pc;
+	cpu->exec_pc = cs.exec_pc;
+	cpu->op = cs.op;
+	cpu->alu_out = cs.alu_out;
+	cpu->switches = cs.switches;
+	cpu->int_enable = cs.int_enable;
+	cpu->halted = cs.halted;
+	cpu->pending_ipl_mask = cs.pending_ipl_mask;
+	cpu->dma_addr = cs.dma_addr;
+	cpu->dma_count = cs.dma_count;
+	cpu->dma_mode = cs.dma_mode;
+	cpu->dma_enable = cs.dma_enable;
+	cpu->dma_mystery = cs.dma_mystery;
+	memcpy(cpu->cpu_sram, cs.cpu_sram, sizeof(cpu->cpu_sram));
+	memcpy(cpu->mmu, cs.mmu, sizeof(cpu->mmu));
+	cpu->twobit_cached_reg = cs.twobit_cached_reg;
+	memcpy(cpu->irq_asserted_ns, cs.irq_asserted_ns, sizeof(cpu->irq_asserted_ns));
+	cpu->di_ns = cs.di_ns;
+	return 0;
 }
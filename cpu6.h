@@ -1,4 +1,5 @@
 #include <inttypes.h>
+#include <stdio.h>
 
 #define AH		0
 #define AL		1
@@ -37,6 +38,8 @@ extern void mem_write8(uint32_t addr, uint8_t val);
 extern void halt_system(void);
 extern uint16_t cpu6_pc(void);
 extern void set_pc_debug(uint16_t new_pc);
+extern void set_mmu_debug(uint8_t new_mmu);
+extern uint32_t mmu_map(uint16_t addr);
 extern void reg_write_debug(uint8_t r, uint8_t v);
 extern void regpair_write_debug(uint8_t r, uint16_t v);
 extern unsigned cpu6_execute_one(unsigned trace);
@@ -45,7 +48,12 @@ extern uint8_t dma_write_cycle(void);
 extern int dma_write_active(void);
 extern void cpu6_set_switches(unsigned switches);
 extern unsigned cpu6_halted(void);
+struct cpu6_state;
+extern struct cpu6_state *cpu6_create(void);
+extern void cpu6_destroy(struct cpu6_state *s);
+extern void cpu6_bind(struct cpu6_state *s);
 extern void cpu6_init(void);
+extern void cpu6_report(FILE *fp);
 extern void cpu_assert_irq(unsigned ipl);
 extern void cpu_deassert_irq(unsigned ipl);
 extern void advance_time(uint64_t nanoseconds);
@@ -0,0 +1,946 @@
+/*
+ *	Hawk platter images, raw, compact or overlaid on a base image (see
+ *	diskimg.h)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "diskimg.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define OVERLAY_MAGIC		"HAWKOVL\0"
+#define OVERLAY_VERSION		1
+#define OVERLAY_BASE_LEN	488
+#define OVERLAY_BITMAP_BYTES	((HAWK_IMAGE_SECTORS + 7) / 8)
+#define OVERLAY_RECORD_BYTES	(4 + HAWK_SECTOR_BYTES)
+/* Header and bitmap, rounded up to 512 bytes */
+#define OVERLAY_DATA_OFFSET	\
+	((sizeof(struct overlay_header) + OVERLAY_BITMAP_BYTES + 511) & ~511)
+
+/* Overlays of overlays are fine, loops are not */
+#define OVERLAY_MAX_DEPTH	16
+
+#define COMPACT_MAGIC		"HAWKCMP\0"
+#define COMPACT_VERSION		1
+
+/* All numbers little endian */
+struct overlay_header {
+	char magic[8];
+	uint8_t version[4];
+	uint8_t sectors[4];
+	uint8_t sector_bytes[4];
+	uint8_t data_offset[4];
+	char base[OVERLAY_BASE_LEN];	/* Relative to the overlay's directory */
+};
+
+struct compact_header {
+	char magic[8];
+	uint8_t version[4];
+	uint8_t tracks[4];
+	uint8_t sectors_per_track[4];
+	uint8_t sector_bytes[4];
+};
+
+struct compact_track {
+	uint8_t offset[4];		/* Of the block */
+	uint8_t length[4];		/* 0 if every sector is a fill */
+	uint8_t stored[2];		/* Bit per sector held in the block */
+	uint8_t packed;			/* Block is compressed */
+	uint8_t pad;
+	uint8_t fill[HAWK_SECTS_PER_TRK]; /* Byte the other sectors repeat */
+};
+
+struct disk_image {
+	int fd;
+
+	/* Raw image: the shared mapping, or NULL to use pread */
+	const uint8_t *data;
+	size_t len;
+
+	/* Overlay */
+	struct disk_image *base;
+	uint8_t bitmap[OVERLAY_BITMAP_BYTES];
+	uint32_t *where;		/* Offset of each sector's latest copy */
+	off_t end;			/* Where the next record goes */
+	uint32_t data_offset;
+
+	/* Compact image */
+	struct compact_track *index;
+	unsigned tracks;
+	uint8_t *track;			/* The last track decoded */
+	int cached;
+};
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/*
+ *	Every raw image file is mapped once per process, and stays mapped.
+ *	A file that has been replaced or written since gets a new mapping.
+ */
+struct image_map {
+	struct image_map *next;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	const uint8_t *data;
+	size_t len;
+};
+
+static struct image_map *image_maps;
+static pthread_mutex_t image_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const uint8_t *map_image(int fd, size_t *len)
+{
+	struct image_map *im;
+	struct stat st;
+	void *data;
+
+	*len = 0;
+	if (fstat(fd, &st) == -1 || st.st_size == 0)
+		return NULL;
+
+	pthread_mutex_lock(&image_map_lock);
+	for (im = image_maps; im; im = im->next)
+		if (im->dev == st.st_dev && im->ino == st.st_ino &&
+		    im->mtime == st.st_mtime && im->len == st.st_size)
+			goto out;
+
+	/* Not fatal, sectors are read with pread() instead */
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED || (im = calloc(1, sizeof(*im))) == NULL) {
+		pthread_mutex_unlock(&image_map_lock);
+		return NULL;
+	}
+	im->dev = st.st_dev;
+	im->ino = st.st_ino;
+	im->mtime = st.st_mtime;
+	im->data = data;
+	im->len = st.st_size;
+	im->next = image_maps;
+	image_maps = im;
+out:
+	pthread_mutex_unlock(&image_map_lock);
+	*len = im->len;
+	return im->data;
+}
+
+/*
+ *	Block codec, LZ77 in the manner of LZ4. A block is a run of sequences:
+ *
+ *	token		literal count << 4 | match length - 4, 15 meaning
+ *			more follows as bytes of 255 ended by one below
+ *	literals
+ *	offset		16 bits back from the end of the output so far
+ *
+ *	The last sequence is literals only, and ends the block.
+ */
+
+#define LZ_MIN_MATCH	4
+#define LZ_HASH_BITS	12
+
+static uint8_t *lz_length(uint8_t *op, const uint8_t *end, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op == end)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op == end)
+		return NULL;
+	*op++ = len;
+	return op;
+}
+
+static int lz_sequence(uint8_t **opp, const uint8_t *end, const uint8_t *lit,
+		       size_t nlit, unsigned offset, size_t mlen)
+{
+	size_t m = mlen ? mlen - LZ_MIN_MATCH : 0;
+	uint8_t *op = *opp;
+
+	if (op == end)
+		return -1;
+	*op++ = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+	if (nlit >= 15 && (op = lz_length(op, end, nlit - 15)) == NULL)
+		return -1;
+	if (end - op < nlit)
+		return -1;
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen) {
+		if (end - op < 2)
+			return -1;
+		*op++ = offset;
+		*op++ = offset >> 8;
+		if (m >= 15 && (op = lz_length(op, end, m - 15)) == NULL)
+			return -1;
+	}
+	*opp = op;
+	return 0;
+}
+
+/* Bytes written to out, or 0 if it didn't fit in cap. At most 64K in. */
+static size_t lz_compress(const uint8_t *in, size_t n, uint8_t *out, size_t cap)
+{
+	uint16_t table[1 << LZ_HASH_BITS];	/* Position + 1, 0 for none */
+	const uint8_t *ip = in, *anchor = in, *end = in + n;
+	uint8_t *op = out;
+
+	memset(table, 0, sizeof(table));
+	while (end - ip >= LZ_MIN_MATCH) {
+		uint32_t h = (get_le32(ip) * 2654435761u) >> (32 - LZ_HASH_BITS);
+		const uint8_t *ref = in + table[h] - 1;
+		size_t len;
+
+		table[h] = ip - in + 1;
+		if (ref < in || memcmp(ref, ip, LZ_MIN_MATCH)) {
+			ip++;
+			continue;
+		}
+		for (len = LZ_MIN_MATCH; ip + len < end && ref[len] == ip[len]; len++)
+			;
+		if (lz_sequence(&op, out + cap, anchor, ip - anchor, ip - ref, len))
+			return 0;
+		ip += len;
+		anchor = ip;
+	}
+	if (lz_sequence(&op, out + cap, anchor, end - anchor, 0, 0))
+		return 0;
+	return op - out;
+}
+
+/* Expands to exactly len bytes, or fails */
+static int lz_decompress(const uint8_t *in, size_t n, uint8_t *out, size_t len)
+{
+	const uint8_t *ip = in, *end = in + n;
+	uint8_t *op = out;
+	size_t nlit, m;
+	unsigned offset;
+
+	while (ip < end) {
+		nlit = *ip >> 4;
+		m = *ip++ & 15;
+		if (nlit == 15) {
+			do {
+				if (ip == end)
+					return -1;
+				nlit += *ip;
+			} while (*ip++ == 255);
+		}
+		if (end - ip < nlit || out + len - op < nlit)
+			return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (m == 15) {
+			do {
+				if (ip == end)
+					return -1;
+				m += *ip;
+			} while (*ip++ == 255);
+		}
+		m += LZ_MIN_MATCH;
+		if (offset == 0 || offset > op - out || out + len - op < m)
+			return -1;
+		for (; m; m--, op++)
+			*op = op[-(int)offset];
+	}
+	return op == out + len ? 0 : -1;
+}
+
+static int compact_load(struct disk_image *img, const char *path,
+			const struct compact_header *h)
+{
+	size_t len;
+
+	img->tracks = get_le32(h->tracks);
+	if (get_le32(h->version) != COMPACT_VERSION ||
+	    get_le32(h->sectors_per_track) != HAWK_SECTS_PER_TRK ||
+	    get_le32(h->sector_bytes) != HAWK_SECTOR_BYTES ||
+	    img->tracks > HAWK_IMAGE_SECTORS / HAWK_SECTS_PER_TRK) {
+		fprintf(stderr, "%s: unsupported compact image format\n", path);
+		return -1;
+	}
+	len = img->tracks * sizeof(struct compact_track);
+	img->index = malloc(len);
+	img->track = malloc(HAWK_TRACK_BYTES);
+	if (img->index == NULL || img->track == NULL) {
+		perror(path);
+		return -1;
+	}
+	if (pread(img->fd, img->index, len, sizeof(*h)) != len) {
+		fprintf(stderr, "%s: short compact image index\n", path);
+		return -1;
+	}
+	img->cached = -1;
+	img->data = map_image(img->fd, &img->len);
+	return 0;
+}
+
+/* Expand a track of a compact image into img->track */
+static int compact_decode(struct disk_image *img, unsigned track)
+{
+	const struct compact_track *t;
+	uint8_t block[HAWK_TRACK_BYTES], plain[HAWK_TRACK_BYTES];
+	uint32_t offset, length;
+	const uint8_t *data = block, *src;
+	unsigned stored, s, n = 0;
+
+	if (img->cached == track)
+		return 0;
+	img->cached = -1;
+	if (track >= img->tracks)
+		return -1;
+
+	t = &img->index[track];
+	offset = get_le32(t->offset);
+	length = get_le32(t->length);
+	stored = t->stored[0] | t->stored[1] << 8;
+	for (s = 0; s < HAWK_SECTS_PER_TRK; s++)
+		n += (stored >> s) & 1;
+	if (length > sizeof(block) || (!t->packed && length != n * HAWK_SECTOR_BYTES))
+		return -1;
+	if (img->data) {
+		if (offset > img->len || img->len - offset < length)
+			return -1;
+		data = img->data + offset;
+	} else if (pread(img->fd, block, length, offset) != length)
+		return -1;
+	src = data;
+	if (t->packed) {
+		if (lz_decompress(data, length, plain, n * HAWK_SECTOR_BYTES))
+			return -1;
+		src = plain;
+	}
+
+	for (s = 0; s < HAWK_SECTS_PER_TRK; s++) {
+		uint8_t *sector = img->track + s * HAWK_SECTOR_BYTES;
+
+		if (stored & (1 << s)) {
+			memcpy(sector, src, HAWK_SECTOR_BYTES);
+			src += HAWK_SECTOR_BYTES;
+		} else
+			memset(sector, t->fill[s], HAWK_SECTOR_BYTES);
+	}
+	img->cached = track;
+	return 0;
+}
+
+static struct disk_image *image_open(const char *path, int flags, unsigned depth);
+
+/* The base named by an overlay header, looked up next to the overlay */
+static void base_path(const char *path, const struct overlay_header *h,
+		      char *buf, size_t len)
+{
+	const char *slash = strrchr(path, '/');
+	int n = strnlen(h->base, OVERLAY_BASE_LEN);
+
+	if (h->base[0] == '/' || slash == NULL)
+		snprintf(buf, len, "%.*s", n, h->base);
+	else
+		snprintf(buf, len, "%.*s/%.*s", (int)(slash - path), path, n, h->base);
+}
+
+static int overlay_load(struct disk_image *img, const char *path,
+			const struct overlay_header *h, unsigned depth)
+{
+	uint8_t rec[4];
+	char base[4096];
+	off_t pos, size;
+	uint32_t lba;
+
+	if (get_le32(h->version) != OVERLAY_VERSION ||
+	    get_le32(h->sectors) != HAWK_IMAGE_SECTORS ||
+	    get_le32(h->sector_bytes) != HAWK_SECTOR_BYTES) {
+		fprintf(stderr, "%s: unsupported overlay format\n", path);
+		return -1;
+	}
+	if (depth == OVERLAY_MAX_DEPTH) {
+		fprintf(stderr, "%s: overlays nested too deep\n", path);
+		return -1;
+	}
+	base_path(path, h, base, sizeof(base));
+	img->base = image_open(base, O_RDONLY, depth + 1);
+	if (img->base == NULL) {
+		fprintf(stderr, "%s: can't open base image %s\n", path, base);
+		return -1;
+	}
+
+	img->data_offset = get_le32(h->data_offset);
+	if (pread(img->fd, img->bitmap, sizeof(img->bitmap),
+		  sizeof(*h)) != sizeof(img->bitmap)) {
+		fprintf(stderr, "%s: short overlay bitmap\n", path);
+		return -1;
+	}
+
+	/* Replay the records to find the latest copy of each sector. A
+	   record cut short by a crash is overwritten by the next write. */
+	img->where = calloc(HAWK_IMAGE_SECTORS, sizeof(*img->where));
+	if (img->where == NULL) {
+		perror(path);
+		return -1;
+	}
+	size = lseek(img->fd, 0, SEEK_END);
+	for (pos = img->data_offset; pos + OVERLAY_RECORD_BYTES <= size;
+	     pos += OVERLAY_RECORD_BYTES) {
+		if (pread(img->fd, rec, 4, pos) != 4)
+			break;
+		lba = get_le32(rec);
+		if (lba < HAWK_IMAGE_SECTORS)
+			img->where[lba] = pos + 4;
+	}
+	img->end = pos;
+	return 0;
+}
+
+static struct disk_image *image_open(const char *path, int flags, unsigned depth)
+{
+	struct overlay_header h;
+	struct disk_image *img;
+	int fd;
+
+	fd = open(path, flags | O_BINARY);
+	if (fd == -1)
+		return NULL;
+	img = calloc(1, sizeof(*img));
+	if (img == NULL) {
+		close(fd);
+		return NULL;
+	}
+	img->fd = fd;
+	if (pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+	    memcmp(h.magic, OVERLAY_MAGIC, sizeof(h.magic)) == 0) {
+		if (overlay_load(img, path, &h, depth)) {
+			disk_image_close(img);
+			return NULL;
+		}
+	} else if (memcmp(h.magic, COMPACT_MAGIC, sizeof(h.magic)) == 0) {
+		if (compact_load(img, path, (struct compact_header *)&h)) {
+			disk_image_close(img);
+			return NULL;
+		}
+	} else
+		img->data = map_image(fd, &img->len);
+	return img;
+}
+
+struct disk_image *disk_image_open(const char *path)
+{
+	struct disk_image *img = image_open(path, O_RDWR, 0);
+
+	/* A write protected platter still reads */
+	if (img == NULL && errno == EACCES)
+		img = image_open(path, O_RDONLY, 0);
+	return img;
+}
+
+void disk_image_close(struct disk_image *img)
+{
+	if (img == NULL)
+		return;
+	if (img->base)
+		disk_image_close(img->base);
+	free(img->where);
+	free(img->index);
+	free(img->track);
+	close(img->fd);
+	free(img);
+}
+
+static unsigned in_overlay(const struct disk_image *img, unsigned lba)
+{
+	return (img->bitmap[lba >> 3] & (1 << (lba & 7))) && img->where[lba];
+}
+
+const uint8_t *disk_image_sector(struct disk_image *img, unsigned lba, uint8_t *buf)
+{
+	off_t pos = (off_t)lba * HAWK_SECTOR_BYTES;
+
+	if (lba >= HAWK_IMAGE_SECTORS)
+		return NULL;
+	if (img->base) {
+		if (!in_overlay(img, lba))
+			return disk_image_sector(img->base, lba, buf);
+		pos = img->where[lba];
+	} else if (img->index) {
+		if (compact_decode(img, lba / HAWK_SECTS_PER_TRK))
+			return NULL;
+		return img->track + (lba % HAWK_SECTS_PER_TRK) * HAWK_SECTOR_BYTES;
+	} else if (img->data) {
+		return pos + HAWK_SECTOR_BYTES <= img->len ? img->data + pos : NULL;
+	}
+	if (pread(img->fd, buf, HAWK_SECTOR_BYTES, pos) != HAWK_SECTOR_BYTES)
+		return NULL;
+	return buf;
+}
+
+int disk_image_track(struct disk_image *img, unsigned lba, const uint8_t **sector,
+		     uint8_t *buf)
+{
+	off_t pos;
+	const uint8_t *data;
+	unsigned s;
+
+	lba -= lba % HAWK_SECTS_PER_TRK;
+	pos = (off_t)lba * HAWK_SECTOR_BYTES;
+	if (lba >= HAWK_IMAGE_SECTORS)
+		return -1;
+
+	if (img->base) {
+		if (disk_image_track(img->base, lba, sector, buf))
+			return -1;
+		/* Each sector has its own slot in buf, whoever filled it */
+		for (s = 0; s < HAWK_SECTS_PER_TRK; s++) {
+			uint8_t *slot = buf + s * HAWK_SECTOR_BYTES;
+
+			if (!in_overlay(img, lba + s))
+				continue;
+			if (pread(img->fd, slot, HAWK_SECTOR_BYTES,
+				  img->where[lba + s]) != HAWK_SECTOR_BYTES)
+				return -1;
+			sector[s] = slot;
+		}
+		return 0;
+	}
+
+	if (img->index) {
+		if (compact_decode(img, lba / HAWK_SECTS_PER_TRK))
+			return -1;
+		data = img->track;
+	} else if (img->data) {
+		if (pos >= img->len)
+			return -1;
+		if (pos + HAWK_TRACK_BYTES <= img->len)
+			data = img->data + pos;
+		else {
+			/* The image ends part way through the track */
+			memcpy(buf, img->data + pos, img->len - pos);
+			memset(buf + img->len - pos, 0, pos + HAWK_TRACK_BYTES - img->len);
+			data = buf;
+		}
+	} else {
+		ssize_t n = pread(img->fd, buf, HAWK_TRACK_BYTES, pos);
+
+		if (n <= 0)
+			return -1;
+		memset(buf + n, 0, HAWK_TRACK_BYTES - n);
+		data = buf;
+	}
+	for (s = 0; s < HAWK_SECTS_PER_TRK; s++)
+		sector[s] = data + s * HAWK_SECTOR_BYTES;
+	return 0;
+}
+
+int disk_image_write_sector(struct disk_image *img, unsigned lba, const uint8_t *data)
+{
+	uint8_t rec[OVERLAY_RECORD_BYTES];
+
+	if (lba >= HAWK_IMAGE_SECTORS || img->index)
+		return -1;
+	if (img->base == NULL) {
+		if (pwrite(img->fd, data, HAWK_SECTOR_BYTES,
+			   (off_t)lba * HAWK_SECTOR_BYTES) != HAWK_SECTOR_BYTES)
+			return -1;
+		return 0;
+	}
+
+	/* The record goes down before the bitmap says it is there */
+	put_le32(rec, lba);
+	memcpy(rec + 4, data, HAWK_SECTOR_BYTES);
+	if (pwrite(img->fd, rec, sizeof(rec), img->end) != sizeof(rec))
+		return -1;
+	img->where[lba] = img->end + 4;
+	img->end += sizeof(rec);
+	if (!(img->bitmap[lba >> 3] & (1 << (lba & 7)))) {
+		img->bitmap[lba >> 3] |= 1 << (lba & 7);
+		if (pwrite(img->fd, &img->bitmap[lba >> 3], 1,
+			   sizeof(struct overlay_header) + (lba >> 3)) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ *	Overlay maintenance
+ */
+
+static struct disk_image *open_overlay(const char *path)
+{
+	struct disk_image *img;
+
+	errno = 0;
+	img = image_open(path, O_RDWR, 0);
+
+	if (img == NULL) {
+		fprintf(stderr, "%s: %s\n", path, errno ? strerror(errno) : "bad image");
+		return NULL;
+	}
+	if (img->base == NULL) {
+		fprintf(stderr, "%s: not an overlay\n", path);
+		disk_image_close(img);
+		return NULL;
+	}
+	return img;
+}
+
+static unsigned overlay_sectors(const struct disk_image *img)
+{
+	unsigned lba, n = 0;
+
+	for (lba = 0; lba < HAWK_IMAGE_SECTORS; lba++)
+		n += in_overlay(img, lba);
+	return n;
+}
+
+int disk_image_create_overlay(const char *path, const char *base)
+{
+	static uint8_t zero[OVERLAY_DATA_OFFSET];
+	struct overlay_header h;
+	struct disk_image *img;
+	int fd;
+
+	if (strlen(base) >= OVERLAY_BASE_LEN) {
+		fprintf(stderr, "%s: base name too long\n", base);
+		return -1;
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, OVERLAY_MAGIC, sizeof(h.magic));
+	put_le32(h.version, OVERLAY_VERSION);
+	put_le32(h.sectors, HAWK_IMAGE_SECTORS);
+	put_le32(h.sector_bytes, HAWK_SECTOR_BYTES);
+	put_le32(h.data_offset, OVERLAY_DATA_OFFSET);
+	strcpy(h.base, base);
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_BINARY, 0666);
+	if (fd == -1) {
+		perror(path);
+		return -1;
+	}
+	if (write(fd, zero, sizeof(zero)) != sizeof(zero) ||
+	    pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+		perror(path);
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	close(fd);
+
+	/* Check that the base can be found from where the overlay is */
+	img = open_overlay(path);
+	if (img == NULL) {
+		unlink(path);
+		return -1;
+	}
+	disk_image_close(img);
+	return 0;
+}
+
+int disk_image_discard(const char *path)
+{
+	struct disk_image *img = open_overlay(path);
+	int r = 0;
+
+	if (img == NULL)
+		return -1;
+	memset(img->bitmap, 0, sizeof(img->bitmap));
+	if (pwrite(img->fd, img->bitmap, sizeof(img->bitmap),
+		   sizeof(struct overlay_header)) != sizeof(img->bitmap) ||
+	    ftruncate(img->fd, img->data_offset) == -1) {
+		perror(path);
+		r = -1;
+	}
+	disk_image_close(img);
+	return r;
+}
+
+/* Write the overlay's sectors into its base, then empty it */
+int disk_image_commit(const char *path)
+{
+	struct disk_image *img = open_overlay(path);
+	struct overlay_header h;
+	struct disk_image *base;
+	uint8_t buf[HAWK_SECTOR_BYTES];
+	char name[4096];
+	unsigned lba, n = 0;
+
+	if (img == NULL)
+		return -1;
+	/* The base is only open read-only for reads, reopen it to write */
+	if (pread(img->fd, &h, sizeof(h), 0) != sizeof(h)) {
+		perror(path);
+		disk_image_close(img);
+		return -1;
+	}
+	base_path(path, &h, name, sizeof(name));
+	base = image_open(name, O_RDWR, 0);
+	if (base == NULL) {
+		fprintf(stderr, "%s: can't open base image %s for writing\n", path, name);
+		disk_image_close(img);
+		return -1;
+	}
+	if (base->index) {
+		fprintf(stderr, "%s: %s is a compact image, expand it first\n", path, name);
+		disk_image_close(base);
+		disk_image_close(img);
+		return -1;
+	}
+	for (lba = 0; lba < HAWK_IMAGE_SECTORS; lba++) {
+		const uint8_t *data;
+
+		if (!in_overlay(img, lba))
+			continue;
+		data = disk_image_sector(img, lba, buf);
+		if (data == NULL || disk_image_write_sector(base, lba, data)) {
+			fprintf(stderr, "%s: commit failed at sector %u\n", path, lba);
+			disk_image_close(base);
+			disk_image_close(img);
+			return -1;
+		}
+		n++;
+	}
+	if (fsync(base->fd) == -1)
+		perror(name);
+	disk_image_close(base);
+	disk_image_close(img);
+	printf("%s: %u sectors committed to %s\n", path, n, name);
+	return disk_image_discard(path);
+}
+
+void disk_image_info(const char *path)
+{
+	struct disk_image *img;
+	struct overlay_header h;
+	char name[4096];
+
+	errno = 0;
+	img = image_open(path, O_RDONLY, 0);
+	if (img == NULL) {
+		fprintf(stderr, "%s: %s\n", path, errno ? strerror(errno) : "bad image");
+		return;
+	}
+	if (img->index) {
+		unsigned t, s, stored = 0;
+		uint64_t bytes = 0;
+
+		for (t = 0; t < img->tracks; t++) {
+			bytes += get_le32(img->index[t].length);
+			for (s = 0; s < HAWK_SECTS_PER_TRK; s++)
+				stored += (img->index[t].stored[s >> 3] >> (s & 7)) & 1;
+		}
+		printf("%s: compact image, %u of %u tracks, %u sectors stored, "
+			"%llu bytes of blocks\n", path, img->tracks,
+			HAWK_IMAGE_SECTORS / HAWK_SECTS_PER_TRK, stored,
+			(unsigned long long)bytes);
+	} else if (img->base == NULL) {
+		printf("%s: raw image, %u of %u sectors\n", path,
+			(unsigned)(lseek(img->fd, 0, SEEK_END) / HAWK_SECTOR_BYTES),
+			HAWK_IMAGE_SECTORS);
+	} else if (pread(img->fd, &h, sizeof(h), 0) == sizeof(h)) {
+		base_path(path, &h, name, sizeof(name));
+		printf("%s: overlay on %s, %u sectors modified, %lld bytes of records\n",
+			path, name, overlay_sectors(img),
+			(long long)(img->end - img->data_offset));
+	}
+	disk_image_close(img);
+}
+
+/*
+ *	Conversion. Both read any kind of image, up to the first track it
+ *	doesn't hold, and refuse to overwrite the output. A raw image that
+ *	ends part way through a track has the rest of it filled with zeros.
+ */
+
+static struct disk_image *open_input(const char *path, unsigned *tracks)
+{
+	const uint8_t *sector[HAWK_SECTS_PER_TRK];
+	uint8_t buf[HAWK_TRACK_BYTES];
+	struct disk_image *img;
+	struct stat st;
+
+	errno = 0;
+	img = image_open(path, O_RDONLY, 0);
+	if (img == NULL) {
+		fprintf(stderr, "%s: %s\n", path, errno ? strerror(errno) : "bad image");
+		return NULL;
+	}
+	for (*tracks = 0; *tracks < HAWK_IMAGE_SECTORS / HAWK_SECTS_PER_TRK; (*tracks)++)
+		if (disk_image_track(img, *tracks * HAWK_SECTS_PER_TRK, sector, buf))
+			break;
+	/* A compact image says how long it is, so that's damage */
+	if (img->index && *tracks < img->tracks) {
+		fprintf(stderr, "%s: track %u is corrupt\n", path, *tracks);
+		disk_image_close(img);
+		return NULL;
+	}
+	if (img->base == NULL && img->index == NULL &&
+	    fstat(img->fd, &st) == 0 && st.st_size % HAWK_TRACK_BYTES)
+		fprintf(stderr, "%s: last track is short, padded with zeros\n", path);
+	return img;
+}
+
+static unsigned is_fill(const uint8_t *sector)
+{
+	return sector[0] == sector[HAWK_SECTOR_BYTES - 1] &&
+		memcmp(sector, sector + 1, HAWK_SECTOR_BYTES - 1) == 0;
+}
+
+int disk_image_compact(const char *path, const char *out)
+{
+	const uint8_t *sector[HAWK_SECTS_PER_TRK];
+	uint8_t buf[HAWK_TRACK_BYTES], plain[HAWK_TRACK_BYTES], packed[HAWK_TRACK_BYTES];
+	struct compact_track *index = NULL;
+	struct compact_header h;
+	struct disk_image *img;
+	unsigned tracks, t, s, n;
+	off_t pos;
+	int fd = -1;
+
+	img = open_input(path, &tracks);
+	if (img == NULL)
+		return -1;
+	index = calloc(tracks ? tracks : 1, sizeof(*index));
+	if (index == NULL) {
+		perror(path);
+		goto fail;
+	}
+	fd = open(out, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+	if (fd == -1) {
+		perror(out);
+		goto fail;
+	}
+
+	pos = sizeof(h) + tracks * sizeof(*index);
+	for (t = 0; t < tracks; t++) {
+		struct compact_track *e = &index[t];
+		const uint8_t *data = plain;
+		unsigned stored = 0;
+		size_t len;
+
+		if (disk_image_track(img, t * HAWK_SECTS_PER_TRK, sector, buf))
+			goto fail_read;
+		for (s = n = 0; s < HAWK_SECTS_PER_TRK; s++) {
+			if (is_fill(sector[s])) {
+				e->fill[s] = sector[s][0];
+				continue;
+			}
+			stored |= 1 << s;
+			memcpy(plain + n++ * HAWK_SECTOR_BYTES, sector[s], HAWK_SECTOR_BYTES);
+		}
+		len = n * HAWK_SECTOR_BYTES;
+		if (len) {
+			size_t c = lz_compress(plain, len, packed, len - 1);
+
+			if (c) {
+				data = packed;
+				len = c;
+				e->packed = 1;
+			}
+			if (pwrite(fd, data, len, pos) != len)
+				goto fail_write;
+			put_le32(e->offset, pos);
+		}
+		put_le32(e->length, len);
+		e->stored[0] = stored;
+		e->stored[1] = stored >> 8;
+		pos += len;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, COMPACT_MAGIC, sizeof(h.magic));
+	put_le32(h.version, COMPACT_VERSION);
+	put_le32(h.tracks, tracks);
+	put_le32(h.sectors_per_track, HAWK_SECTS_PER_TRK);
+	put_le32(h.sector_bytes, HAWK_SECTOR_BYTES);
+	if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+	    pwrite(fd, index, tracks * sizeof(*index), sizeof(h)) !=
+	    tracks * sizeof(*index))
+		goto fail_write;
+	if (close(fd) == -1) {
+		fd = -1;
+		goto fail_write;
+	}
+	free(index);
+	disk_image_close(img);
+	return 0;
+
+fail_read:
+	fprintf(stderr, "%s: read failed at track %u\n", path, t);
+	goto fail;
+fail_write:
+	perror(out);
+fail:
+	if (fd != -1) {
+		close(fd);
+		unlink(out);
+	}
+	free(index);
+	disk_image_close(img);
+	return -1;
+}
+
+int disk_image_expand(const char *path, const char *out)
+{
+	const uint8_t *sector[HAWK_SECTS_PER_TRK];
+	uint8_t buf[HAWK_TRACK_BYTES];
+	struct disk_image *img;
+	unsigned tracks, t, s;
+	int fd, r = 0;
+
+	img = open_input(path, &tracks);
+	if (img == NULL)
+		return -1;
+	fd = open(out, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+	if (fd == -1) {
+		perror(out);
+		disk_image_close(img);
+		return -1;
+	}
+	for (t = 0; t < tracks && r == 0; t++) {
+		if (disk_image_track(img, t * HAWK_SECTS_PER_TRK, sector, buf)) {
+			fprintf(stderr, "%s: read failed at track %u\n", path, t);
+			r = -1;
+			break;
+		}
+		for (s = 0; s < HAWK_SECTS_PER_TRK && r == 0; s++)
+			if (write(fd, sector[s], HAWK_SECTOR_BYTES) != HAWK_SECTOR_BYTES) {
+				perror(out);
+				r = -1;
+			}
+	}
+	if (close(fd) == -1 && r == 0) {
+		perror(out);
+		r = -1;
+	}
+	if (r)
+		unlink(out);
+	disk_image_close(img);
+	return r;
+}
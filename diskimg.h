@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hawk.h"
+
+/*
+ *	Hawk platter images
+ *
+ *	A platter is HAWK_IMAGE_SECTORS sectors of HAWK_SECTOR_BYTES, addressed
+ *	by (cylinder << 5) | (head << 4) | sector. An image file is a raw copy
+ *	of the platter, a compact image, or an overlay on top of a read-only
+ *	base image.
+ *
+ *	A compact image is read-only and stores the platter a track at a time:
+ *
+ *	header		struct compact_header
+ *	index		struct compact_track for each track
+ *	blocks		the sectors of each track that aren't a single byte
+ *			repeated, compressed as one block if that helps
+ *
+ *	Sectors of one repeated byte (most of them, on the average archived
+ *	platter) cost a byte in the index. Blocks use a small LZ77 codec in
+ *	diskimg.c, and are decoded a whole track at a time.
+ *
+ *	An overlay is:
+ *
+ *	header		struct overlay_header, naming the base image
+ *	bitmap		one bit per sector, set once the overlay holds it
+ *	data		overlay records, appended in the order written
+ *
+ *	Each record is a little endian 32 bit sector number followed by the
+ *	sector. A sector written more than once has a record per write and
+ *	the last one wins. Reads of sectors not in the bitmap go to the base,
+ *	so a fresh overlay costs a few KB however big the platter.
+ *
+ *	Raw and compact images are mapped read-only and shared by everything
+ *	in the process that opens the same file, overlays share their base.
+ */
+
+#define HAWK_IMAGE_SECTORS \
+	(HAWK_NUM_CYLINDERS * HAWK_NUM_HEADS * HAWK_SECTS_PER_TRK)
+#define HAWK_TRACK_BYTES	(HAWK_SECTS_PER_TRK * HAWK_SECTOR_BYTES)
+
+struct disk_image;
+
+/* NULL if the file doesn't exist or isn't a usable image */
+struct disk_image *disk_image_open(const char *path);
+void disk_image_close(struct disk_image *img);
+
+/* The sector, read into buf if it can't be returned directly. NULL if the
+   image is too short to hold it. The sector stays valid until the next
+   read from the image. */
+const uint8_t *disk_image_sector(struct disk_image *img, unsigned lba, uint8_t *buf);
+/* Every sector of the track holding lba, the same way. buf holds a track,
+   and sector[] gets HAWK_SECTS_PER_TRK pointers. */
+int disk_image_track(struct disk_image *img, unsigned lba, const uint8_t **sector,
+		     uint8_t *buf);
+/* Compact images can't be written, put an overlay on them */
+int disk_image_write_sector(struct disk_image *img, unsigned lba, const uint8_t *data);
+
+/* Maintenance, for hawkimg. Errors are reported to stderr. */
+int disk_image_create_overlay(const char *path, const char *base);
+int disk_image_commit(const char *path);
+int disk_image_discard(const char *path);
+/* Any kind of image to a new compact or raw one */
+int disk_image_compact(const char *path, const char *out);
+int disk_image_expand(const char *path, const char *out);
+void disk_image_info(const char *path);
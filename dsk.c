@@ -1,18 +1,19 @@
 #include <assert.h>
-#include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "cpu6.h"
+#include "diskimg.h"
 #include "dma.h"
 #include "dsk.h"
 #include "hawk.h"
+#include "log.h"
 #include "scheduler.h"
-
-#ifndef O_BINARY
-#define O_BINARY 0
-#endif
+#include "snapshot.h"
+#include "stats.h"
 
 /* DSK: A controller for the CDC 9427H "Hawk" drive
  *
@@ -44,65 +45,10 @@
 #define NUM_HAWK_DRIVES 4
 
 // This seems to be hardcoded (or configurable by jumpers?)
-static uint8_t dsk_irq = 2;
-
-// F140 selected unit
-static uint8_t dsk_selected_unit;
-
-// F143 write enable mask
-static uint8_t dsk_write_mask;
-
-static uint16_t dsk_cylinder;
-static uint8_t  dsk_head;
-static uint8_t  dsk_sector;
-
-static unsigned dsk_interrupt_enabled;
-static unsigned dsk_interrupt_ack;
-static uint16_t dsk_status;
-
-static unsigned dsk_tracing;
-static unsigned dsk_transfer_mode; // 1=read, 0=write
-
-static unsigned dsk_transfer_count; // number of bytes transferred during current sector
+static const uint8_t dsk_irq = 2;
 
 static void dsk_timeout_cb(struct event_t* event, int64_t late_ns);
-static struct event_t dsk_timeout_evt = {
-	.name = "dsk_timeout",
-	.delta_ns = 100 * ONE_MILISECOND_NS,
-	.callback = dsk_timeout_cb
-};
-
 static void dsk_runstate_cb(struct event_t* event, int64_t late_ns);
-static struct event_t dsk_runstate_evt = {
-	.name = "dsk_runstate",
-	.delta_ns = 0,
-	.callback = dsk_runstate_cb
-};
-
-// Format Error
-// Controller couldn't find the sync pattern before address or data.
-// Sync pattern is ~87 zeros then a one
-static uint8_t dsk_fmt_err;
-
-// Addr Error
-// Controller read 16bit address at start of sector, and it was for the
-// it didn't match the controllers sector register (F141/F142)
-static uint8_t dsk_addr_err;
-
-// Timeout Error
-// Controller state machine timed out.
-// For reads/writes, It didn't see correct sector index from hawk unit.
-// For seeks/rtz, It probally didn't see on_cyl from unit
-static uint8_t dsk_timeout;
-
-// CRC Error
-// Controller encountered a CRC error after address read or data read.
-static uint8_t dsk_crc_error;
-
-static uint8_t dsk_seek_active;
-static uint8_t dsk_seek_complete;
-
-static struct hawk_drive hawk[NUM_HAWK_DRIVES];
 
 static void dsk_seek(unsigned trace);
 static void dsk_update_status();
@@ -137,19 +83,111 @@ static const char *dsk_state_names[] = {
 	"FINISH",
 };
 
-static enum dsk_state_t dsk_state = STATE_IDLE;
-static enum dsk_state_t dsk_old_state = STATE_IDLE;
+/*
+ *	Controller and drive state. There is one per machine, reached through
+ *	the thread's current machine (see machine.h).
+ */
+struct dsk_state {
+	// F140 selected unit
+	uint8_t selected_unit;
+
+	// F143 write enable mask
+	uint8_t write_mask;
+
+	uint16_t cylinder;
+	uint8_t  head;
+	uint8_t  sector;
+
+	unsigned interrupt_enabled;
+	unsigned interrupt_ack;
+	uint16_t status;
+
+	unsigned tracing;
+	unsigned transfer_mode; // 1=read, 0=write
+
+	unsigned transfer_count; // number of bytes transferred during current sector
+
+	struct event_t timeout_evt;
+	struct event_t runstate_evt;
+
+	// Format Error
+	// Controller couldn't find the sync pattern before address or data.
+	// Sync pattern is ~87 zeros then a one
+	uint8_t fmt_err;
+
+	// Addr Error
+	// Controller read 16bit address at start of sector, and it was for the
+	// it didn't match the controllers sector register (F141/F142)
+	uint8_t addr_err;
+
+	// Timeout Error
+	// Controller state machine timed out.
+	// For reads/writes, It didn't see correct sector index from hawk unit.
+	// For seeks/rtz, It probally didn't see on_cyl from unit
+	uint8_t timeout;
+
+	// CRC Error
+	// Controller encountered a CRC error after address read or data read.
+	uint8_t crc_error;
+
+	uint8_t seek_active;
+	uint8_t seek_complete;
+
+	struct hawk_drive hawk[NUM_HAWK_DRIVES];
+
+	/* Image for each platter, hawk<unit>.disk when not set */
+	char *image[NUM_HAWK_DRIVES * 2];
+
+	enum dsk_state_t state;
+	enum dsk_state_t old_state;
+};
+
+static _Thread_local struct dsk_state *dsk;
+
+struct dsk_state *dsk_create(void)
+{
+	struct dsk_state *d = calloc(1, sizeof(*d));
+
+	if (d == NULL) {
+		perror("dsk_create");
+		exit(1);
+	}
+	d->timeout_evt.name = "dsk_timeout";
+	d->timeout_evt.delta_ns = 100 * ONE_MILISECOND_NS;
+	d->timeout_evt.callback = dsk_timeout_cb;
+	d->runstate_evt.name = "dsk_runstate";
+	d->runstate_evt.delta_ns = 0;
+	d->runstate_evt.callback = dsk_runstate_cb;
+	d->state = STATE_IDLE;
+	d->old_state = STATE_IDLE;
+	return d;
+}
+
+void dsk_destroy(struct dsk_state *d)
+{
+	int drive;
+
+	for (drive = 0; drive < NUM_HAWK_DRIVES; drive++)
+		hawk_release(&d->hawk[drive]);
+	for (drive = 0; drive < NUM_HAWK_DRIVES * 2; drive++)
+		free(d->image[drive]);
+	free(d);
+}
 
+void dsk_bind(struct dsk_state *d)
+{
+	dsk = d;
+}
 
 static void dsk_reschedule(int64_t delta_ns)
 {
-	dsk_runstate_evt.delta_ns = delta_ns;
-	schedule_event(&dsk_runstate_evt);
+	dsk->runstate_evt.delta_ns = delta_ns;
+	schedule_event(&dsk->runstate_evt);
 }
 
 static void dsk_goto_finish() {
-	dsk_state = STATE_FINISH;
-	cancel_event(&dsk_timeout_evt);
+	dsk->state = STATE_FINISH;
+	cancel_event(&dsk->timeout_evt);
 	hawk_set_dma(0);
 
 	dsk_reschedule(0); // Immediately
@@ -157,7 +195,7 @@ static void dsk_goto_finish() {
 
 static void dsk_check_sync(enum dsk_state_t success_state, int64_t time)
 {
-	struct hawk_drive* unit = &hawk[dsk_selected_unit / 2];
+	struct hawk_drive* unit = &dsk->hawk[dsk->selected_unit / 2];
 
 	hawk_update(unit, time);
 	if (hawk_wait_sync(unit))
@@ -189,17 +227,17 @@ static void dsk_check_sync(enum dsk_state_t success_state, int64_t time)
 	unit->data_ptr = pos+1;
 
 	if (zero_count < zero_threshold || sync_count < HAWK_GAP_BITS) {
-		dsk_fmt_err = 1;
+		dsk->fmt_err = 1;
 		dsk_goto_finish();
 		return;
 	}
 
-	dsk_state = success_state;
+	dsk->state = success_state;
 }
 
 static void dsk_verify_addr(int64_t time)
 {
-	struct hawk_drive* unit = &hawk[dsk_selected_unit / 2];
+	struct hawk_drive* unit = &dsk->hawk[dsk->selected_unit / 2];
 
 	int remaining = hawk_remaining_bits(unit, time);
 
@@ -208,24 +246,25 @@ static void dsk_verify_addr(int64_t time)
 		return;
 	}
 
-	uint16_t expected = (dsk_cylinder << 5) | (dsk_head << 4) | dsk_sector;
+	uint16_t expected = (dsk->cylinder << 5) | (dsk->head << 4) | dsk->sector;
 	uint16_t addr = hawk_read_word(unit);
 	// Guess: checkword is just inverted addrs
 	uint16_t checkword = ~hawk_read_word(unit);
 
 	if (addr != expected || checkword != expected) {
-		fprintf(stderr, "Addr error: %04hx != %04hx || %04hx != %04hx\n", addr, expected, checkword, expected);
-		dsk_addr_err = 1;
+		LOG_WARN(TRACE_DSK, "Address error: %04hx != %04hx || %04hx != %04hx",
+			 addr, expected, checkword, expected);
+		dsk->addr_err = 1;
 		dsk_goto_finish();
 		return;
 	}
 
-	dsk_state = STATE_DATA_SYNC;
+	dsk->state = STATE_DATA_SYNC;
 }
 
 static void dsk_read_data(int64_t time)
 {
-	struct hawk_drive* unit = &hawk[dsk_selected_unit / 2];
+	struct hawk_drive* unit = &dsk->hawk[dsk->selected_unit / 2];
 	//time = get_current_time();
 	int remaining = hawk_remaining_bits(unit, time);
 
@@ -237,8 +276,8 @@ static void dsk_read_data(int64_t time)
 		// 	fprintf(stderr, "\n");
 		// }
 		remaining -= 8;
-		if (--dsk_transfer_count == 0) {
-			dsk_state = STATE_CRC;
+		if (--dsk->transfer_count == 0) {
+			dsk->state = STATE_CRC;
 			return;
 		}
 	}
@@ -249,7 +288,7 @@ static void dsk_read_data(int64_t time)
 
 static void dsk_do_crc(int64_t time)
 {
-	struct hawk_drive* unit = &hawk[dsk_selected_unit / 2];
+	struct hawk_drive* unit = &dsk->hawk[dsk->selected_unit / 2];
 	int remaining = hawk_remaining_bits(unit, time);
 
 	if (remaining < 16) {
@@ -257,74 +296,75 @@ static void dsk_do_crc(int64_t time)
 		return;
 	}
 
-	if (dsk_transfer_mode == 1) {
+	if (dsk->transfer_mode == 1) {
 		uint16_t crc = hawk_read_word(unit);
 		// TODO: Proper CRC function
 		if (crc != 0xcccc) {
-			fprintf(stderr, "DSK: CRC error. Got 0x%04x\n", crc);
-			dsk_crc_error = 1;
+			LOG_WARN(TRACE_DSK, "CRC error. Got 0x%04x", crc);
+			dsk->crc_error = 1;
 			dsk_goto_finish();
 		} else {
-			dsk_sector = (dsk_sector + 1) & 0xf;
-			hawk_wait_sector(unit, dsk_sector);
-			dsk_state = STATE_WAIT_SECTOR;
+			STAT_INC(dsk_sectors);
+			dsk->sector = (dsk->sector + 1) & 0xf;
+			hawk_wait_sector(unit, dsk->sector);
+			dsk->state = STATE_WAIT_SECTOR;
 		}
 	} else {
-		fprintf(stderr, "DISK unimplemented transfer mode %d\n", dsk_transfer_mode);
+		LOG_WARN(TRACE_DSK, "Unimplemented transfer mode %d", dsk->transfer_mode);
 	}
 }
 
 static void dsk_run_state_machine(unsigned trace, int64_t time)
 {
-	unsigned drive = dsk_selected_unit / 2;
+	unsigned drive = dsk->selected_unit / 2;
 	unsigned drive_bit = 1 << drive;
-	dsk_tracing = trace;
+	dsk->tracing = trace;
 
 	do {
-		if (dsk_old_state != dsk_state) {
-			dsk_old_state = dsk_state;
+		if (dsk->old_state != dsk->state) {
+			dsk->old_state = dsk->state;
 
 			if (trace)
-				fprintf(stderr, "DSK: state machine moved to %s\n", dsk_state_names[dsk_state]);
+				fprintf(stderr, "DSK: state machine moved to %s\n", dsk_state_names[dsk->state]);
 		}
 
-		switch (dsk_state) {
+		switch (dsk->state) {
 		case STATE_SEEK:
 			// Start a sync
 			dsk_seek(trace);
-			if (hawk[drive].addr_ack) {
-				dsk_state = STATE_WAIT_SEEK;
+			if (dsk->hawk[drive].addr_ack) {
+				dsk->state = STATE_WAIT_SEEK;
 
-				dsk_seek_active |= drive_bit;
-				dsk_seek_complete &= ~drive_bit;
+				dsk->seek_active |= drive_bit;
+				dsk->seek_complete &= ~drive_bit;
 			}
 			break;
 		case STATE_RTZ:
 			// start a rtz
-			hawk_rtz(&hawk[drive], dsk_selected_unit & 1);
-			if (hawk[drive].addr_ack) {
-				dsk_seek_active |= drive_bit;
-				dsk_seek_complete &= ~drive_bit;
-				dsk_state = STATE_WAIT_SEEK;
+			hawk_rtz(&dsk->hawk[drive], dsk->selected_unit & 1);
+			if (dsk->hawk[drive].addr_ack) {
+				dsk->seek_active |= drive_bit;
+				dsk->seek_complete &= ~drive_bit;
+				dsk->state = STATE_WAIT_SEEK;
 			}
 			break;
 		case STATE_WAIT_SEEK:
 			// Wait until all active seeks/RTZs are complete
-			if (dsk_seek_active == 0) {
+			if (dsk->seek_active == 0) {
 				dsk_goto_finish();
 			}
 			break;
 
 		case STATE_START:
 			// Start of a read or write
-			hawk_wait_sector(&hawk[drive], dsk_sector);
-			dsk_state = STATE_WAIT_SECTOR;
+			hawk_wait_sector(&dsk->hawk[drive], dsk->sector);
+			dsk->state = STATE_WAIT_SECTOR;
 			break;
 		case STATE_WAIT_SECTOR:
 			// wait for the sector
-			hawk_update(&hawk[drive], time);
-			if (hawk[drive].sector_pulse && hawk[drive].sector_addr == dsk_sector) {
-				dsk_state = STATE_ADDR_SYNC;
+			hawk_update(&dsk->hawk[drive], time);
+			if (dsk->hawk[drive].sector_pulse && dsk->hawk[drive].sector_addr == dsk->sector) {
+				dsk->state = STATE_ADDR_SYNC;
 			}
 			break;
 		case STATE_ADDR_SYNC:
@@ -338,9 +378,9 @@ static void dsk_run_state_machine(unsigned trace, int64_t time)
 			// wait for a sync
 			// guess: In order to allow enough time for the current instruction to finish
 			//        DSK requests a DMA lock as soon as it starts looking for sync
-			hawk_set_dma(dsk_transfer_mode);
+			hawk_set_dma(dsk->transfer_mode);
 			dsk_check_sync(STATE_READ_DATA, time);
-			dsk_transfer_count = HAWK_SECTOR_BYTES;
+			dsk->transfer_count = HAWK_SECTOR_BYTES;
 			break;
 		case STATE_READ_DATA:
 			// read data
@@ -353,95 +393,121 @@ static void dsk_run_state_machine(unsigned trace, int64_t time)
 		case STATE_FINISH:
 			// Guess: If interrupts are enabled, we stay here until the
 			// interrupt is cleared.
-			if (dsk_interrupt_enabled && !dsk_interrupt_ack) {
+			if (dsk->interrupt_enabled && !dsk->interrupt_ack) {
 				cpu_assert_irq(dsk_irq);
 				if (trace)
 					fprintf(stderr, "DSK: interrupt asserted\n");
-			} else if (dsk_interrupt_ack) {
+			} else if (dsk->interrupt_ack) {
 				if (trace)
 					fprintf(stderr, "DSK: interrupt acked\n");
-				dsk_interrupt_ack = 0;
+				dsk->interrupt_ack = 0;
 				cpu_deassert_irq(dsk_irq);
-				dsk_state = STATE_IDLE;
+				dsk->state = STATE_IDLE;
 			} else {
-				dsk_state = STATE_IDLE;
+				dsk->state = STATE_IDLE;
 			}
 		case STATE_IDLE:
 			break;
 		}
 
-		dsk_interrupt_ack = 0;
+		dsk->interrupt_ack = 0;
 
 		// Testing on real hardware suggests status register is latched to only
 		// update on state machine change
 		dsk_update_status();
 
-	} while (dsk_state != dsk_old_state);
+	} while (dsk->state != dsk->old_state);
 }
 
 static void dsk_runstate_cb(struct event_t* event, int64_t late_ns)
 {
 	int64_t time = get_current_time() - late_ns;
-	dsk_run_state_machine(dsk_tracing, time);
+	dsk_run_state_machine(dsk->tracing, time);
 }
 
 static void dsk_timeout_cb(struct event_t* event, int64_t late_ns)
 {
-	if (dsk_tracing) {
+	if (dsk->tracing) {
 		fprintf(stderr, "DSK: timeout in state %s\n",
-			dsk_state_names[dsk_state]);
+			dsk_state_names[dsk->state]);
 	}
 
 	// Kill any outstanding DMA transfers
 	hawk_set_dma(0);
 
-	dsk_timeout = 1;
+	dsk->timeout = 1;
 	dsk_goto_finish();
 }
 
 void dsk_hawk_changed(unsigned drive, int64_t time)
 {
-	if (hawk[drive].on_cyl) {
+	if (dsk->hawk[drive].on_cyl) {
 		unsigned drive_bit = 1 << drive;
 
-		if (dsk_seek_active & drive_bit) {
-			dsk_seek_active &= ~drive_bit;
-			dsk_seek_complete |= drive_bit;
+		if (dsk->seek_active & drive_bit) {
+			dsk->seek_active &= ~drive_bit;
+			dsk->seek_complete |= drive_bit;
 		}
 	}
 
-	dsk_run_state_machine(dsk_tracing, time);
+	dsk_run_state_machine(dsk->tracing, time);
 }
 
-void dsk_init(void)
+/* Use path instead of hawk<unit>.disk, must be called before dsk_init */
+void dsk_set_image(unsigned unit, const char *path)
+{
+	if (unit >= NUM_HAWK_DRIVES * 2)
+		return;
+	free(dsk->image[unit]);
+	dsk->image[unit] = strdup(path);
+}
+
+/* A command is in flight */
+unsigned dsk_busy(void)
+{
+	return dsk->state != STATE_IDLE;
+}
+
+static struct disk_image *dsk_open_image(unsigned unit)
 {
-	int drive, fd1, fd2, unit;
 	char name[32];
 
+	if (dsk->image[unit])
+		return disk_image_open(dsk->image[unit]);
+	snprintf(name, sizeof(name), "hawk%u.disk", unit);
+	return disk_image_open(name);
+}
+
+void dsk_init(void)
+{
+	struct disk_image *img1, *img2;
+	int drive, unit;
+
 	for (drive = 0; drive < NUM_HAWK_DRIVES; drive++) {
 		unit = drive * 2;
 
 		// Removable Platter
-		snprintf(name, sizeof(name), "hawk%u.disk", unit);
-		fd1 = open(name, O_RDWR|O_BINARY);
+		img1 = dsk_open_image(unit);
 
 		// Fixed Platter
-		snprintf(name, sizeof(name), "hawk%u.disk", unit + 1);
-		fd2 = open(name, O_RDWR|O_BINARY);
+		img2 = dsk_open_image(unit + 1);
 
 		// We don't check status of opens
 
-		hawk_init(&hawk[drive], drive, fd1, fd2);
+		hawk_init(&dsk->hawk[drive], drive, img1, img2);
+		register_event(&dsk->hawk[drive].event);
 	}
+	register_event(&dsk->timeout_evt);
+	register_event(&dsk->runstate_evt);
 }
 
 static void dsk_update_status() {
-	unsigned drive = dsk_selected_unit / 2;
-	struct hawk_drive *u = &hawk[drive];
+	unsigned drive = dsk->selected_unit / 2;
+	struct hawk_drive *u = &dsk->hawk[drive];
 
-	unsigned busy = dsk_state != STATE_IDLE;
+	unsigned busy = dsk->state != STATE_IDLE;
 
-	dsk_status = (dsk_seek_complete & 0x0f) // bits 0-3. One per hawk unit
+	dsk->status = (dsk->seek_complete & 0x0f) // bits 0-3. One per hawk unit
 	     | (u->ready      << 4)   // Probably the ready signal from drive
 	     | (u->on_cyl     << 5)   // Head is on the correct cylinder
 	     | (0             << 6)   // write enable
@@ -450,9 +516,9 @@ static void dsk_update_status() {
 	     | (u->fault      << 9)   // drive fault
 	     | (u->seek_error << 10)  // Guess. Causes OPSYS to retry
 	     | (0             << 11)  // not seen
-	     | (dsk_fmt_err   << 12)  // Format Error (couldn't find preamble before address or data)
-	     | (dsk_addr_err  << 13)  // Address Error (address didn't match)
-	     | (dsk_timeout   << 14)  // Seek error line from drive
+	     | (dsk->fmt_err   << 12)  // Format Error (couldn't find preamble before address or data)
+	     | (dsk->addr_err  << 13)  // Address Error (address didn't match)
+	     | (dsk->timeout   << 14)  // Seek error line from drive
 	     | (0             << 15); // not seen
 
 	if (busy & u->fault) {
@@ -462,10 +528,10 @@ static void dsk_update_status() {
 }
 
 static void hawk_clear_controller_error() {
-	dsk_crc_error = 0;
-	dsk_addr_err = 0;
-	dsk_fmt_err = 0;
-	dsk_timeout = 0;
+	dsk->crc_error = 0;
+	dsk->addr_err = 0;
+	dsk->fmt_err = 0;
+	dsk->timeout = 0;
 }
 
 /*	"Cylinder  0 - 405
@@ -494,15 +560,15 @@ static void hawk_clear_controller_error() {
  */
 static void dsk_seek(unsigned trace)
 {
-	unsigned drive = dsk_selected_unit / 2;
-	unsigned fixed = dsk_selected_unit & 1;
+	unsigned drive = dsk->selected_unit / 2;
+	unsigned fixed = dsk->selected_unit & 1;
 
 	if (trace)
 		fprintf(stderr, "%04x: %i Seek to %u/%u/%u\n", cpu6_pc(), drive,
-			dsk_cylinder, dsk_head, dsk_sector);
+			dsk->cylinder, dsk->head, dsk->sector);
 
-	if (hawk[drive].ready) {
-		hawk_seek(&hawk[drive], fixed, dsk_cylinder, dsk_head);
+	if (dsk->hawk[drive].ready) {
+		hawk_seek(&dsk->hawk[drive], fixed, dsk->cylinder, dsk->head);
 	}
 }
 
@@ -538,12 +604,13 @@ void hawk_dma_done(void)
  */
 static void dsk_cmd(uint8_t cmd, unsigned trace)
 {
-	if (dsk_state != STATE_IDLE) {
+	if (dsk->state != STATE_IDLE) {
 		if (trace)
 			fprintf(stderr, "%04X: statemachine busy. cmd=%i\n", cpu6_pc(), cmd);
 	}
 
-	schedule_event(&dsk_timeout_evt);
+	schedule_event(&dsk->timeout_evt);
+	STAT_INC(dsk_commands);
 
 	// Controller errors appear to be cleared when starting a new command
 	hawk_clear_controller_error();
@@ -552,30 +619,29 @@ static void dsk_cmd(uint8_t cmd, unsigned trace)
 	case 0:		/* Multi sector read  - 1 to 16 sectors */
 		if (trace)
 			fprintf(stderr, "%04X: hawk %i Read %i bytes\n", cpu6_pc(),
-				dsk_selected_unit, cpu6_dma_count());
-		dsk_transfer_mode = 1;
-		dsk_state = STATE_START;
+				dsk->selected_unit, cpu6_dma_count());
+		dsk->transfer_mode = 1;
+		dsk->state = STATE_START;
 		break;
 	case 1:		/* Multi sector write - ditto */
 		if (trace)
 			fprintf(stderr, "%04X: hawk %i Write %i bytes\n", cpu6_pc(),
-				dsk_selected_unit, cpu6_dma_count());
-		dsk_transfer_mode = 2;
-        dsk_state = STATE_START;
+				dsk->selected_unit, cpu6_dma_count());
+		dsk->transfer_mode = 2;
+        dsk->state = STATE_START;
 		break;
 	case 2:		/* Seek */
-		dsk_state = STATE_SEEK;
+		dsk->state = STATE_SEEK;
 		break;
 	case 3:		/* Return to Track Zero Sector (Recalibrate) */
 		if (trace)
 			fprintf(stderr, "%04X: hawk %i Return to Zero\n", cpu6_pc(),
-				dsk_selected_unit);
-		dsk_state = STATE_RTZ;
+				dsk->selected_unit);
+		dsk->state = STATE_RTZ;
 		break;
 	case 4:		/* Format sector - Ken thinks but not sure */
 	default:
-		fprintf(stderr, "%04X: Unknown hawk command %02X\n",
-			cpu6_pc(), cmd);
+		LOG_WARN_PC(TRACE_DSK, "Unknown hawk command %02X", cmd);
 		break;
 	}
 }
@@ -584,7 +650,7 @@ void dsk_write(uint16_t addr, uint8_t val, unsigned trace)
 {
 	switch (addr) {
 	case 0xF140:
-		dsk_selected_unit = val;
+		dsk->selected_unit = val;
 
 		// guess, selecting unit updates status
 		dsk_update_status();
@@ -593,15 +659,15 @@ void dsk_write(uint16_t addr, uint8_t val, unsigned trace)
 		break;
 	case 0xF141:
 		// bits are xxCC_CCCC_CCCH_SSSS
-		dsk_cylinder &= 0x007;
-		dsk_cylinder |= (val << 3);
+		dsk->cylinder &= 0x007;
+		dsk->cylinder |= (val << 3);
 		break;
 	case 0xF142:
 		// continued
-		dsk_cylinder &= 0x7f8;
-		dsk_cylinder |= val >> 5;
-		dsk_head = !!(val & 0x10);
-		dsk_sector = val & 0x0f;
+		dsk->cylinder &= 0x7f8;
+		dsk->cylinder |= val >> 5;
+		dsk->head = !!(val & 0x10);
+		dsk->sector = val & 0x0f;
 		break;
 	case 0xF143:
 		/* "It is a Write Enable Bit Mask to help protect against writing to a
@@ -617,7 +683,7 @@ void dsk_write(uint16_t addr, uint8_t val, unsigned trace)
 		*  128 = Write Enable Platter = 1 drive 4
 		*  Regards, Ken R."
 		*/
-                dsk_write_mask = val;
+                dsk->write_mask = val;
 		break;
 	case 0xF144:
 	case 0xF145:
@@ -632,31 +698,30 @@ void dsk_write(uint16_t addr, uint8_t val, unsigned trace)
 		// Guess, it's forcing the state machine to FINISH which will trigger
 		// an interrupt if interrupts are enabled.
 		if (trace)
-			fprintf(stderr, "%04X: hawk %i Force Interrupt\n", cpu6_pc(), dsk_selected_unit);
-		dsk_state = STATE_FINISH;
+			fprintf(stderr, "%04X: hawk %i Force Interrupt\n", cpu6_pc(), dsk->selected_unit);
+		dsk->state = STATE_FINISH;
 		break;
 	case 0xF14D:
 		// Disable interrupts.
 		if (trace)
-			fprintf(stderr, "%04X: hawk %i Disable Interrupts\n", cpu6_pc(), dsk_selected_unit);
-		dsk_interrupt_enabled = 0;
+			fprintf(stderr, "%04X: hawk %i Disable Interrupts\n", cpu6_pc(), dsk->selected_unit);
+		dsk->interrupt_enabled = 0;
 		break;
 	case 0xF14E:
 		// Strobe. Enable interrupt on FINISH
 		if (trace)
-			fprintf(stderr, "%04X: hawk %i Enable Interrupt\n", cpu6_pc(), dsk_selected_unit);
-		dsk_interrupt_enabled = 1;
+			fprintf(stderr, "%04X: hawk %i Enable Interrupt\n", cpu6_pc(), dsk->selected_unit);
+		dsk->interrupt_enabled = 1;
 		break;
 	case 0xF14F:
 		// Strobe. Acknowledge interrupt
 		if (trace)
-			fprintf(stderr, "%04X: hawk %i Acknowledge Interrupt\n", cpu6_pc(), dsk_selected_unit);
-		dsk_interrupt_ack = 1;
+			fprintf(stderr, "%04X: hawk %i Acknowledge Interrupt\n", cpu6_pc(), dsk->selected_unit);
+		dsk->interrupt_ack = 1;
 		break;
 	default:
-		fprintf(stderr,
-			"%04X: Unknown hawk I/O write %04X with %02X\n",
-			cpu6_pc(), addr, val);
+		LOG_WARN_PC(TRACE_IO, "Unknown hawk I/O write %04X with %02X",
+			    addr, val);
 		return;
 	}
 
@@ -666,7 +731,7 @@ void dsk_write(uint16_t addr, uint8_t val, unsigned trace)
 uint8_t dsk_read(uint16_t addr, unsigned trace)
 {
 	uint8_t status;
-	unsigned drive = dsk_selected_unit / 2;
+	unsigned drive = dsk->selected_unit / 2;
 	switch (addr) {
 	case 0xF141:
 		// 16bit word
@@ -676,29 +741,164 @@ uint8_t dsk_read(uint16_t addr, unsigned trace)
 		// the sector.
 		// So DSK probally combines the sector address with the last cylinder
 		// and head written to 0xF141
-		return dsk_cylinder >> 3;
+		return dsk->cylinder >> 3;
 	case 0xF142:
 		// Continued
 
 		// Make sure hawk unit has latest state
-		hawk_update(&hawk[drive], get_current_time());
+		hawk_update(&dsk->hawk[drive], get_current_time());
 
-		return (dsk_cylinder << 5) | (dsk_head << 4) | hawk[drive].sector_addr;
+		return (dsk->cylinder << 5) | (dsk->head << 4) | dsk->hawk[drive].sector_addr;
 	case 0xF144:
-		status = dsk_status >> 8;
+		status = dsk->status >> 8;
 		if (trace)
 		 	fprintf(stderr, "%04X: hawk status read high | %02x__\n", cpu6_pc(), status);
 		return status;
 	case 0xF145:
-		status = dsk_status & 0xff;
+		status = dsk->status & 0xff;
 		if (trace)
 		 	fprintf(stderr, "%04X: hawk status read low  | __%02x\n", cpu6_pc(), status);
 		return status ;
 	case 0xF148:		/* Bit 0 seems to be set while it is processing */
-		return dsk_state != STATE_IDLE;
+		return dsk->state != STATE_IDLE;
 	default:
-		fprintf(stderr, "%04X: Unknown hawk I/O read %04X\n",
-			cpu6_pc(), addr);
+		LOG_WARN_PC(TRACE_IO, "Unknown hawk I/O read %04X", addr);
 		return 0xFF;
 	}
 }
+
+/*
+ *	Snapshot support. The drives are saved whole apart from the scheduler
+ *	linkage, the image file handles and the buffered track. Guest writes
+ *	never reach the track buffer, so it is read from the images again.
+ */
+#define HAWK_SAVED_BYTES	offsetof(struct hawk_drive, datacells)
+
+struct dsk_snapshot {
+	uint16_t cylinder;
+	uint16_t status;
+	uint8_t selected_unit;
+	uint8_t write_mask;
+	uint8_t head;
+	uint8_t sector;
+	uint32_t interrupt_enabled;
+	uint32_t interrupt_ack;
+	uint32_t transfer_mode;
+	uint32_t transfer_count;
+	uint32_t state;
+	uint32_t old_state;
+	uint8_t fmt_err;
+	uint8_t addr_err;
+	uint8_t timeout;
+	uint8_t crc_error;
+	uint8_t seek_active;
+	uint8_t seek_complete;
+	uint8_t pad[2];
+};
+
+void dsk_save_state(struct snapshot *s)
+{
+	struct dsk_snapshot ds;
+	struct hawk_drive *saved;
+	char tag[5];
+	int drive;
+
+	memset(&ds, 0, sizeof(ds));
+	ds.cylinder = dsk->cylinder;
+	ds.status = dsk->status;
+	ds.selected_unit = dsk->selected_unit;
+	ds.write_mask = dsk->write_mask;
+	ds.head = dsk->head;
+	ds.sector = dsk->sector;
+	ds.interrupt_enabled = dsk->interrupt_enabled;
+	ds.interrupt_ack = dsk->interrupt_ack;
+	ds.transfer_mode = dsk->transfer_mode;
+	ds.transfer_count = dsk->transfer_count;
+	ds.state = dsk->state;
+	ds.old_state = dsk->old_state;
+	ds.fmt_err = dsk->fmt_err;
+	ds.addr_err = dsk->addr_err;
+	ds.timeout = dsk->timeout;
+	ds.crc_error = dsk->crc_error;
+	ds.seek_active = dsk->seek_active;
+	ds.seek_complete = dsk->seek_complete;
+	snapshot_write_section(s, "DSK ", &ds, sizeof(ds));
+
+	/* Too big for the stack */
+	saved = malloc(sizeof(*saved));
+	if (saved == NULL) {
+		perror("dsk_save_state");
+		exit(1);
+	}
+	for (drive = 0; drive < NUM_HAWK_DRIVES; drive++) {
+		/* Host pointers and handles mean nothing in the next process */
+		memcpy(saved, &dsk->hawk[drive], HAWK_SAVED_BYTES);
+		memset(&saved->event, 0, sizeof(saved->event));
+		saved->image_removable = NULL;
+		saved->image_fixed = NULL;
+		snprintf(tag, sizeof(tag), "HWK%d", drive);
+		snapshot_write_section(s, tag, saved, HAWK_SAVED_BYTES);
+	}
+	free(saved);
+}
+
+int dsk_load_state(struct snapshot *s)
+{
+	struct dsk_snapshot ds;
+	const struct hawk_drive *saved;
+	uint32_t len;
+	char tag[5];
+	int drive;
+
+	if (snapshot_read_section(s, "DSK ", &ds, sizeof(ds)))
+		return -1;
+	if (ds.state >= sizeof(dsk_state_names) / sizeof(dsk_state_names[0]) ||
+	    ds.old_state >= sizeof(dsk_state_names) / sizeof(dsk_state_names[0])) {
+		fprintf(stderr, "%s: bad disk controller state\n", s->name);
+		return -1;
+	}
+	dsk->cylinder = ds.cylinder;
+	dsk->status = ds.status;
+	dsk->selected_unit = ds.selected_unit;
+	dsk->write_mask = ds.write_mask;
+	dsk->head = ds.head;
+	dsk->sector = ds.sector;
+	dsk->interrupt_enabled = ds.interrupt_enabled;
+	dsk->interrupt_ack = ds.interrupt_ack;
+	dsk->transfer_mode = ds.transfer_mode;
+	dsk->transfer_count = ds.transfer_count;
+	dsk->state = ds.state;
+	dsk->old_state = ds.old_state;
+	dsk->fmt_err = ds.fmt_err;
+	dsk->addr_err = ds.addr_err;
+	dsk->timeout = ds.timeout;
+	dsk->crc_error = ds.crc_error;
+	dsk->seek_active = ds.seek_active;
+	dsk->seek_complete = ds.seek_complete;
+
+	for (drive = 0; drive < NUM_HAWK_DRIVES; drive++) {
+		struct hawk_drive *unit = &dsk->hawk[drive];
+
+		struct event_t event = unit->event;
+		struct disk_image *image_removable = unit->image_removable;
+		struct disk_image *image_fixed = unit->image_fixed;
+
+		snprintf(tag, sizeof(tag), "HWK%d", drive);
+		saved = snapshot_find_section(s, tag, &len);
+		if (saved == NULL || len != HAWK_SAVED_BYTES) {
+			fprintf(stderr, "%s: bad or missing %s section\n",
+				s->name, tag);
+			return -1;
+		}
+		/* Keep our own event linkage and images */
+		memcpy(unit, saved, HAWK_SAVED_BYTES);
+		unit->event = event;
+		unit->image_removable = image_removable;
+		unit->image_fixed = image_fixed;
+		snprintf(unit->event_name_string, sizeof(unit->event_name_string),
+			 "hawk%d_event", drive);
+		unit->event.name = unit->event_name_string;
+		hawk_rebuffer_track(unit);
+	}
+	return 0;
+}
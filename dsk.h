@@ -1,7 +1,14 @@
 #include <stdint.h>
 
+struct dsk_state;
+
+struct dsk_state *dsk_create(void);
+void dsk_destroy(struct dsk_state *d);
+void dsk_bind(struct dsk_state *d);
+void dsk_set_image(unsigned unit, const char *path);
 void dsk_init(void);
 unsigned get_hawk_dma_mode(void);
+unsigned dsk_busy(void);
 
 uint8_t dsk_read(uint16_t addr, unsigned trace);
 void dsk_write(uint16_t addr, uint8_t val, unsigned trace);
@@ -0,0 +1,205 @@
+/*
+ *	Farm mode
+ *
+ *	The parent sets the machine up once, then forks a child per test
+ *	case, keeping at most one child per host CPU running. Copy on write
+ *	means the children share the booted memory image until they touch
+ *	it. Each child gets its input through a pipe on stdin and writes its
+ *	console output to a temporary file, which the parent prints once the
+ *	child is done.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "farm.h"
+#include "mux.h"
+#include "scheduler.h"
+#include "script.h"
+
+struct farm_job {
+	struct farm_case c;
+	pid_t pid;
+	FILE *output;
+	int status;
+};
+
+static struct farm_job *load_cases(const char *path, unsigned *count)
+{
+	struct farm_job *jobs = NULL;
+	unsigned n = 0, line = 0;
+	char buf[FARM_INPUT_LEN + 128];
+	int64_t timeout_ns = FARM_TIMEOUT * ONE_SECOND_NS;
+	double secs;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(buf, sizeof(buf), fp)) {
+		struct farm_case *c;
+		char *p = buf;
+		int len;
+
+		line++;
+		p += strspn(p, " \t");
+		if (*p == '#' || *p == '\n' || *p == 0)
+			continue;
+		if (strncmp(p, "timeout", 7) == 0 && (p[7] == ' ' || p[7] == '\t')) {
+			if (sscanf(p + 7, "%lf", &secs) != 1 || secs < 0) {
+				fprintf(stderr, "%s:%u: expected timeout <secs>\n",
+					path, line);
+				exit(1);
+			}
+			timeout_ns = secs * ONE_SECOND_NS;
+			continue;
+		}
+
+		jobs = realloc(jobs, (n + 1) * sizeof(*jobs));
+		if (jobs == NULL) {
+			perror("farm");
+			exit(1);
+		}
+		memset(&jobs[n], 0, sizeof(jobs[n]));
+		c = &jobs[n].c;
+		c->timeout_ns = timeout_ns;
+		if (sscanf(p, "%63s %u%n", c->name, &c->switches, &len) != 2) {
+			fprintf(stderr, "%s:%u: expected <name> <switches>\n",
+				path, line);
+			exit(1);
+		}
+		p += len;
+		if (*p == ' ' || *p == '\t')
+			p++;
+		if (parse_escapes(p, c->input, FARM_INPUT_LEN, &c->input_len)) {
+			fprintf(stderr, "%s:%u: bad input\n", path, line);
+			exit(1);
+		}
+		n++;
+	}
+	fclose(fp);
+	*count = n;
+	return jobs;
+}
+
+/* In the child: stdin is the case input, stdout the capture file */
+static void setup_child(struct farm_job *job)
+{
+	int pfd[2];
+
+	if (pipe(pfd) == -1) {
+		perror("pipe");
+		_exit(1);
+	}
+	/* Fits in the pipe buffer. The write end stays open so that the
+	   console never sees EOF and the case runs to its end. */
+	if (write(pfd[1], job->c.input, job->c.input_len) != job->c.input_len) {
+		perror("farm input");
+		_exit(1);
+	}
+	dup2(pfd[0], STDIN_FILENO);
+	close(pfd[0]);
+	dup2(fileno(job->output), STDOUT_FILENO);
+	fclose(job->output);
+
+	mux_attach(0, MUX_MODE_CONSOLE, STDIN_FILENO, STDOUT_FILENO);
+}
+
+static void report(struct farm_job *job)
+{
+	char buf[4096];
+	size_t len;
+	long size;
+	int st = job->status;
+
+	fflush(job->output);
+	size = ftell(job->output);
+	printf("=== %s: ", job->c.name);
+	if (WIFEXITED(st) && WEXITSTATUS(st) == FARM_TIMEOUT_EXIT)
+		printf("timed out");
+	else if (WIFEXITED(st))
+		printf("exit %d", WEXITSTATUS(st));
+	else if (WIFSIGNALED(st))
+		printf("killed by signal %d", WTERMSIG(st));
+	printf(", %ld bytes of output\n", size);
+
+	rewind(job->output);
+	while ((len = fread(buf, 1, sizeof(buf), job->output)) > 0)
+		fwrite(buf, 1, len, stdout);
+	if (size > 0)
+		putchar('\n');
+	fclose(job->output);
+	fflush(stdout);
+}
+
+int farm_run(const char *path, struct farm_case *c, int *exit_code)
+{
+	struct farm_job *jobs;
+	unsigned count, next = 0, running = 0, failed = 0;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (ncpu < 1)
+		ncpu = 1;
+	jobs = load_cases(path, &count);
+	fflush(stdout);
+	fflush(stderr);
+
+	while (next < count || running) {
+		pid_t pid;
+		int st;
+		unsigned i;
+
+		while (next < count && running < ncpu) {
+			struct farm_job *job = &jobs[next++];
+
+			job->output = tmpfile();
+			if (job->output == NULL) {
+				perror("tmpfile");
+				exit(1);
+			}
+			pid = fork();
+			if (pid == -1) {
+				perror("fork");
+				exit(1);
+			}
+			if (pid == 0) {
+				setup_child(job);
+				*c = job->c;
+				free(jobs);
+				return 1;
+			}
+			job->pid = pid;
+			running++;
+		}
+
+		pid = wait(&st);
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("wait");
+			exit(1);
+		}
+		for (i = 0; i < next; i++) {
+			if (jobs[i].pid == pid) {
+				jobs[i].status = st;
+				if (!WIFEXITED(st) || WEXITSTATUS(st) != 0)
+					failed++;
+				report(&jobs[i]);
+				running--;
+				break;
+			}
+		}
+	}
+
+	printf("farm: %u cases, %u passed, %u failed\n",
+		count, count - failed, failed);
+	free(jobs);
+	*exit_code = failed ? 1 : 0;
+	return 0;
+}
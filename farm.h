@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ *	Farm mode: run a list of test cases in parallel, one forked child
+ *	per case, all starting from the machine state at the fork.
+ *
+ *	The farm file has one case per line:
+ *
+ *	<name> <diag switches> [<MUX0 input>]
+ *
+ *	Blank lines and lines starting with '#' are ignored. The input is the
+ *	rest of the line and may use \r, \n, \t, \\ and \xHH escapes.
+ *
+ *	timeout <secs>
+ *
+ *	sets the emulated time the cases after it may run for, 0 for no limit.
+ *	A case that runs out exits with FARM_TIMEOUT_EXIT and fails.
+ */
+
+#define FARM_NAME_LEN	64
+#define FARM_INPUT_LEN	4096	/* Must fit in a pipe without blocking */
+#define FARM_TIMEOUT	300	/* Default, emulated seconds */
+#define FARM_TIMEOUT_EXIT	124
+
+struct farm_case {
+	char name[FARM_NAME_LEN];
+	unsigned switches;
+	char input[FARM_INPUT_LEN];
+	size_t input_len;
+	int64_t timeout_ns;		/* Or 0 */
+};
+
+/*
+ * Returns 1 in each child, with the case it should run in *c and MUX0
+ * attached to its input and captured output. Returns 0 in the parent once
+ * every case has finished and been reported, with the exit code for the
+ * farm in *exit_code.
+ */
+int farm_run(const char *path, struct farm_case *c, int *exit_code);
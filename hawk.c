@@ -1,5 +1,7 @@
 
+#include "diskimg.h"
 #include "hawk.h"
+#include "log.h"
 #include "scheduler.h"
 
 #include <assert.h>
@@ -15,7 +17,7 @@
 #define HAWK_EVENT_ROTATE_SECTOR    3
 #define HAWK_EVENT_ROTATE_SYNC      4
 
-static void hawk_write_bits(struct hawk_drive* unit, int count, uint8_t* data);
+static void hawk_write_bits(struct hawk_drive* unit, int count, const uint8_t* data);
 static void hawk_set_bits(struct hawk_drive* unit, int count, uint8_t val);
 static void hawk_erase_bits(struct hawk_drive* unit, int count);
 
@@ -51,21 +53,24 @@ static void hawk_event_callback(struct event_t* event, int64_t late_ns)
 
 // Reads entire track of data into host memory.
 // Converts from 400 byte sectors, into raw bits with gaps, sync and format info
-static int hawk_buffer_track(struct hawk_drive* unit, unsigned fixed, unsigned cyl, unsigned head) {
-    off_t offset = ((cyl << 5) | (head << 4)) * HAWK_SECTOR_BYTES;
-    uint8_t buffer[HAWK_SECTOR_BYTES];
+int hawk_buffer_track(struct hawk_drive* unit, unsigned fixed, unsigned cyl, unsigned head) {
+    uint8_t buffer[HAWK_TRACK_BYTES];
+    const uint8_t *data[HAWK_SECTS_PER_TRK];
 
-    int fd = fixed ? unit->fd_fixed : unit->fd_removable;
+    struct disk_image *image = fixed ? unit->image_fixed : unit->image_removable;
     memset(unit->datacells, 0, sizeof(unit->datacells));
+    unit->track_fixed = fixed;
+    unit->track_cyl = cyl;
+    unit->track_head = head;
 
     // If we don't have a platter installed, the seek is going to complete anyway
     // There just won't be any data to read
-    if (fd == -1)
+    if (image == NULL)
         return 0;
 
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        fprintf(stderr, "hawk position failed (%d,%d,0) = %lx.\n",
-            cyl, head, (long) offset);
+    // Compact images decode a track at a time, so fetch it all up front
+    if (disk_image_track(image, (cyl << 5) | (head << 4), data, buffer)) {
+        LOG_ERROR(TRACE_DSK, "Hawk read failed (%d,%d)", cyl, head);
         return 0;
     }
 
@@ -97,11 +102,7 @@ static int hawk_buffer_track(struct hawk_drive* unit, unsigned fixed, unsigned c
         hawk_set_bits(unit, 1, 1);
 
         // sector data
-        if (read(fd, buffer, HAWK_SECTOR_BYTES) != HAWK_SECTOR_BYTES) {
-            fprintf(stderr, "hawk read failed (%d,%d,%d).\n", cyl, head, sector);
-            return 0;
-        }
-        hawk_write_bits(unit, HAWK_SECTOR_BYTES * 8, buffer);
+        hawk_write_bits(unit, HAWK_SECTOR_BYTES * 8, data[sector]);
 
         // CRC
         // TODO: proper CRC function
@@ -114,6 +115,14 @@ static int hawk_buffer_track(struct hawk_drive* unit, unsigned fixed, unsigned c
     return 1;
 }
 
+// Buffer the same track again, after a snapshot restore
+void hawk_rebuffer_track(struct hawk_drive* unit) {
+    int32_t data_ptr = unit->data_ptr;
+
+    hawk_buffer_track(unit, unit->track_fixed, unit->track_cyl, unit->track_head);
+    unit->data_ptr = data_ptr;
+}
+
 
 void hawk_seek(struct hawk_drive* unit, unsigned fixed, unsigned cyl, unsigned head)
 {
@@ -179,7 +188,8 @@ void hawk_update(struct hawk_drive* unit, int64_t now) {
     unit->sector_pulse = (rotation % (int64_t)HAWK_SECTOR_NS) < HAWK_SECTOR_PULSE_NS;
 }
 
-void hawk_init(struct hawk_drive *unit, unsigned drive_num, int fd1, int fd2) {
+void hawk_init(struct hawk_drive *unit, unsigned drive_num,
+    struct disk_image *removable, struct disk_image *fixed) {
     memset(unit, 0, sizeof(struct hawk_drive));
 
     unit->event.callback = hawk_event_callback;
@@ -189,12 +199,12 @@ void hawk_init(struct hawk_drive *unit, unsigned drive_num, int fd1, int fd2) {
     unit->drive_num = drive_num;
     unit->wprotect = 1;
 
-    hawk_setfd(unit, 0, fd1);
-    hawk_setfd(unit, 1, fd2);
+    hawk_set_image(unit, 0, removable);
+    hawk_set_image(unit, 1, fixed);
 
     // It's not actually possible to spin up a drive without a cartridge installed,
     // So if we have either image, it's ready.
-    unit->ready = (fd1 != -1) || (fd2 != -1);
+    unit->ready = (removable != NULL) || (fixed != NULL);
 
     if (unit->ready) {
         hawk_buffer_track(unit, 0, 0, 0);
@@ -202,11 +212,19 @@ void hawk_init(struct hawk_drive *unit, unsigned drive_num, int fd1, int fd2) {
     }
 }
 
-void hawk_setfd(struct hawk_drive* unit, unsigned fixed, int fd) {
+void hawk_set_image(struct hawk_drive* unit, unsigned fixed, struct disk_image *img) {
     if (fixed)
-        unit->fd_fixed = fd;
+        unit->image_fixed = img;
     else
-        unit->fd_removable = fd;
+        unit->image_removable = img;
+}
+
+// The drive owns its images
+void hawk_release(struct hawk_drive* unit) {
+    disk_image_close(unit->image_removable);
+    disk_image_close(unit->image_fixed);
+    unit->image_removable = NULL;
+    unit->image_fixed = NULL;
 }
 
 
@@ -335,7 +353,7 @@ void hawk_rewind(struct hawk_drive* unit, int count) {
         unit->data_ptr += HAWK_RAW_TRACK_BITS;
 }
 
-static void hawk_write_bits(struct hawk_drive* unit, int count, uint8_t* data) {
+static void hawk_write_bits(struct hawk_drive* unit, int count, const uint8_t* data) {
     while (count > 0) {
         uint8_t byte = *(data++);
         for (int shift = 7; shift >= 0; shift--) {
@@ -93,21 +93,19 @@ struct hawk_drive {
 
 	uint8_t seeking;
 
-	// File handle of image file
-	int fd_removable;
-	int fd_fixed;
+	// Platter images, NULL if there is no cartridge (see diskimg.h)
+	struct disk_image *image_removable;
+	struct disk_image *image_fixed;
 
 	// assigned drive number
 	unsigned drive_num;
 
 	unsigned selected; // removable or fixed
 
-	// Datacells for current track
-	// Wastefully store 1 bit per byte.
-	// Bottom bit is actual data. Forth bit is "clock" signal, that will be one
-	// for every data cell that contains data, and zero for data cells that
-	// haven't been written.
-	uint8_t datacells[HAWK_RAW_TRACK_BITS];
+	// The track last buffered into datacells
+	unsigned track_fixed;
+	unsigned track_cyl;
+	unsigned track_head;
 
 	int32_t data_ptr;
 	int32_t head_pos;
@@ -115,10 +113,24 @@ struct hawk_drive {
 
 	// For unrealistically instant seeking, and teleporting rotations
 	unsigned instant_read;
+
+	// Datacells for current track
+	// Wastefully store 1 bit per byte.
+	// Bottom bit is actual data. Forth bit is "clock" signal, that will be one
+	// for every data cell that contains data, and zero for data cells that
+	// haven't been written.
+	// Kept last, as snapshots leave it out and buffer the track again.
+	uint8_t datacells[HAWK_RAW_TRACK_BITS];
 };
 
-void hawk_init(struct hawk_drive* unit, unsigned drive_num, int fd1, int fd2);
-void hawk_setfd(struct hawk_drive* unit, unsigned fixed, int fd);
+struct disk_image;
+
+void hawk_init(struct hawk_drive* unit, unsigned drive_num,
+    struct disk_image *removable, struct disk_image *fixed);
+void hawk_set_image(struct hawk_drive* unit, unsigned fixed, struct disk_image *img);
+void hawk_release(struct hawk_drive* unit);
+int hawk_buffer_track(struct hawk_drive* unit, unsigned fixed, unsigned cyl, unsigned head);
+void hawk_rebuffer_track(struct hawk_drive* unit);
 void hawk_seek(struct hawk_drive* unit, unsigned fixed, unsigned cyl, unsigned head);
 void hawk_rtz(struct hawk_drive* unit, unsigned fixed);
 int hawk_remaining_bits(struct hawk_drive* unit, uint64_t time);
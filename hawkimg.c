@@ -0,0 +1,58 @@
+/*
+ *	Hawk platter image tool
+ *
+ *	hawkimg overlay <overlay> <base>	create an empty overlay on <base>
+ *	hawkimg commit <overlay>		write its sectors into the base
+ *	hawkimg discard <overlay>		drop its sectors
+ *	hawkimg compact <image> <out>		convert to a compact image
+ *	hawkimg expand <image> <out>		convert to a raw image
+ *	hawkimg info <image>...			describe images
+ *
+ *	The base of an overlay is named relative to the overlay's directory.
+ *	Any kind of image converts, an overlay converts to what it reads as.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "diskimg.h"
+
+static int usage(void)
+{
+	fprintf(stderr,
+		"hawkimg overlay <overlay> <base>\n"
+		"hawkimg commit <overlay>\n"
+		"hawkimg discard <overlay>\n"
+		"hawkimg compact <image> <out>\n"
+		"hawkimg expand <image> <out>\n"
+		"hawkimg info <image>...\n");
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	if (argc < 3)
+		return usage();
+	if (strcmp(argv[1], "overlay") == 0 && argc == 4)
+		return disk_image_create_overlay(argv[2], argv[3]) ? 1 : 0;
+	if (strcmp(argv[1], "commit") == 0 && argc == 3)
+		return disk_image_commit(argv[2]) ? 1 : 0;
+	if (strcmp(argv[1], "discard") == 0 && argc == 3)
+		return disk_image_discard(argv[2]) ? 1 : 0;
+	if (strcmp(argv[1], "compact") == 0 && argc == 4) {
+		if (disk_image_compact(argv[2], argv[3]))
+			return 1;
+		disk_image_info(argv[3]);
+		return 0;
+	}
+	if (strcmp(argv[1], "expand") == 0 && argc == 4)
+		return disk_image_expand(argv[2], argv[3]) ? 1 : 0;
+	if (strcmp(argv[1], "info") == 0) {
+		for (i = 2; i < argc; i++)
+			disk_image_info(argv[i]);
+		return 0;
+	}
+	return usage();
+}
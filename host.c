@@ -0,0 +1,861 @@
+/*
+ *	Host mode
+ *
+ *	Runs every machine listed in a configuration file on a pool of
+ *	worker threads. A machine runs for a slice of emulated time and then
+ *	goes back on the queue of the worker that ran it. Each worker takes
+ *	machines from the front of its own queue and, once that is empty,
+ *	steals from the back of the others'.
+ *
+ *	A throttled machine that has got ahead of the wall clock is idle. So
+ *	is one that spent its slice polling MUX units with no input, with no
+ *	byte moving either way. Idle machines are parked instead of queued,
+ *	and the main thread queues them again once the wall clock has caught
+ *	up, or the next scheduler event is due, or input arrives for one of
+ *	their MUX units. A throttled machine that was polling has its clock
+ *	moved on over the time it was parked, as if it had kept polling. An
+ *	unthrottled one is only parked with no scheduler events pending.
+ *	The main thread also accepts the terminal connections for the MUX
+ *	units and hands them over to their machines.
+ *
+ *	The configuration file has one setting per line, '#' starts a
+ *	comment. Everything after a "machine" line applies to that machine:
+ *
+ *	threads <n>			worker threads (default: one per host CPU)
+ *	machine <name>			start a new machine
+ *	speed <n>|unthrottled		emulated seconds per second (default 1)
+ *	diag [<switches>]		fit the diag card, with its switches
+ *	display <file>			append the diag display to <file>
+ *					(default: not shown)
+ *	finch				emulate a finch drive
+ *	switches <n>			CPU switches
+ *	rom <file> <addr> [<len>]	ROM image at a hex address, instead
+ *					of the standard ones
+ *	disk <unit> <image>		image for Hawk unit 0-7
+ *	boot <file> [<addr>]		centurion binary to boot
+ *	restore <snapshot>		restore instead of booting
+ *	cards <list>			MUX cards, as -c (default 4)
+ *	baud <unit> <baud>|unlimited	host side rate of a unit, as -a
+ *	mux <unit> <port>		telnet to the unit on 127.0.0.1:<port>
+ *	pty <unit>			the unit on a new pseudo terminal
+ *	console				MUX0 on the emulator's own terminal
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "centurion.h"
+#include "console.h"
+#include "cpu6.h"
+#include "dsk.h"
+#include "host.h"
+#include "log.h"
+#include "machine.h"
+#include "mux.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "stats.h"
+
+/* Emulated time a machine runs for before it goes back on a queue */
+#define HOST_SLICE_NS	((int64_t)(10 * ONE_MILISECOND_NS))
+/* A slice is a polling loop if there is a status read this often */
+#define HOST_POLL_INSNS	16
+
+#define HOST_NAME_LEN	64
+#define HOST_MAX_ROMS	8
+#define HOST_MAX_DISKS	8
+
+enum host_state {
+	HOST_QUEUED,
+	HOST_RUNNING,
+	HOST_PARKED,
+	HOST_STOPPED
+};
+
+struct host_rom {
+	char *file;
+	uint32_t addr;
+	uint16_t len;
+};
+
+struct host_machine {
+	struct host_machine *next;
+	char name[HOST_NAME_LEN];
+	struct machine *m;
+
+	/* From the configuration file */
+	double speed;			/* 0 when unthrottled */
+	unsigned diag;
+	unsigned diag_switches;
+	unsigned finch;
+	int cpu_switches;
+	struct host_rom rom[HOST_MAX_ROMS];
+	unsigned roms;
+	char *disk[HOST_MAX_DISKS];
+	char *boot_file;
+	uint16_t boot_addr;
+	char *restore_file;
+	char *cards;
+	char *display;			/* File for the diag display */
+	int baud[NUM_MUX_UNITS];	/* MUX_BAUD_... or a rate */
+	unsigned short port[NUM_MUX_UNITS];
+	unsigned char pty[NUM_MUX_UNITS];
+	unsigned console;
+
+	/* Pacing against the wall clock */
+	uint64_t wall_start;
+	int64_t emulated_start;
+	long long instructions;
+	unsigned polling;		/* Parked while polling for input */
+
+	/* Protected by host_lock */
+	enum host_state state;
+	uint64_t wake_ns;		/* Parked until this wall clock time */
+	int wake_fd[NUM_MUX_UNITS];	/* or until one of these is readable */
+	int pending_fd[NUM_MUX_UNITS];	/* Accepted, not yet attached */
+	unsigned worker;		/* Queue it goes back on */
+
+	int listen_fd[NUM_MUX_UNITS];	/* Only used by the main thread */
+	int conn_fd[NUM_MUX_UNITS];	/* Only used while the machine runs */
+};
+
+/* A worker's run queue, a ring of machines */
+struct host_worker {
+	unsigned id;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct host_machine **ring;
+	unsigned head;
+	unsigned count;
+};
+
+static struct host_machine *machines;
+static unsigned num_machines;
+static struct host_worker *workers;
+static unsigned num_workers;
+
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static unsigned queued;			/* Machines on the run queues */
+static unsigned stopped;		/* Machines that have stopped */
+static unsigned host_done;
+
+/* Written to whenever the main thread has to look at the machines again */
+static int wake_pipe[2] = { -1, -1 };
+
+static void wake_main(void)
+{
+	char c = 0;
+
+	if (write(wake_pipe[1], &c, 1) == -1 && errno != EAGAIN)
+		perror("host wake");
+}
+
+static void host_signal(int sig)
+{
+	emulator_done = 1;
+	wake_main();
+}
+
+static int64_t emulated_due(struct host_machine *hm, uint64_t now)
+{
+	return hm->emulated_start + (int64_t)((now - hm->wall_start) * hm->speed);
+}
+
+static uint64_t wall_due(struct host_machine *hm, int64_t emulated)
+{
+	return hm->wall_start + (uint64_t)((emulated - hm->emulated_start) / hm->speed);
+}
+
+/*
+ *	Run queues
+ */
+
+static void queue_push(struct host_worker *w, struct host_machine *hm)
+{
+	pthread_mutex_lock(&w->lock);
+	w->ring[(w->head + w->count++) % num_machines] = hm;
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* The owner works from the front */
+static struct host_machine *queue_pop_front(struct host_worker *w)
+{
+	struct host_machine *hm = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->count) {
+		hm = w->ring[w->head];
+		w->head = (w->head + 1) % num_machines;
+		w->count--;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return hm;
+}
+
+/* Thieves take from the back, the machine least recently queued there */
+static struct host_machine *queue_pop_back(struct host_worker *w)
+{
+	struct host_machine *hm = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->count) {
+		w->count--;
+		hm = w->ring[(w->head + w->count) % num_machines];
+	}
+	pthread_mutex_unlock(&w->lock);
+	return hm;
+}
+
+/* Called with host_lock held */
+static void make_runnable(struct host_machine *hm)
+{
+	hm->state = HOST_QUEUED;
+	queue_push(&workers[hm->worker], hm);
+	queued++;
+	pthread_cond_signal(&work_cond);
+}
+
+/*
+ *	Workers
+ */
+
+/* Hand over the connections accepted since the machine last ran */
+static void attach_connections(struct host_machine *hm)
+{
+	unsigned unit;
+
+	pthread_mutex_lock(&host_lock);
+	for (unit = 0; unit < NUM_MUX_UNITS; unit++) {
+		if (hm->pending_fd[unit] == -1)
+			continue;
+		/* Output for the old connection goes out before it closes */
+		mux_attach(unit, MUX_MODE_REMOTE, hm->pending_fd[unit], hm->pending_fd[unit]);
+		if (hm->conn_fd[unit] != -1)
+			close(hm->conn_fd[unit]);
+		hm->conn_fd[unit] = hm->pending_fd[unit];
+		hm->pending_fd[unit] = -1;
+	}
+	pthread_mutex_unlock(&host_lock);
+}
+
+static unsigned has_pending(struct host_machine *hm)
+{
+	unsigned unit;
+
+	for (unit = 0; unit < NUM_MUX_UNITS; unit++)
+		if (hm->pending_fd[unit] != -1)
+			return 1;
+	return 0;
+}
+
+/* Catch up on the time spent parked, up to the next event */
+static void skip_idle_time(struct host_machine *hm)
+{
+	int64_t target = emulated_due(hm, monotonic_time_ns());
+	int64_t next = scheduler_next();
+
+	if (next != -1 && next < target)
+		target = next;
+	if (target > get_current_time())
+		advance_time(target - get_current_time());
+}
+
+/* Whether the slice just run did nothing but look for input */
+static unsigned slice_polling(struct host_machine *hm, int64_t start, long long insns)
+{
+	uint32_t polls = mux_idle_polls();
+
+	return polls && insns <= (long long)polls * HOST_POLL_INSNS &&
+		mux_last_activity() < start && !has_pending(hm);
+}
+
+static void run_slice(struct host_worker *w, struct host_machine *hm)
+{
+	int64_t until, start, next;
+	long long insns;
+	unsigned unit, polling;
+
+	machine_bind(hm->m);
+	attach_connections(hm);
+
+	if (hm->polling && hm->speed)
+		skip_idle_time(hm);
+	hm->polling = 0;
+	mux_idle_polls();
+	start = get_current_time();
+	insns = hm->instructions;
+
+	until = get_current_time() + HOST_SLICE_NS;
+	if (hm->speed) {
+		/* Never more than a slice ahead of the wall clock */
+		int64_t due = emulated_due(hm, monotonic_time_ns()) + HOST_SLICE_NS;
+		if (until > due)
+			until = due;
+	}
+	while (get_current_time() < until && !board_stopped() && !emulator_done) {
+		machine_step();
+		hm->instructions++;
+	}
+	STAT_SET(instructions, hm->instructions);
+	STAT_SET(emulated_ns, get_current_time());
+	mux_flush();
+	log_flush();
+	diag_display_update(0);
+
+	next = scheduler_next();
+	polling = slice_polling(hm, start, hm->instructions - insns) &&
+		(hm->speed || next == -1);
+
+	pthread_mutex_lock(&host_lock);
+	hm->worker = w->id;
+	if (board_stopped()) {
+		hm->state = HOST_STOPPED;
+		if (++stopped == num_machines)
+			wake_main();
+	} else if (polling || (hm->speed && !has_pending(hm) &&
+		   get_current_time() > emulated_due(hm, monotonic_time_ns()))) {
+		hm->state = HOST_PARKED;
+		if (!polling)
+			hm->wake_ns = wall_due(hm, get_current_time());
+		else if (next == -1)
+			hm->wake_ns = UINT64_MAX;
+		else
+			hm->wake_ns = wall_due(hm, next);
+		hm->polling = polling;
+		for (unit = 0; unit < NUM_MUX_UNITS; unit++)
+			hm->wake_fd[unit] = mux_get_in_poll_fd(unit);
+		wake_main();
+	} else
+		make_runnable(hm);
+	pthread_mutex_unlock(&host_lock);
+
+	machine_bind(NULL);
+}
+
+static struct host_machine *take_work(struct host_worker *w)
+{
+	struct host_machine *hm;
+	unsigned i;
+
+	hm = queue_pop_front(w);
+	for (i = 1; hm == NULL && i < num_workers; i++)
+		hm = queue_pop_back(&workers[(w->id + i) % num_workers]);
+	return hm;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct host_worker *w = arg;
+	struct host_machine *hm;
+
+	while (1) {
+		pthread_mutex_lock(&host_lock);
+		while (queued == 0 && !host_done)
+			pthread_cond_wait(&work_cond, &host_lock);
+		if (host_done) {
+			pthread_mutex_unlock(&host_lock);
+			return NULL;
+		}
+		/* There is now one machine on some queue set aside for us */
+		queued--;
+		pthread_mutex_unlock(&host_lock);
+
+		while ((hm = take_work(w)) == NULL)
+			;
+		pthread_mutex_lock(&host_lock);
+		hm->state = HOST_RUNNING;
+		pthread_mutex_unlock(&host_lock);
+		run_slice(w, hm);
+	}
+}
+
+/*
+ *	Main thread: parked machines and terminal connections
+ */
+
+static int host_listen(unsigned short port)
+{
+	struct sockaddr_in sin;
+	int fd, on = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1) {
+		perror("socket");
+		exit(1);
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7F000001);
+	sin.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+		fprintf(stderr, "port %u: %s\n", port, strerror(errno));
+		exit(1);
+	}
+	listen(fd, 1);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+static void host_accept(struct host_machine *hm, unsigned unit)
+{
+	int fd = accept(hm->listen_fd[unit], NULL, NULL);
+
+	if (fd == -1)
+		return;
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	pthread_mutex_lock(&host_lock);
+	/* A newer connection wins over one that never got attached */
+	if (hm->pending_fd[unit] != -1)
+		close(hm->pending_fd[unit]);
+	hm->pending_fd[unit] = fd;
+	if (hm->state == HOST_PARKED)
+		make_runnable(hm);
+	pthread_mutex_unlock(&host_lock);
+}
+
+struct host_pollfd {
+	struct host_machine *hm;
+	unsigned unit;
+	unsigned listener;
+};
+
+static void host_poll(void)
+{
+	unsigned max = 1 + num_machines * NUM_MUX_UNITS * 2;
+	struct pollfd *pfd = calloc(max, sizeof(*pfd));
+	struct host_pollfd *owner = calloc(max, sizeof(*owner));
+	char buf[64];
+
+	if (pfd == NULL || owner == NULL) {
+		perror("host");
+		exit(1);
+	}
+
+	while (1) {
+		struct host_machine *hm;
+		uint64_t now, wake = UINT64_MAX;
+		unsigned n = 1, i, unit;
+		int timeout = -1;
+
+		pfd[0].fd = wake_pipe[0];
+		pfd[0].events = POLLIN;
+
+		pthread_mutex_lock(&host_lock);
+		if (emulator_done || stopped == num_machines) {
+			host_done = 1;
+			pthread_cond_broadcast(&work_cond);
+			pthread_mutex_unlock(&host_lock);
+			break;
+		}
+		for (hm = machines; hm; hm = hm->next) {
+			for (unit = 0; unit < NUM_MUX_UNITS; unit++) {
+				if (hm->listen_fd[unit] != -1) {
+					pfd[n].fd = hm->listen_fd[unit];
+					pfd[n].events = POLLIN;
+					owner[n].hm = hm;
+					owner[n].unit = unit;
+					owner[n++].listener = 1;
+				}
+				if (hm->state == HOST_PARKED && hm->wake_fd[unit] != -1) {
+					pfd[n].fd = hm->wake_fd[unit];
+					pfd[n].events = POLLIN;
+					owner[n].hm = hm;
+					owner[n].unit = unit;
+					owner[n++].listener = 0;
+				}
+			}
+			if (hm->state == HOST_PARKED && hm->wake_ns < wake)
+				wake = hm->wake_ns;
+		}
+		pthread_mutex_unlock(&host_lock);
+
+		if (wake != UINT64_MAX) {
+			now = monotonic_time_ns();
+			/* Round up, waking early would only park it again */
+			timeout = wake > now ? (wake - now + 999999) / 1000000 : 0;
+		}
+		if (poll(pfd, n, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			exit(1);
+		}
+
+		if (pfd[0].revents & POLLIN)
+			while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+				;
+		for (i = 1; i < n; i++) {
+			if (!pfd[i].revents)
+				continue;
+			if (owner[i].listener) {
+				host_accept(owner[i].hm, owner[i].unit);
+				continue;
+			}
+			pthread_mutex_lock(&host_lock);
+			if (owner[i].hm->state == HOST_PARKED)
+				make_runnable(owner[i].hm);
+			pthread_mutex_unlock(&host_lock);
+		}
+
+		now = monotonic_time_ns();
+		pthread_mutex_lock(&host_lock);
+		for (hm = machines; hm; hm = hm->next)
+			if (hm->state == HOST_PARKED && hm->wake_ns <= now)
+				make_runnable(hm);
+		pthread_mutex_unlock(&host_lock);
+	}
+	free(pfd);
+	free(owner);
+}
+
+/*
+ *	Configuration
+ */
+
+static struct host_machine *new_machine(const char *name)
+{
+	struct host_machine *hm = calloc(1, sizeof(*hm)), **pp;
+	unsigned unit;
+
+	if (hm == NULL) {
+		perror("host");
+		exit(1);
+	}
+	snprintf(hm->name, sizeof(hm->name), "%s", name);
+	hm->speed = 1.0;
+	hm->cpu_switches = -1;
+	for (unit = 0; unit < NUM_MUX_UNITS; unit++) {
+		hm->wake_fd[unit] = -1;
+		hm->pending_fd[unit] = -1;
+		hm->listen_fd[unit] = -1;
+		hm->conn_fd[unit] = -1;
+	}
+	/* Keep the file order, it is the order they are reported in */
+	for (pp = &machines; *pp; pp = &(*pp)->next)
+		;
+	*pp = hm;
+	num_machines++;
+	return hm;
+}
+
+static char *xstrdup(const char *s)
+{
+	char *p = strdup(s);
+
+	if (p == NULL) {
+		perror("host");
+		exit(1);
+	}
+	return p;
+}
+
+static void load_config(const char *path, unsigned *threads)
+{
+	struct host_machine *hm = NULL;
+	char buf[1024], *p;
+	unsigned line = 0, unit;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(buf, sizeof(buf), fp)) {
+		char *word[5];
+		unsigned n = 0;
+
+		line++;
+		if ((p = strchr(buf, '#')))
+			*p = 0;
+		for (p = strtok(buf, " \t\r\n"); p && n < 5; p = strtok(NULL, " \t\r\n"))
+			word[n++] = p;
+		if (n == 0)
+			continue;
+
+		if (strcmp(word[0], "threads") == 0 && n == 2) {
+			*threads = atoi(word[1]);
+			continue;
+		}
+		if (strcmp(word[0], "machine") == 0 && n == 2) {
+			hm = new_machine(word[1]);
+			continue;
+		}
+		if (hm == NULL) {
+			fprintf(stderr, "%s:%u: expected machine <name>\n", path, line);
+			exit(1);
+		}
+		if (strcmp(word[0], "speed") == 0 && n == 2) {
+			hm->speed = strcmp(word[1], "unthrottled") ? atof(word[1]) : 0;
+			if (hm->speed < 0)
+				goto bad;
+		} else if (strcmp(word[0], "diag") == 0 && n <= 2) {
+			hm->diag = 1;
+			if (n == 2)
+				hm->diag_switches = atoi(word[1]);
+		} else if (strcmp(word[0], "display") == 0 && n == 2) {
+			/* The machines would share the terminal */
+			if (strcmp(word[1], "status") == 0 ||
+			    strcmp(word[1], "stdout") == 0)
+				goto bad;
+			free(hm->display);
+			hm->display = xstrdup(word[1]);
+		} else if (strcmp(word[0], "finch") == 0 && n == 1) {
+			hm->finch = 1;
+		} else if (strcmp(word[0], "switches") == 0 && n == 2) {
+			hm->cpu_switches = atoi(word[1]);
+		} else if (strcmp(word[0], "rom") == 0 && (n == 3 || n == 4)) {
+			struct host_rom *rom = &hm->rom[hm->roms];
+
+			if (hm->roms == HOST_MAX_ROMS)
+				goto bad;
+			rom->file = xstrdup(word[1]);
+			rom->addr = strtoul(word[2], NULL, 16);
+			rom->len = n == 4 ? strtoul(word[3], NULL, 16) : 0;
+			hm->roms++;
+		} else if (strcmp(word[0], "disk") == 0 && n == 3) {
+			unit = atoi(word[1]);
+			if (unit >= HOST_MAX_DISKS)
+				goto bad;
+			free(hm->disk[unit]);
+			hm->disk[unit] = xstrdup(word[2]);
+		} else if (strcmp(word[0], "boot") == 0 && (n == 2 || n == 3)) {
+			hm->boot_file = xstrdup(word[1]);
+			hm->boot_addr = n == 3 ? strtoul(word[2], NULL, 16) : 0;
+		} else if (strcmp(word[0], "restore") == 0 && n == 2) {
+			hm->restore_file = xstrdup(word[1]);
+		} else if (strcmp(word[0], "cards") == 0 && n == 2) {
+			free(hm->cards);
+			hm->cards = xstrdup(word[1]);
+		} else if (strcmp(word[0], "baud") == 0 && n == 3) {
+			unit = atoi(word[1]);
+			if (unit >= NUM_MUX_UNITS)
+				goto bad;
+			if (strcmp(word[2], "unlimited") == 0)
+				hm->baud[unit] = MUX_BAUD_UNLIMITED;
+			else if ((hm->baud[unit] = atoi(word[2])) <= 0)
+				goto bad;
+		} else if (strcmp(word[0], "mux") == 0 && n == 3) {
+			unit = atoi(word[1]);
+			if (unit >= NUM_MUX_UNITS)
+				goto bad;
+			hm->port[unit] = atoi(word[2]);
+		} else if (strcmp(word[0], "pty") == 0 && n == 2) {
+			unit = atoi(word[1]);
+			if (unit >= NUM_MUX_UNITS)
+				goto bad;
+			hm->pty[unit] = 1;
+		} else if (strcmp(word[0], "console") == 0 && n == 1) {
+			hm->console = 1;
+		} else
+			goto bad;
+		continue;
+bad:
+		fprintf(stderr, "%s:%u: bad %s line\n", path, line, word[0]);
+		exit(1);
+	}
+	fclose(fp);
+	if (num_machines == 0) {
+		fprintf(stderr, "%s: no machines\n", path);
+		exit(1);
+	}
+}
+
+/* Bring a machine up as the command line options would */
+static void setup_machine(struct host_machine *hm, unsigned unthrottled)
+{
+	unsigned i;
+
+	hm->m = machine_create();
+	machine_bind(hm->m);
+	mux_init();
+	if (hm->cards && mux_configure(hm->cards))
+		exit(1);
+	for (i = 0; i < NUM_MUX_UNITS; i++)
+		mux_set_host_baud(i, hm->baud[i]);
+	stats_init();
+
+	board_configure(hm->diag, hm->diag_switches, hm->finch);
+	if (board_set_display(hm->display ? hm->display : "off"))
+		exit(1);
+	if (hm->cpu_switches != -1)
+		cpu6_set_switches(hm->cpu_switches);
+	for (i = 0; i < HOST_MAX_DISKS; i++)
+		if (hm->disk[i])
+			dsk_set_image(i, hm->disk[i]);
+	dsk_init();
+
+	if (hm->restore_file) {
+		if (hm->boot_file)
+			fprintf(stderr, "%s: boot ignored, restoring %s\n",
+				hm->name, hm->restore_file);
+		if (snapshot_load(hm->restore_file))
+			exit(1);
+	} else {
+		if (hm->roms == 0)
+			load_standard_roms();
+		for (i = 0; i < hm->roms; i++)
+			load_rom(hm->rom[i].file, hm->rom[i].addr, hm->rom[i].len);
+		cpu6_init();
+		boot_program(hm->boot_file, 0, hm->boot_addr, 0);
+	}
+
+	if (hm->console)
+		tty_init();
+	for (i = 0; i < NUM_MUX_UNITS; i++) {
+		if (hm->port[i] == 0 && hm->pty[i] == 0)
+			continue;
+		if (i >= mux_units()) {
+			fprintf(stderr, "%s: no MUX%u fitted\n", hm->name, i);
+			exit(1);
+		}
+		if (hm->pty[i] && pty_attach(i))
+			exit(1);
+		if (hm->port[i])
+			hm->listen_fd[i] = host_listen(hm->port[i]);
+	}
+	if (unthrottled)
+		hm->speed = 0;
+
+	machine_bind(NULL);
+}
+
+static void free_machine(struct host_machine *hm)
+{
+	unsigned i;
+
+	for (i = 0; i < NUM_MUX_UNITS; i++) {
+		if (hm->listen_fd[i] != -1)
+			close(hm->listen_fd[i]);
+		if (hm->conn_fd[i] != -1)
+			close(hm->conn_fd[i]);
+		if (hm->pending_fd[i] != -1)
+			close(hm->pending_fd[i]);
+	}
+	for (i = 0; i < hm->roms; i++)
+		free(hm->rom[i].file);
+	for (i = 0; i < HOST_MAX_DISKS; i++)
+		free(hm->disk[i]);
+	free(hm->boot_file);
+	free(hm->restore_file);
+	free(hm->cards);
+	free(hm->display);
+	machine_destroy(hm->m);
+	free(hm);
+}
+
+int host_run(const char *config, unsigned unthrottled)
+{
+	struct host_machine *hm, *next;
+	unsigned threads = 0, consoles = 0, i;
+	sigset_t set, old;
+	long ncpu;
+
+	load_config(config, &threads);
+	for (hm = machines; hm; hm = hm->next)
+		consoles += hm->console;
+	if (consoles > 1) {
+		fprintf(stderr, "%s: only one machine can have the console\n", config);
+		exit(1);
+	}
+
+	if (pipe(wake_pipe) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+	for (hm = machines; hm; hm = hm->next)
+		setup_machine(hm, unthrottled);
+
+	/* tty_init may have set its own handlers, which also work here */
+	if (!consoles) {
+		signal(SIGINT, host_signal);
+		signal(SIGQUIT, host_signal);
+	}
+	signal(SIGTERM, host_signal);
+	/* A terminal that hangs up must not take every machine with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads == 0)
+		threads = ncpu > 0 ? ncpu : 1;
+	if (threads > num_machines)
+		threads = num_machines;
+	num_workers = threads;
+	workers = calloc(num_workers, sizeof(*workers));
+	if (workers == NULL) {
+		perror("host");
+		exit(1);
+	}
+
+	/* Deal the machines out round robin, stealing evens out the rest */
+	i = 0;
+	pthread_mutex_lock(&host_lock);
+	for (hm = machines; hm; hm = hm->next) {
+		hm->wall_start = monotonic_time_ns();
+		machine_bind(hm->m);
+		hm->emulated_start = get_current_time();
+		machine_bind(NULL);
+		hm->worker = i++ % num_workers;
+	}
+	for (i = 0; i < num_workers; i++) {
+		workers[i].id = i;
+		pthread_mutex_init(&workers[i].lock, NULL);
+		workers[i].ring = calloc(num_machines, sizeof(*workers[i].ring));
+		if (workers[i].ring == NULL) {
+			perror("host");
+			exit(1);
+		}
+	}
+	for (hm = machines; hm; hm = hm->next)
+		make_runnable(hm);
+	pthread_mutex_unlock(&host_lock);
+
+	/* Signals are left to the main thread, so that they wake its poll */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i])) {
+			fprintf(stderr, "Failed to start worker thread\n");
+			exit(1);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	host_poll();
+
+	for (i = 0; i < num_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		pthread_mutex_destroy(&workers[i].lock);
+		free(workers[i].ring);
+	}
+	free(workers);
+
+	for (hm = machines; hm; hm = next) {
+		next = hm->next;
+		machine_bind(hm->m);
+		printf("%s: %s after %lld instructions, %.3f emulated seconds\n",
+			hm->name, hm->state == HOST_STOPPED ? "stopped" : "interrupted",
+			hm->instructions, get_current_time() / ONE_SECOND_NS);
+		machine_bind(NULL);
+		free_machine(hm);
+	}
+	close(wake_pipe[0]);
+	close(wake_pipe[1]);
+	return 0;
+}
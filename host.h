@@ -0,0 +1,11 @@
+#pragma once
+
+/*
+ *	Host mode: run every machine listed in a configuration file in this
+ *	one process, on a pool of worker threads. The file format is
+ *	described in host.c.
+ *
+ *	Returns the exit code for the emulator once all the machines have
+ *	stopped, or the emulator is interrupted.
+ */
+int host_run(const char *config, unsigned unthrottled);
@@ -0,0 +1,106 @@
+/*
+ *	Diagnostics (see log.h)
+ *
+ *	A guest that pokes at something we don't emulate tends to do it in a
+ *	loop, so messages are rate limited where they are printed and written
+ *	out in batches rather than a syscall each.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "console.h"
+#include "log.h"
+
+#define LOG_BUF_LEN	8192
+#define LOG_LINE_LEN	512
+
+unsigned log_level = LOG_LEVEL_WARN;
+unsigned log_mask;
+
+static _Thread_local char log_buf[LOG_BUF_LEN];
+static _Thread_local size_t log_len;
+
+static const char *level_names[] = { "error", "warning", "info", "debug" };
+
+static const char *subsys_names[] = {
+	"mem", "mem", "reg", "cpu", "fdc", "cmd", "parity", "mux", "dsk",
+	"sched", "io"
+};
+
+void log_flush(void)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < log_len) {
+		r = write(STDERR_FILENO, log_buf + done, log_len - done);
+		if (r <= 0)
+			break;
+		done += r;
+	}
+	log_len = 0;
+}
+
+static void log_append(const char *text, size_t len)
+{
+	if (log_len + len > LOG_BUF_LEN)
+		log_flush();
+	memcpy(log_buf + log_len, text, len);
+	log_len += len;
+}
+
+void log_init(unsigned level, unsigned mask)
+{
+	log_level = level;
+	log_mask = mask;
+	atexit(log_flush);
+}
+
+void log_printf(struct log_site *site, unsigned level, unsigned subsys, int pc,
+		const char *fmt, ...)
+{
+	uint64_t now = monotonic_time_ns();
+	char line[LOG_LINE_LEN];
+	const char *name = NULL;
+	size_t len = 0;
+	unsigned i;
+	va_list ap;
+
+	if (now - site->window_ns >= 1000000000ULL) {
+		site->window_ns = now;
+		site->count = 0;
+	}
+	if (site->count == LOG_BURST) {
+		site->dropped++;
+		return;
+	}
+	site->count++;
+
+	for (i = 0; i < sizeof(subsys_names) / sizeof(subsys_names[0]); i++)
+		if (subsys & (1 << i))
+			name = subsys_names[i];
+	if (name)
+		len = snprintf(line, sizeof(line), "[%s] ", name);
+	len += snprintf(line + len, sizeof(line) - len, "%s: ", level_names[level]);
+	if (site->dropped) {
+		len += snprintf(line + len, sizeof(line) - len,
+				"(%u suppressed) ", site->dropped);
+		site->dropped = 0;
+	}
+	if (pc != -1)
+		len += snprintf(line + len, sizeof(line) - len, "%04X ", pc);
+	va_start(ap, fmt);
+	len += vsnprintf(line + len, sizeof(line) - len, fmt, ap);
+	va_end(ap);
+	if (len > sizeof(line) - 2)
+		len = sizeof(line) - 2;
+	line[len++] = '\n';
+
+	log_append(line, len);
+	if (level == LOG_LEVEL_ERROR)
+		log_flush();
+}
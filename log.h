@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ *	Diagnostics
+ *
+ *	Messages have a level and a subsystem. Errors and warnings are always
+ *	shown (down to the -v level), info and debug messages only for the
+ *	subsystems traced with -t. Debug messages are compiled out unless the
+ *	emulator is built with -DLOG_MAX_LEVEL=LOG_LEVEL_DEBUG.
+ *
+ *	Each call site prints at most LOG_BURST messages a second, and says
+ *	how many it dropped when it next prints. Output is buffered per thread
+ *	and written by log_flush(), which runs when the emulator idles.
+ */
+
+#define LOG_LEVEL_ERROR	0
+#define LOG_LEVEL_WARN	1
+#define LOG_LEVEL_INFO	2
+#define LOG_LEVEL_DEBUG	3
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL	LOG_LEVEL_INFO
+#endif
+
+/* Subsystems, which are the -t bits */
+#define TRACE_MEM_RD	1
+#define TRACE_MEM_WR	2
+#define TRACE_MEM_REG	4
+#define TRACE_CPU	8
+#define TRACE_FDC	16
+#define TRACE_CMD	32
+#define TRACE_PARITY	64
+#define TRACE_MUX	128
+#define TRACE_DSK	256
+#define TRACE_SCHEDULER	512
+#define TRACE_IO	1024	/* Accesses to nothing */
+
+#define LOG_BURST	10
+
+struct log_site {
+	uint64_t window_ns;		/* Host time the current second began */
+	unsigned count;			/* Printed in it */
+	unsigned dropped;
+};
+
+extern unsigned log_level;
+extern unsigned log_mask;
+
+void log_init(unsigned level, unsigned mask);
+/* pc is printed in front of the message if it isn't -1 */
+void log_printf(struct log_site *site, unsigned level, unsigned subsys, int pc,
+		const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+void log_flush(void);
+
+#define LOG_WANTED(level, subsys)					\
+	((level) <= log_level &&					\
+	 ((level) <= LOG_LEVEL_WARN || ((subsys) & log_mask)))
+
+#define LOG_AT(level, subsys, pc, ...)					\
+	do {								\
+		static _Thread_local struct log_site log_site_;	\
+		if (LOG_WANTED(level, subsys))				\
+			log_printf(&log_site_, level, subsys, pc,	\
+				   __VA_ARGS__);			\
+	} while (0)
+
+#define LOG_ERROR(subsys, ...)	LOG_AT(LOG_LEVEL_ERROR, subsys, -1, __VA_ARGS__)
+#define LOG_WARN(subsys, ...)	LOG_AT(LOG_LEVEL_WARN, subsys, -1, __VA_ARGS__)
+/* The _PC forms need cpu6.h */
+#define LOG_WARN_PC(subsys, ...) \
+	LOG_AT(LOG_LEVEL_WARN, subsys, cpu6_pc(), __VA_ARGS__)
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(subsys, ...)	LOG_AT(LOG_LEVEL_INFO, subsys, -1, __VA_ARGS__)
+#else
+#define LOG_INFO(subsys, ...)	do { } while (0)
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(subsys, ...)	LOG_AT(LOG_LEVEL_DEBUG, subsys, -1, __VA_ARGS__)
+#else
+#define LOG_DEBUG(subsys, ...)	do { } while (0)
+#endif
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "centurion.h"
+#include "cpu6.h"
+#include "dsk.h"
+#include "machine.h"
+#include "mux.h"
+#include "scheduler.h"
+#include "stats.h"
+
+static _Thread_local struct machine *current;
+
+/* A machine in power on state, not yet bound to any thread */
+struct machine *machine_create(void)
+{
+	struct machine *m = calloc(1, sizeof(*m));
+
+	if (m == NULL) {
+		perror("machine_create");
+		exit(1);
+	}
+	m->board = board_create();
+	m->cpu = cpu6_create();
+	m->dsk = dsk_create();
+	m->mux = mux_create();
+	m->sched = scheduler_create();
+	m->stats = stats_create();
+	return m;
+}
+
+void machine_destroy(struct machine *m)
+{
+	if (m == current)
+		machine_bind(NULL);
+	board_destroy(m->board);
+	cpu6_destroy(m->cpu);
+	dsk_destroy(m->dsk);
+	mux_destroy(m->mux);
+	scheduler_destroy(m->sched);
+	stats_destroy(m->stats);
+	free(m);
+}
+
+void machine_bind(struct machine *m)
+{
+	current = m;
+	board_bind(m ? m->board : NULL);
+	cpu6_bind(m ? m->cpu : NULL);
+	dsk_bind(m ? m->dsk : NULL);
+	mux_bind(m ? m->mux : NULL);
+	scheduler_bind(m ? m->sched : NULL);
+	stats_bind(m ? m->stats : NULL);
+}
+
+struct machine *machine_current(void)
+{
+	return current;
+}
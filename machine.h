@@ -0,0 +1,38 @@
+#pragma once
+
+/*
+ *	Machine context
+ *
+ *	All the state of one emulated Centurion: the board with its memory
+ *	and simple cards, the CPU card, the DSK controller and its drives,
+ *	the MUX card, the event queue and the statistics counters. Each part
+ *	is private to the source file that emulates it.
+ *
+ *	machine_bind() makes a machine the current one for the calling
+ *	thread. The CPU, memory, scheduler and device code all work on the
+ *	current machine, so entry points bind once and nothing below them
+ *	has to pass the context along. Any number of machines can exist in
+ *	one process; each may be bound to one thread at a time, and can be
+ *	moved to another thread by binding it there.
+ */
+
+struct board_state;
+struct cpu6_state;
+struct dsk_state;
+struct mux_state;
+struct scheduler_state;
+struct emu_stats;
+
+struct machine {
+	struct board_state *board;
+	struct cpu6_state *cpu;
+	struct dsk_state *dsk;
+	struct mux_state *mux;
+	struct scheduler_state *sched;
+	struct emu_stats *stats;
+};
+
+struct machine *machine_create(void);
+void machine_destroy(struct machine *m);
+void machine_bind(struct machine *m);
+struct machine *machine_current(void);
@@ -2,13 +2,17 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "centurion.h"
 #include "console.h"
 #include "cpu6.h"
+#include "log.h"
 #include "mux.h"
 #include "scheduler.h"
+#include "snapshot.h"
+#include "stats.h"
 #include "trace.h"
 
 #define TRACE_WITH_CHAR(val, ...)					\
@@ -21,29 +25,251 @@
 		fputc('\n', stderr);					\
 	}
 
-struct MuxUnit mux[NUM_MUX_UNITS];
-static unsigned char irq_level;
-static unsigned char irq_enabled;
-static int irq_cause;
-static uint32_t poll_count;
-
-static void mux_reset(void)
+/*
+ *	The MUX cards. Each machine has its own set, reached through the
+ *	thread's current machine (see machine.h).
+ */
+/* One line of an input log, see mux_record() */
+struct mux_log_entry {
+	uint64_t poll;
+	int64_t time;
+	char kind;			/* LOG_..., 0 once the log is used up */
+	unsigned unit;
+	unsigned byte;
+};
+
+#define LOG_READY	'r'		/* Input arrived on unit */
+#define LOG_BYTE	'b'		/* Unit's data register read as byte */
+#define LOG_EOF		'e'		/* Unit's input hung up */
+#define LOG_END		'x'		/* The recording stopped */
+
+/* Each card has its own interrupt level, enable and cause register */
+struct mux_card {
+	unsigned first;			/* First unit */
+	unsigned ports;			/* 4 for a MUX4, 8 for a MUX8 */
+	unsigned window;		/* First window, (addr >> 4) & 0xF */
+	unsigned char divider;		/* Custom rate, register 0xB */
+	unsigned char irq_level;
+	unsigned char irq_enabled;
+	int irq_cause;
+};
+
+struct mux_state {
+	struct MuxUnit unit[NUM_MUX_UNITS];
+	struct mux_card card[MUX_MAX_CARDS];
+	unsigned cards;
+	unsigned units;
+	int8_t window[MUX_WINDOWS];	/* Card answering in each window, or -1 */
+	uint8_t unit_card[NUM_MUX_UNITS];
+
+	/* Interrupts are only looked at again when one of these changes */
+	uint64_t requesting;		/* RX_READY or tx_done, wants an IRQ */
+	uint64_t attached;		/* in_fd isn't -1 */
+	uint16_t irq_lines;		/* Levels the cards are asserting */
+	unsigned trace;			/* For the unit events, from mux_poll() */
+
+	uint32_t poll_count;
+	int64_t activity_ns;		/* Last byte in or out, on any unit */
+	uint32_t idle_polls;		/* Status reads that found no input */
+	unsigned tx_pending;		/* Some unit has buffered output */
+	int64_t tx_flush_ns;		/* When to write it regardless */
+
+	/* Input record and replay */
+	uint64_t polls;			/* mux_poll() calls since startup */
+	FILE *record;
+	FILE *replay;
+	struct mux_log_entry next;	/* Next replay entry */
+
+	/* Script mode */
+	void (*tap)(unsigned unit, uint8_t c);
+	unsigned injecting;		/* Units with mux_inject() input */
+};
+
+static _Thread_local struct mux_state *mux;
+
+static void mux_event(struct event_t *event, int64_t late_ns);
+static void mux_update_irqs(unsigned trace);
+
+struct mux_state *mux_create(void)
 {
+	struct mux_state *m = calloc(1, sizeof(*m));
 	int i;
 
+	if (m == NULL) {
+		perror("mux_create");
+		exit(1);
+	}
 	for (i = 0; i < NUM_MUX_UNITS; i++) {
-		mux[i].status        = MUX_TX_READY;
-		mux[i].lastc         = 0xFF;
-		mux[i].baud          = 9600;
-		mux[i].tx_done       = 0;
-		mux[i].rx_ready_time = 0;
-	        mux[i].tx_done_time  = 0;
+		struct MuxUnit *u = &m->unit[i];
+
+		snprintf(u->event_name, sizeof(u->event_name), "mux%d", i);
+		u->event.name = u->event_name;
+		u->event.callback = mux_event;
+		u->pty_master = -1;
+		u->pty_slave = -1;
 	}
+	return m;
+}
+
+void mux_destroy(struct mux_state *m)
+{
+	unsigned i;
+
+	for (i = 0; i < NUM_MUX_UNITS; i++) {
+		if (m->unit[i].pty_master != -1)
+			close(m->unit[i].pty_master);
+		if (m->unit[i].pty_slave != -1)
+			close(m->unit[i].pty_slave);
+	}
+	if (m->record)
+		fclose(m->record);
+	if (m->replay)
+		fclose(m->replay);
+	free(m);
+}
+
+void mux_bind(struct mux_state *m)
+{
+	mux = m;
+}
+
+/*
+ *	Called whenever a unit's state changes. Its event is set for the
+ *	earlier of rx_ready_time and tx_done_time, and the interrupt lines
+ *	are worked out again if it started or stopped wanting one.
+ */
+static void mux_update(unsigned unit)
+{
+	struct MuxUnit *u = &mux->unit[unit];
+	uint64_t bit = 1ULL << unit;
+	uint64_t requesting = mux->requesting;
+	int64_t when = u->rx_ready_time;
+
+	if (u->tx_done_time && (when == 0 || u->tx_done_time < when))
+		when = u->tx_done_time;
+	if (when && (!u->event.queued || u->event.scheduled_ns != when)) {
+		u->event.delta_ns = when - get_current_time();
+		schedule_event(&u->event);
+	} else if (when == 0 && u->event.queued)
+		cancel_event(&u->event);
+
+	if ((u->status & MUX_RX_READY) || u->tx_done)
+		mux->requesting |= bit;
+	else
+		mux->requesting &= ~bit;
+	if ((mux->requesting | requesting) & bit)
+		mux_update_irqs(mux->trace);
+}
+
+/*
+ *	Speed. The low three bits of a status write select the rate, 7 being
+ *	the card's custom rate from register 0xB. All the software tells us is
+ *	that OPSYS writes C5 and a divider of E0 and runs at 9600. What the
+ *	other codes select isn't known, so they run at 9600 too rather than
+ *	at a guess. A divider of n gives MUX_CUSTOM_CLOCK / (256 - n) baud,
+ *	which makes E0 9600 as well.
+ */
+#define MUX_SPEED_9600		5
+#define MUX_SPEED_CUSTOM	7
+#define MUX_CUSTOM_CLOCK	307200
+
+static void mux_set_speed(unsigned unit, unsigned speed)
+{
+	struct mux_card *card = &mux->card[mux->unit_card[unit]];
 
-	irq_level   = 0;
-	irq_enabled = 0;
-	irq_cause   = -1;
-	poll_count  = 0;
+	mux->unit[unit].speed = speed;
+	if (speed == MUX_SPEED_CUSTOM)
+		mux->unit[unit].baud = MUX_CUSTOM_CLOCK / (256 - card->divider);
+	else
+		mux->unit[unit].baud = 9600;
+}
+
+static void mux_reset_card(struct mux_card *card)
+{
+	unsigned i;
+
+	for (i = card->first; i < card->first + card->ports; i++) {
+		mux->unit[i].status        = MUX_TX_READY;
+		mux->unit[i].lastc         = 0xFF;
+		mux->unit[i].baud          = 9600;
+		mux->unit[i].speed         = MUX_SPEED_9600;
+		mux->unit[i].tx_done       = 0;
+		mux->unit[i].rx_ready_time = 0;
+	        mux->unit[i].tx_done_time  = 0;
+		mux_update(i);
+	}
+
+	card->divider     = 0;
+	card->irq_level   = 0;
+	card->irq_enabled = 0;
+	card->irq_cause   = -1;
+	mux_update_irqs(mux->trace);
+}
+
+static void mux_reset(void)
+{
+	unsigned i;
+
+	for (i = 0; i < mux->cards; i++)
+		mux_reset_card(&mux->card[i]);
+	mux->poll_count  = 0;
+}
+
+int mux_configure(const char *list)
+{
+	const char *p = list;
+	unsigned window = 0, unit = 0, n = 0;
+	struct mux_card *card;
+
+	memset(mux->window, -1, sizeof(mux->window));
+	while (*p) {
+		char *end;
+		unsigned long ports = strtoul(p, &end, 10);
+
+		if (end == p || (ports != 4 && ports != 8) ||
+		    window + ports / 4 > MUX_WINDOWS)
+			goto bad;
+		card = &mux->card[n];
+		card->first = unit;
+		card->ports = ports;
+		card->window = window;
+		while (ports) {
+			mux->window[window++] = n;
+			ports -= 4;
+		}
+		while (unit < card->first + card->ports) {
+			register_event(&mux->unit[unit].event);
+			mux->unit_card[unit++] = n;
+		}
+		n++;
+
+		p = end;
+		if (*p == ',' && p[1])
+			p++;
+		else if (*p)
+			goto bad;
+	}
+	if (n == 0)
+		goto bad;
+	mux->cards = n;
+	mux->units = unit;
+	STAT_SET(mux_units, unit);
+	mux_reset();
+	return 0;
+bad:
+	fprintf(stderr, "%s: MUX cards should be a list of 4 and 8, with at most %u windows\n",
+		list, MUX_WINDOWS);
+	return -1;
+}
+
+unsigned mux_units(void)
+{
+	return mux->units;
+}
+
+uint64_t mux_attached(void)
+{
+	return mux->attached;
 }
 
 // Set the initial state for all out ports
@@ -52,19 +278,225 @@ void mux_init(void)
 	int i;
 
 	for (i = 0; i < NUM_MUX_UNITS; i++) {
-		mux[i].in_fd = -1;
-		mux[i].out_fd = -1;
-		mux[i].mode = 0;
+		mux->unit[i].in_fd = -1;
+		mux->unit[i].out_fd = -1;
+		mux->unit[i].mode = MUX_MODE_CONSOLE;
+		mux->unit[i].host_baud = MUX_BAUD_GUEST;
 	}
+	mux->attached = 0;
 
-	mux_reset();
+	mux_configure("4");
 }
 
 void mux_attach(unsigned unit, char mode, int in_fd, int out_fd)
 {
-	mux[unit].in_fd = in_fd;
-	mux[unit].out_fd = out_fd;
-	mux[unit].mode = mode;
+	/* What was sent so far belongs to the old fd */
+	if (mux->unit[unit].tx_len)
+		mux_flush();
+	mux->unit[unit].tx_len = 0;
+	mux->unit[unit].in_fd = in_fd;
+	mux->unit[unit].out_fd = out_fd;
+	mux->unit[unit].mode = mode;
+	if (in_fd != -1)
+		mux->attached |= 1ULL << unit;
+	else
+		mux->attached &= ~(1ULL << unit);
+}
+
+void mux_attach_pty(unsigned unit, int master, int slave)
+{
+	mux_attach(unit, MUX_MODE_REMOTE, master, master);
+	mux->unit[unit].pty_master = master;
+	mux->unit[unit].pty_slave = slave;
+}
+
+void mux_set_host_baud(int unit, int baud)
+{
+	int i;
+
+	for (i = 0; i < NUM_MUX_UNITS; i++)
+		if (unit == -1 || unit == i)
+			mux->unit[i].host_baud = baud;
+}
+
+/* How long a character takes to go either way */
+static int64_t mux_char_ns(unsigned unit)
+{
+	struct MuxUnit *u = &mux->unit[unit];
+
+	if (u->host_baud == MUX_BAUD_UNLIMITED)
+		return MUX_UNLIMITED_NS;
+	// Start bit, 8 data bits, stop bit
+	return (int64_t)(ONE_SECOND_NS / (u->host_baud ? u->host_baud : u->baud)) * 10;
+}
+
+/*
+ *	Input record and replay
+ *
+ *	Everything the host side feeds the MUX goes through two places: the
+ *	poll that finds input waiting on a unit, and the data register read
+ *	that takes it. The log has a line for each, naming the mux_poll()
+ *	call it happened in (or after) and the emulated time:
+ *
+ *	<poll> <time_ns> ready <unit>
+ *	<poll> <time_ns> byte <unit> <hex>
+ *	<poll> <time_ns> eof <unit>
+ *	<poll> <time_ns> end
+ *
+ *	The emulation between them doesn't depend on the host, so a replay
+ *	started from the same boot or snapshot does exactly what the
+ *	recorded run did, however fast it runs.
+ */
+static void mux_log(char kind, unsigned unit, unsigned byte)
+{
+	fprintf(mux->record, "%" PRIu64 " %" PRId64 " ", mux->polls,
+		get_current_time());
+	switch (kind) {
+	case LOG_READY:
+		fprintf(mux->record, "ready %u\n", unit);
+		break;
+	case LOG_BYTE:
+		fprintf(mux->record, "byte %u %02x\n", unit, byte);
+		break;
+	case LOG_EOF:
+		fprintf(mux->record, "eof %u\n", unit);
+		break;
+	case LOG_END:
+		fprintf(mux->record, "end\n");
+		break;
+	}
+}
+
+static void mux_replay_next(void)
+{
+	struct mux_log_entry *e = &mux->next;
+	char line[128], kind[8];
+	unsigned long long poll;
+	long long time;
+	int n;
+
+	e->kind = 0;
+	while (fgets(line, sizeof(line), mux->replay)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		e->unit = 0;
+		e->byte = 0;
+		n = sscanf(line, "%llu %lld %7s %u %x", &poll, &time, kind,
+			   &e->unit, &e->byte);
+		e->poll = poll;
+		e->time = time;
+		if (n == 3 && strcmp(kind, "end") == 0)
+			e->kind = LOG_END;
+		else if (n == 4 && strcmp(kind, "ready") == 0)
+			e->kind = LOG_READY;
+		else if (n == 4 && strcmp(kind, "eof") == 0)
+			e->kind = LOG_EOF;
+		else if (n == 5 && strcmp(kind, "byte") == 0)
+			e->kind = LOG_BYTE;
+		if (e->kind && e->unit < mux->units)
+			return;
+		fprintf(stderr, "Bad input log line: %s", line);
+		e->kind = 0;
+	}
+}
+
+/* The guest didn't do what it did when recorded, nothing after is valid */
+static void mux_replay_diverged(const char *what, unsigned unit)
+{
+	fprintf(stderr, "MUX%u: replay diverged at poll %" PRIu64 ", time %" PRId64
+		" (%s)\n", unit, mux->polls, get_current_time(), what);
+	fclose(mux->replay);
+	mux->replay = NULL;
+	stop_system();
+}
+
+static void mux_replay_poll(unsigned trace)
+{
+	struct mux_log_entry *e = &mux->next;
+	struct MuxUnit *u;
+
+	while ((e->kind == LOG_READY || e->kind == LOG_END) && e->poll <= mux->polls) {
+		if (e->poll != mux->polls || e->time != get_current_time()) {
+			mux_replay_diverged("input out of step", e->unit);
+			return;
+		}
+		if (e->kind == LOG_END) {
+			stop_system();
+			mux_replay_next();
+			return;
+		}
+		u = &mux->unit[e->unit];
+		if (u->status & MUX_RX_READY || u->rx_ready_time) {
+			mux_replay_diverged("input not taken", e->unit);
+			return;
+		}
+		mux_set_read_ready(e->unit, trace);
+		mux_replay_next();
+	}
+}
+
+int mux_record(const char *path)
+{
+	mux->record = fopen(path, "w");
+	if (mux->record == NULL) {
+		perror(path);
+		return -1;
+	}
+	fprintf(mux->record, "# centurion input log\n");
+	return 0;
+}
+
+int mux_replay(const char *path)
+{
+	mux->replay = fopen(path, "r");
+	if (mux->replay == NULL) {
+		perror(path);
+		return -1;
+	}
+	mux_replay_next();
+	return 0;
+}
+
+void mux_record_end(void)
+{
+	if (mux->record == NULL)
+		return;
+	mux_log(LOG_END, 0, 0);
+	fclose(mux->record);
+	mux->record = NULL;
+}
+
+void mux_inject(unsigned unit, const uint8_t *data, size_t len)
+{
+	if (len == 0)
+		return;
+	if (mux->unit[unit].inject_len == 0)
+		mux->injecting++;
+	mux->unit[unit].inject = data;
+	mux->unit[unit].inject_len = len;
+}
+
+unsigned mux_injecting(unsigned unit)
+{
+	return mux->unit[unit].inject_len != 0;
+}
+
+void mux_set_tap(void (*tap)(unsigned unit, uint8_t c))
+{
+	mux->tap = tap;
+}
+
+/* Injected input arrives like input on an fd, whenever the unit is idle */
+static void mux_inject_poll(unsigned trace)
+{
+	unsigned unit;
+
+	for (unit = 0; unit < mux->units; unit++) {
+		struct MuxUnit *u = &mux->unit[unit];
+
+		if (u->inject_len && !(u->status & MUX_RX_READY) && !u->rx_ready_time)
+			mux_set_read_ready(unit, trace);
+	}
 }
 
 /* Utility functions for the mux */
@@ -80,32 +512,55 @@ static unsigned int next_char(uint8_t unit)
 	 * never become ready to read
 	 */
 	
-	if (unit != 0) fprintf(stderr, "Starting read\n");
+	LOG_DEBUG(TRACE_MUX, "MUX%u: starting read", unit);
 
-	if (!(mux[unit].status & MUX_RX_READY)) {
-
-		fprintf(stderr, "Mux not ready, return '%X' for unit %d\n", mux[unit].lastc, unit);
-		return mux[unit].lastc;
+	if (!(mux->unit[unit].status & MUX_RX_READY)) {
+		LOG_DEBUG(TRACE_MUX, "MUX%u: not ready, returning %02X", unit,
+			  mux->unit[unit].lastc);
+		return mux->unit[unit].lastc;
 	}
 
 	
-	r = read(mux[unit].in_fd, &c, 1);
-
-	if (unit != 0) fprintf(stderr, "Read complete\n");
+	if (mux->replay) {
+		struct mux_log_entry *e = &mux->next;
 
-	/* if mode is console (0), do character preprocessing */
-	if (!mux[unit].mode) {
-		if (r == 0) {
-			emulator_done = 1;
-			return mux[unit].lastc;
+		if ((e->kind != LOG_BYTE && e->kind != LOG_EOF) ||
+		    e->unit != unit || e->poll != mux->polls) {
+			mux_replay_diverged("unexpected read", unit);
+			return mux->unit[unit].lastc;
+		}
+		r = e->kind == LOG_BYTE;
+		c = e->byte;
+		mux_replay_next();
+	} else if (mux->unit[unit].inject_len) {
+		r = 1;
+		c = *mux->unit[unit].inject++;
+		if (--mux->unit[unit].inject_len == 0)
+			mux->injecting--;
+	} else
+		r = read(mux->unit[unit].in_fd, &c, 1);
+
+	LOG_DEBUG(TRACE_MUX, "MUX%u: read complete", unit);
+
+	/* terminals get character preprocessing */
+	if (mux->unit[unit].mode != MUX_MODE_RAW) {
+		/* Someone read the port when nothing there */
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (mux->record)
+				mux_log(LOG_BYTE, unit, mux->unit[unit].lastc);
+			return mux->unit[unit].lastc;
 		}
 
-		if (r < 0) {
-			/* Someone read the port when nothing there */
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				return mux[unit].lastc;
-			}
-			exit(1);
+		/* Hung up, or the connection was reset */
+		if (r <= 0) {
+			if (mux->record)
+				mux_log(LOG_EOF, unit, 0);
+			/* A remote terminal went away, the machine carries on */
+			if (mux->unit[unit].mode == MUX_MODE_REMOTE)
+				mux_attach(unit, MUX_MODE_REMOTE, -1, -1);
+			else
+				stop_system();
+			return mux->unit[unit].lastc;
 		}
 
 		if (c == 0x7F) {
@@ -116,69 +571,116 @@ static unsigned int next_char(uint8_t unit)
 		/* if nothing has been read, just return 0 */
 		if (r <= 0) {
 			c = 0;
-			fprintf(stderr, "Nothing has been read!\n");
+			LOG_DEBUG(TRACE_MUX, "MUX%u: nothing has been read", unit);
 		}
 	}
 
 
-	mux[unit].lastc = c;
+	mux->unit[unit].lastc = c;
+	STAT_INC(mux_rx_bytes[unit]);
+	if (mux->record)
+		mux_log(LOG_BYTE, unit, c);
 
-	fprintf(stderr, "Normal read, return '%X' for unit %d\n", c, unit);
+	LOG_DEBUG(TRACE_MUX, "MUX%u: read %02X", unit, c);
 
 	return c;
 }
 
-static int mux_assert_irq(unsigned unit, unsigned reason, unsigned trace)
+static void mux_assert_irq(struct mux_card *card, unsigned unit, unsigned reason,
+			   unsigned trace)
 {
-	if (!irq_enabled)
-		return 0;
+	unsigned port = unit - card->first;
 
-	if (irq_cause != (unit << 1 | reason))
+	if (card->irq_cause != (port << 1 | reason))
 		TRACE("MUX%i: %s IRQ raised", unit, reason ? "TX" : "RX");
 
-	// Cause is actually the lower 8 bits of unit that caused the interrupt
-	// Though, TX interrupts have the lower bit set
-	irq_cause = (unit << 1) | reason;
-	cpu_assert_irq(irq_level);
+	// Cause is actually the lower 8 bits of the card's port that caused the
+	// interrupt. Though, TX interrupts have the lower bit set
+	card->irq_cause = (port << 1) | reason;
+	mux->irq_lines |= 1 << card->irq_level;
+	cpu_assert_irq(card->irq_level);
+}
 
-	return 1;
+static void mux_enable_irq(struct mux_card *card, unsigned char enable, unsigned trace)
+{
+	TRACE_PC("MUX card %u irq enable = %d\n", (unsigned)(card - mux->card), enable);
+	card->irq_enabled = enable;
+	mux_update_irqs(trace);
 }
 
-static void mux_enable_irq(unsigned char enable, unsigned trace)
+struct MuxUnit *mux_get_unit(unsigned unit)
 {
-	TRACE_PC("MUX irq enable = %d\n", enable);
-	irq_enabled = enable;
+	return &mux->unit[unit];
 }
 
-static void mux_unit_send(unsigned unit, uint8_t val) {
-	if (!(mux[unit].status & MUX_TX_READY)) {
-		WARN_PC("Write to busy MUX%i port", unit);
+void mux_flush(void)
+{
+	int unit;
+
+	if (!mux->tx_pending)
+		return;
+	mux_flush_fds();
+	/* Anything the host couldn't take yet goes next time */
+	mux->tx_pending = 0;
+	for (unit = 0; unit < mux->units; unit++)
+		if (mux->unit[unit].tx_len)
+			mux->tx_pending = 1;
+	mux->tx_flush_ns = get_current_time() + MUX_TX_FLUSH_NS;
+}
+
+static void mux_queue_output(unsigned unit, const void *data, unsigned len)
+{
+	struct MuxUnit *u = &mux->unit[unit];
+
+	if (u->tx_len + len > MUX_TX_BUF)
+		mux_flush();
+	/* The host side is stuck, as an unbuffered write would have been */
+	if (u->tx_len + len > MUX_TX_BUF)
+		return;
+	if (!mux->tx_pending) {
+		mux->tx_pending = 1;
+		mux->tx_flush_ns = get_current_time() + MUX_TX_FLUSH_NS;
 	}
-	mux[unit].status &= ~MUX_TX_READY;
-	uint64_t symbol_time = (1000000000.0 / (double)mux[unit].baud);
+	memcpy(u->tx_buf + u->tx_len, data, len);
+	u->tx_len += len;
+	if (u->tx_len >= MUX_TX_FLUSH_BYTES)
+		mux_flush();
+}
 
+static void mux_unit_send(unsigned unit, uint8_t val) {
+	if (!(mux->unit[unit].status & MUX_TX_READY)) {
+		LOG_WARN_PC(TRACE_MUX, "Write to busy MUX%i port", unit);
+	}
+	mux->unit[unit].status &= ~MUX_TX_READY;
 	// it takes time for the send to complete
-	mux[unit].tx_done_time = get_current_time() + (symbol_time * 10);
+	mux->unit[unit].tx_done_time = get_current_time() + mux_char_ns(unit);
+	mux_update(unit);
+	mux->activity_ns = get_current_time();
+	STAT_INC(mux_tx_bytes[unit]);
 
-	if (mux[unit].out_fd == -1) {
+	if (mux->tap)
+		mux->tap(unit, mux->unit[unit].mode == MUX_MODE_RAW ? val : val & 0x7F);
+
+	if (mux->unit[unit].out_fd == -1) {
 		/* This MUX unit isn't connected to anything */
 		return;
 	}
 
-	if (mux[unit].out_fd > 1) {
-		/* if not in console mode, then just send the "real" value */
-		if (!mux[unit].mode) val &= 0x7F;
-		write(mux[unit].out_fd, &val, 1);
+	if (mux->unit[unit].out_fd > 1) {
+		/* only a serial device gets the "real" value */
+		if (mux->unit[unit].mode != MUX_MODE_RAW) val &= 0x7F;
+		mux_queue_output(unit, &val, 1);
 	} else {
+		char buf[8];
+
 		val &= 0x7F;
 		if (val == 0x06) /* Cursor one position right */
-			printf("\x1b[1C");
+			mux_queue_output(unit, "\x1b[1C", 4);
 		else if (val != 0x08 && val != 0x0A && val != 0x0D
 		    && (val < 0x20 || val == 0x7F))
-			printf("[%02X]", val);
+			mux_queue_output(unit, buf, snprintf(buf, sizeof(buf), "[%02X]", val));
 		else
-			putchar(val);
-		fflush(stdout);
+			mux_queue_output(unit, &val, 1);
 	}
 }
 
@@ -210,40 +712,47 @@ static void mux_unit_send(unsigned unit, uint8_t val) {
  *
  */
 
+/* The card answering at addr, and the unit whose data and status registers
+   are there. A MUX8 has ports 4-7 in its second window. */
+static struct mux_card *mux_decode(uint16_t addr, unsigned *unit)
+{
+	unsigned window = (addr >> 4) & 0xF;
+	struct mux_card *card;
+
+	if (mux->window[window] < 0)
+		return NULL;
+	card = &mux->card[mux->window[window]];
+	*unit = card->first + (window - card->window) * 4 + ((addr >> 1) & 0x3);
+	return card;
+}
+
 /* Bit 0 of control is char pending. The real system uses mark parity so
    we ignore that */
 void mux_write(uint16_t addr, uint8_t val, uint32_t trace)
 {
-	unsigned card, unit, port, mode;
+	struct mux_card *card;
+	unsigned unit, mode;
 
 	// Decode address
 
-	// Nibble 1 of the address is the card number
-	// Each MUX4 board supports 4 ports.
-	// There are apparently MUX8 cards, which might act as two cards?
-	card = (addr >> 4) & 0xF;
+	// Nibble 1 of the address is the card window. Each MUX4 board
+	// supports 4 ports, a MUX8 acts as two of them with one set of controls
+	card = mux_decode(addr, &unit);
+	if (card == NULL) {
+		TRACE_PC("MUX: Write to absent card reg %x", addr);
+		return;
+	}
 
 	mode = addr & 0xf;
-	if (mode > 7) {
-		port = 0;
-		unit = card * 4;
-	} else {
+	if (mode <= 7) {
 		// Data or status
 		mode &= 1;
-		// Bits 1 and 2 are port
-		port = (addr >> 1) & 0x3;
-		unit = card * 4 + port;
-	}
-
-	if (unit > NUM_MUX_UNITS) {
-		TRACE_PC("MUX%i: Write to disabled unit reg %x", unit, addr);
-		return;
 	}
 
 	switch(mode) {
 	case 0: // Status Reg
-		TRACE_PC("MUX%i: Status Write %x", unit, val);
-		// TODO: Implement baud
+		mux_set_speed(unit, val & 0x7);
+		TRACE_PC("MUX%i: Status Write %x, %d baud", unit, val, mux->unit[unit].baud);
 		break;
 	case 1: // Data Reg
 		TRACE_WITH_CHAR(val, "MUX%i: Data Write", unit);
@@ -253,16 +762,22 @@ void mux_write(uint16_t addr, uint8_t val, uint32_t trace)
 		/* This controls RTS lines. Bits 1 and 2 specify unit number,
 		 * bit 0 is the actual value to set on the respective line.
 		 */
-		TRACE_PC("MUX%d RTS = %d", val >> 1, val & 1);
+		TRACE_PC("MUX%d RTS = %d", card->first + (val >> 1), val & 1);
 		break;
 	/* Register 9 isn't used */
 	case 0xA: // Set interrupt request level
-		TRACE_PC("MUX%i: IRQ level = %i", unit, val);
-		irq_level = val;
+		TRACE_PC("MUX card %u: IRQ level = %i", (unsigned)(card - mux->card), val);
+		/* There are 16 levels */
+		card->irq_level = val & 0xF;
+		mux_update_irqs(trace);
 		break;
 	case 0xB:
 		/* This configures custom baud rate */
 		TRACE_PC("MUX custom baud rate %02x", val);
+		card->divider = val;
+		for (unit = card->first; unit < card->first + card->ports; unit++)
+			if (mux->unit[unit].speed == MUX_SPEED_CUSTOM)
+				mux_set_speed(unit, MUX_SPEED_CUSTOM);
 		break;
 	case 0xC:
 		/* OPSYS kernel writes unit number (starting from 1)
@@ -271,93 +786,93 @@ void mux_write(uint16_t addr, uint8_t val, uint32_t trace)
 		 * on the given unit. Before doing so, the output routine actually
 		 * waits for MUX_TX_READY bit to go high using a polled loop
 		 */
-		mux[val - 1].tx_done = 1;
+		if (val == 0 || val > card->ports) {
+			LOG_WARN_PC(TRACE_MUX, "TX interrupt forced on MUX card %u port %u",
+				(unsigned)(card - mux->card), val);
+			break;
+		}
+		unit = card->first + val - 1;
+		mux->unit[unit].tx_done = 1;
+		mux_update(unit);
 		break;
 	case 0xD:
 	        /* Disable IRQ, the value is ignored */
-		mux_enable_irq(0, trace);
+		mux_enable_irq(card, 0, trace);
 		break;
 	case 0xE:
 		/* Enable IRQ, the value is ignored */
-		mux_enable_irq(1, trace);
+		mux_enable_irq(card, 1, trace);
 		break;
 	case 0xF:
 	        /* Reset the card, the value is ignored */
 		TRACE_PC("MUX reset");
-		cpu_deassert_irq(irq_level);
-		mux_reset();
+		cpu_deassert_irq(card->irq_level);
+		mux->irq_lines &= ~(1 << card->irq_level);
+		mux_reset_card(card);
 		break;
 	default:
-		WARN_PC("Write to unknown MUX register %x=%02x", addr, val);
+		LOG_WARN_PC(TRACE_MUX, "Write to unknown MUX register %x=%02x", addr, val);
 		break;
 	}
 }
 
 uint8_t mux_read(uint16_t addr, uint32_t trace)
 {
-	unsigned card, port, unit, data, mode;
+	struct mux_card *card;
+	unsigned unit, data, mode;
 
 	
 	data = 0;
 
+	card = mux_decode(addr, &unit);
+	if (card == NULL) {
+		LOG_WARN_PC(TRACE_MUX, "MUX: Read of absent card reg %x", addr);
+		return data;
+	}
 
-	// It seems that all mux units share the same cause register via chaining
-	if (addr == 0xf20f) {
-		TRACE_PC("MUX: InterruptCause Read: %02x", irq_cause);
+	// Each card has a cause register, shared by all of its units
+	if ((addr & 0xf) == 0xf) {
+		TRACE_PC("MUX: InterruptCause Read: %02x", card->irq_cause);
 
-		if (irq_cause & MUX_IRQ_TX) {
+		if (card->irq_cause >= 0 && (card->irq_cause & MUX_IRQ_TX)) {
 			// Reading this register is enough to clear the TX IRQ, but it seems
 			// to not clear the RX IRQ, you actually have to read the data
-			unsigned char unit = (irq_cause & MUX_UNIT_MASK) >> 1;
-			mux[unit].tx_done = 0;
+			unit = card->first + (card->irq_cause >> 1);
+			mux->unit[unit].tx_done = 0;
+			mux_update(unit);
 
 			TRACE("MUX%i: TX IRQ acknowledged", unit);
 		}
 
-		return irq_cause;
+		return card->irq_cause;
 	}
 
 	// Decode address
 
-	// Nibble 1 of the address is the card number
-	// Each MUX4 board supports 4 ports.
-	// There are apparently MUX8 cards, which might act as two cards?
-	card = (addr >> 4) & 0xF;
-
-
 	mode = addr & 0xf;
-	if (mode > 7) {
-		unit = card*4;
-	} else {
-		// Bits 1 and 2 are port
-		port = (mode >> 1) & 0x3;
-		unit = card * 4 + port;
+	if (mode <= 7)
 		mode = mode & 1;
-	}
-
-	if (unit > NUM_MUX_UNITS) {
-		if (addr != 0xf20f)
-			WARN_PC("MUX%i: Read to disabled unit reg %x", unit, addr);
-		return data;
-	}
 
-	if (addr != 0xF200) fprintf(stderr, "Requested mux read at '%X' on mode '%d'\n", addr, mode);
+	LOG_DEBUG(TRACE_MUX, "MUX read at %04X, register %d", addr, mode);
 	
 	switch (mode)
 	{
 	case 0x0: // Status register
 		// Force CTS on
-		data = mux[unit].status | MUX_CTS;
+		data = mux->unit[unit].status | MUX_CTS;
+		if (!(data & MUX_RX_READY))
+			mux->idle_polls++;
 		TRACE_PC("MUX%i: Status Read = %02x", unit, data);
 		break;
 	case 0x1:
 		// Data register
 		data = next_char(unit);
-		mux[unit].status &= ~MUX_RX_READY;
+		mux->unit[unit].status &= ~MUX_RX_READY;
+		mux_update(unit);
 		TRACE_WITH_CHAR(data, "MUX%i: Data Read =", unit);
 		break;
 	default:
-		WARN_PC("MUX%i: Unknown Register %x Read", unit, addr);
+		LOG_WARN_PC(TRACE_MUX, "MUX%i: Unknown Register %x Read", unit, addr);
 		break;
 	}
 
@@ -366,28 +881,33 @@ uint8_t mux_read(uint16_t addr, uint32_t trace)
 
 void mux_set_read_ready(unsigned unit, unsigned trace)
 {
-	assert(mux[unit].rx_ready_time == 0);
+	assert(mux->unit[unit].rx_ready_time == 0);
+
+	if (mux->record)
+		mux_log(LOG_READY, unit, 0);
+	mux->activity_ns = get_current_time();
 
 	// We need a delay here, otherwise interrupts would fire too fast.
-	uint64_t symbol_time = (ONE_SECOND_NS / mux[unit].baud);
-	mux[unit].rx_ready_time = get_current_time() + symbol_time * 10;
+	mux->unit[unit].rx_ready_time = get_current_time() + mux_char_ns(unit);
+	mux_update(unit);
 }
 
-void mux_process_events(unsigned unit, unsigned trace) {
+static void mux_process_events(unsigned unit, unsigned trace) {
 	int64_t time = get_current_time();
 
-	if (mux[unit].rx_ready_time && mux[unit].rx_ready_time <= time) {
-		assert(mux[unit].in_fd != -1);
-		mux[unit].rx_ready_time = 0;
-		mux[unit].status |= MUX_RX_READY;
-		poll_count = 0;
+	if (mux->unit[unit].rx_ready_time && mux->unit[unit].rx_ready_time <= time) {
+		assert(mux->unit[unit].in_fd != -1 || mux->replay ||
+		       mux->unit[unit].inject_len);
+		mux->unit[unit].rx_ready_time = 0;
+		mux->unit[unit].status |= MUX_RX_READY;
+		mux->poll_count = 0;
 
 		TRACE("MUX%i: RX_READY", unit);
 	}
 
-	if (mux[unit].tx_done_time && mux[unit].tx_done_time <= time) {
-		mux[unit].tx_done_time = 0;
-		mux[unit].status |= MUX_TX_READY;
+	if (mux->unit[unit].tx_done_time && mux->unit[unit].tx_done_time <= time) {
+		mux->unit[unit].tx_done_time = 0;
+		mux->unit[unit].status |= MUX_TX_READY;
 
 		/* If a TX done interrupt is requested, it will be raised when the UART
 			* switches from BUSY to READY state. The UART spends in READY state most
@@ -396,56 +916,199 @@ void mux_process_events(unsigned unit, unsigned trace) {
 			* perhaps a part of the status register, but we don't know which one,
 			* we haven't found any reads, so for now we keep it completely separate.
 			*/
-		if (irq_enabled)
-			mux[unit].tx_done = 1;
+		if (mux->card[mux->unit_card[unit]].irq_enabled)
+			mux->unit[unit].tx_done = 1;
 
-		TRACE("MUX%i: TX_READY; TX_DONE = %d", unit, mux[unit].tx_done);
+		TRACE("MUX%i: TX_READY; TX_DONE = %d", unit, mux->unit[unit].tx_done);
 	}
+	mux_update(unit);
 }
 
-void mux_poll(unsigned trace)
+/* A unit's rx_ready_time or tx_done_time has come */
+static void mux_event(struct event_t *event, int64_t late_ns)
 {
-	int unit;
-
-	for (unit = 0; unit < NUM_MUX_UNITS; unit++)
-		mux_process_events(unit, trace);
+	struct MuxUnit *u = (struct MuxUnit *)((char *)event - offsetof(struct MuxUnit, event));
 
-	// Cheap speedhack, only check FDs sometimes
-	if ((poll_count++ & 0xF) == 0)
-		mux_poll_fds(trace);
+	mux_process_events(u - mux->unit, mux->trace);
+}
 
-	cpu_deassert_irq(irq_level);
+/*
+ * Updates current IRQ state and chooses each card's irq_cause register value according to
+ * unit interrupt priorities. Each unit has two interrupts: RX and TX, and we enumerate
+ * them in order, starting from 0: RX0, TX0, RX1, TX1, etc. We consider the lowest
+ * number to have the highest priority, we aren't sure whether the real hardware
+ * does the same, but it's easy to reverse, if needed, by walking the set the other way.
+ */
+static void mux_update_irqs(unsigned trace)
+{
+	uint16_t lines = mux->irq_lines;
+	unsigned raised = 0;		/* Cards with a cause chosen */
+	uint64_t set;
+	unsigned i;
+
+	mux->irq_lines = 0;
+	for (set = mux->requesting; set; set &= set - 1) {
+		unsigned unit = __builtin_ctzll(set);
+		unsigned c = mux->unit_card[unit];
+		struct mux_card *card = &mux->card[c];
+
+		if (!card->irq_enabled || (raised & (1 << c)))
+			continue;
+		raised |= 1 << c;
+		mux_assert_irq(card, unit, mux->unit[unit].status & MUX_RX_READY ?
+			       MUX_IRQ_RX : MUX_IRQ_TX, trace);
+	}
 
 	/*
-	 * Updates current IRQ state and chooses current irq_cause register value according to
-	 * unit interrupt priorities. Each unit has two interrupts: RX and TX, and we enumerate
-	 * them in order, starting from 0: RX0, TX0, RX1, TX1, etc. We consider the lowest
-	 * number to have the highest priority, we aren't sure whether the real hardware
-	 * does the same, but it's easy to reverse, if needed, by removing break statements.
+	 * Only drop a line once no card is requesting an interrupt on it, so
+	 * that a request that stays pending is seen as one continuous assertion.
 	 */
-	for (unit = 0; unit < NUM_MUX_UNITS; unit++) {
-		if (mux[unit].status & MUX_RX_READY && mux_assert_irq(unit, MUX_IRQ_RX, trace))
-			return;
-		if (mux[unit].tx_done && mux_assert_irq(unit, MUX_IRQ_TX, trace))
-			return;
+	for (i = 0; i < 16; i++)
+		if ((lines & ~mux->irq_lines) & (1 << i))
+			cpu_deassert_irq(i);
+
+	for (i = 0; i < mux->cards; i++) {
+		if (raised & (1 << i))
+			continue;
+		if (mux->card[i].irq_cause >= 0)
+			TRACE("MUX: Last mux interrupt acknowledged");
+		mux->card[i].irq_cause = -1;
 	}
+}
 
-	if (irq_cause >= 0)
-		TRACE("MUX: Last mux interrupt acknowledged");
+void mux_poll(unsigned trace)
+{
+	mux->polls++;
+	mux->trace = trace;
+	if (mux->tx_pending && get_current_time() >= mux->tx_flush_ns)
+		mux_flush();
 
-	irq_cause = -1;
+	// Cheap speedhack, only check FDs sometimes
+	if ((mux->poll_count++ & 0xF) == 0 && mux->replay == NULL)
+		mux_poll_fds(trace);
+	if (mux->replay)
+		mux_replay_poll(trace);
+	if (mux->injecting)
+		mux_inject_poll(trace);
+}
+
+int64_t mux_last_activity(void)
+{
+	return mux->activity_ns;
+}
+
+uint32_t mux_idle_polls(void)
+{
+	uint32_t n = mux->idle_polls;
+
+	mux->idle_polls = 0;
+	return n;
 }
 
 int mux_get_in_poll_fd(unsigned unit)
 {
         /* Do not poll if already has a pending character or of the
          * delay hasn't expired yet */
-        if (mux[unit].status & MUX_RX_READY || mux[unit].rx_ready_time)
+        if (mux->unit[unit].status & MUX_RX_READY || mux->unit[unit].rx_ready_time)
                 return -1;
-        return mux[unit].in_fd;
+        return mux->unit[unit].in_fd;
 }
 
 int mux_get_in_fd(unsigned unit)
 {
-	return mux[unit].in_fd;
+	return mux->unit[unit].in_fd;
+}
+
+/*
+ *	Snapshot support. The host side of each unit (fds and mode) belongs
+ *	to the new process and is left alone.
+ */
+struct mux_unit_snapshot {
+	int64_t rx_ready_time;
+	int64_t tx_done_time;
+	int32_t baud;
+	uint8_t status;
+	uint8_t lastc;
+	uint8_t tx_done;
+	uint8_t speed;
+};
+
+struct mux_card_snapshot {
+	int32_t irq_cause;
+	uint8_t ports;
+	uint8_t irq_level;
+	uint8_t irq_enabled;
+	uint8_t divider;
+};
+
+struct mux_snapshot {
+	struct mux_unit_snapshot unit[NUM_MUX_UNITS];
+	struct mux_card_snapshot card[MUX_MAX_CARDS];
+	uint32_t cards;
+	uint32_t poll_count;
+};
+
+void mux_save_state(struct snapshot *s)
+{
+	struct mux_snapshot ms;
+	unsigned i;
+
+	memset(&ms, 0, sizeof(ms));
+	for (i = 0; i < mux->units; i++) {
+		ms.unit[i].rx_ready_time = mux->unit[i].rx_ready_time;
+		ms.unit[i].tx_done_time = mux->unit[i].tx_done_time;
+		ms.unit[i].baud = mux->unit[i].baud;
+		ms.unit[i].status = mux->unit[i].status;
+		ms.unit[i].lastc = mux->unit[i].lastc;
+		ms.unit[i].tx_done = mux->unit[i].tx_done;
+		ms.unit[i].speed = mux->unit[i].speed;
+	}
+	for (i = 0; i < mux->cards; i++) {
+		ms.card[i].irq_cause = mux->card[i].irq_cause;
+		ms.card[i].ports = mux->card[i].ports;
+		ms.card[i].irq_level = mux->card[i].irq_level;
+		ms.card[i].irq_enabled = mux->card[i].irq_enabled;
+		ms.card[i].divider = mux->card[i].divider;
+	}
+	ms.cards = mux->cards;
+	ms.poll_count = mux->poll_count;
+	snapshot_write_section(s, "MUX ", &ms, sizeof(ms));
+}
+
+int mux_load_state(struct snapshot *s)
+{
+	struct mux_snapshot ms;
+	unsigned i;
+
+	if (snapshot_read_section(s, "MUX ", &ms, sizeof(ms)))
+		return -1;
+	/* The cards are hardware, the snapshot must be of the same machine */
+	for (i = 0; i < ms.cards && i < mux->cards; i++)
+		if (ms.card[i].ports != mux->card[i].ports)
+			break;
+	if (ms.cards != mux->cards || i != mux->cards) {
+		fprintf(stderr, "Snapshot has different MUX cards (see -c)\n");
+		return -1;
+	}
+	for (i = 0; i < mux->units; i++) {
+		mux->unit[i].rx_ready_time = ms.unit[i].rx_ready_time;
+		mux->unit[i].tx_done_time = ms.unit[i].tx_done_time;
+		mux->unit[i].baud = ms.unit[i].baud;
+		mux->unit[i].status = ms.unit[i].status;
+		mux->unit[i].lastc = ms.unit[i].lastc;
+		mux->unit[i].tx_done = ms.unit[i].tx_done;
+		mux->unit[i].speed = ms.unit[i].speed;
+		mux_update(i);
+	}
+	mux->irq_lines = 0;
+	for (i = 0; i < mux->cards; i++) {
+		mux->card[i].irq_cause = ms.card[i].irq_cause;
+		mux->card[i].irq_level = ms.card[i].irq_level;
+		mux->card[i].irq_enabled = ms.card[i].irq_enabled;
+		mux->card[i].divider = ms.card[i].divider;
+		if (mux->card[i].irq_cause >= 0)
+			mux->irq_lines |= 1 << mux->card[i].irq_level;
+	}
+	mux->poll_count = ms.poll_count;
+	return 0;
 }
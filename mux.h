@@ -1,7 +1,24 @@
+#pragma once
+
 #include <inttypes.h>
+#include <stddef.h>
+
+#include "scheduler.h"
 
 #define MUX0_BASE 0xf200
-#define NUM_MUX_UNITS 4
+
+/* MUX4 and MUX8 cards answer at F200-F2FF, a 16 byte window each for a MUX4
+   and two for a MUX8. Units are numbered across the cards in order, and
+   unit sets are uint64_t, so there can't be more than 64 of them. */
+#define MUX_WINDOWS	16
+#define MUX_MAX_CARDS	MUX_WINDOWS
+#define NUM_MUX_UNITS	(MUX_WINDOWS * 4)
+
+/* Output is buffered per unit, and written once there is this much of it,
+   or it has waited this long in emulated time, or the machine idles */
+#define MUX_TX_BUF		256
+#define MUX_TX_FLUSH_BYTES	128
+#define MUX_TX_FLUSH_NS		10000000
 
 struct MuxUnit
 {
@@ -10,12 +27,32 @@ struct MuxUnit
 	char mode;
         unsigned char status;
         unsigned char lastc;
-        int baud;
+        int baud;			/* As the guest programmed it */
+	int host_baud;			/* MUX_BAUD_..., or a rate */
+	unsigned char speed;		/* Speed select, see mux_set_speed() */
         unsigned char tx_done;
         int64_t rx_ready_time;
         int64_t tx_done_time;
+	const uint8_t *inject;		/* Input fed by mux_inject() */
+	size_t inject_len;
+	uint8_t tx_buf[MUX_TX_BUF];	/* Output not written to out_fd yet */
+	unsigned tx_len;
+	struct event_t event;		/* At rx_ready_time or tx_done_time */
+	char event_name[8];
+	int pty_master;			/* Pseudo terminal it owns, or -1 */
+	int pty_slave;
 };
 
+/* What a unit is attached to on the host side */
+#define MUX_MODE_CONSOLE	0	/* A terminal, EOF ends the emulation */
+#define MUX_MODE_RAW		1	/* A serial device, bytes pass unchanged */
+#define MUX_MODE_REMOTE		2	/* A terminal that may come and go */
+
+/* Host side rate of a unit, which the guest can't change */
+#define MUX_BAUD_GUEST		0	/* Whatever the guest programmed */
+#define MUX_BAUD_UNLIMITED	-1	/* A character every MUX_UNLIMITED_NS */
+#define MUX_UNLIMITED_NS	4000
+
 /* Status register bits */
 #define MUX_RX_READY   (1 << 0)
 #define MUX_TX_READY   (1 << 1)
@@ -29,15 +66,53 @@ struct MuxUnit
 #define MUX_IRQ_TX 1
 #define MUX_UNIT_MASK 0x06
 
+struct mux_state;
+
+struct mux_state *mux_create(void);
+void mux_destroy(struct mux_state *m);
+void mux_bind(struct mux_state *m);
 void mux_init(void);
+/* Fit the cards in list, such as "4,8,4" (the default is "4"). Errors are
+   reported to stderr. */
+int mux_configure(const char *list);
+unsigned mux_units(void);
+/* Units attached to an input fd */
+uint64_t mux_attached(void);
 void mux_attach(unsigned unit, char mode, int in_fd, int out_fd);
+/* Attach as a remote terminal, closing both fds with the MUX */
+void mux_attach_pty(unsigned unit, int master, int slave);
+/* Override the rate of unit, or of every unit if unit is -1 */
+void mux_set_host_baud(int unit, int baud);
 void mux_poll(unsigned trace);
 
 void mux_write(uint16_t addr, uint8_t val, uint32_t trace);
 uint8_t mux_read(uint16_t addr, uint32_t trace);
 
 void mux_set_read_ready(unsigned unit, unsigned trace);
+/* Emulated time any unit last sent or received anything */
+int64_t mux_last_activity(void);
+/* Status reads that found no input waiting since the last call */
+uint32_t mux_idle_polls(void);
 int mux_get_in_poll_fd(unsigned unit);
 int mux_get_in_fd(unsigned unit);
 
 void mux_poll_fds(unsigned trace);
+
+/* Write out all buffered output now */
+void mux_flush(void);
+/* The host side of mux_flush(), which writes and consumes tx_buf */
+void mux_flush_fds(void);
+struct MuxUnit *mux_get_unit(unsigned unit);
+
+/* Log the input every unit receives, or replay a log in place of the host
+   side. A replay starts from the same boot or snapshot as the recording. */
+int mux_record(const char *path);
+int mux_replay(const char *path);
+void mux_record_end(void);
+
+/* Type len bytes on a unit in place of its input fd. The data must stay
+   valid until mux_injecting() says it has all been taken. */
+void mux_inject(unsigned unit, const uint8_t *data, size_t len);
+unsigned mux_injecting(unsigned unit);
+/* Have tap called with every byte any unit sends */
+void mux_set_tap(void (*tap)(unsigned unit, uint8_t c));
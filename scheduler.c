@@ -1,19 +1,123 @@
 #include "scheduler.h"
 #include "cpu6.h"
+#include "mux.h"
+#include "snapshot.h"
+#include "stats.h"
 
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
-static struct event_t* event_list = NULL;
-static uint64_t next_event = UINT64_MAX;
-static unsigned trace_schedule = 0;
+// The devices, and an event for each MUX unit
+#define MAX_REGISTERED_EVENTS (16 + NUM_MUX_UNITS)
+
+// Dispatch instrumentation, kept per event name so that events sharing
+// a name (say, several instances of a device) are reported together.
+#define MAX_EVENT_STATS 32
+
+struct event_stats {
+    const char *name;
+    struct histogram late;
+};
+
+// One event queue per machine, reached through the thread's current
+// machine (see machine.h).
+struct scheduler_state {
+    struct event_t* event_list;
+    uint64_t next_event;
+    unsigned trace_schedule;
+
+    struct event_t* registered_events[MAX_REGISTERED_EVENTS];
+    unsigned num_registered_events;
+
+    struct event_stats event_stats[MAX_EVENT_STATS];
+    unsigned num_event_stats;
+    unsigned queue_len;
+    unsigned max_queue_len;
+};
+
+static _Thread_local struct scheduler_state *sched;
+
+struct scheduler_state *scheduler_create(void)
+{
+    struct scheduler_state *s = calloc(1, sizeof(*s));
+
+    if (s == NULL) {
+        perror("scheduler_create");
+        exit(1);
+    }
+    s->next_event = UINT64_MAX;
+    return s;
+}
+
+void scheduler_destroy(struct scheduler_state *s)
+{
+    free(s);
+}
+
+void scheduler_bind(struct scheduler_state *s)
+{
+    sched = s;
+}
+
+static struct event_stats* lookup_event_stats(const char *name)
+{
+    unsigned i;
+
+    for (i = 0; i < sched->num_event_stats; i++) {
+        if (strcmp(sched->event_stats[i].name, name) == 0)
+            return &sched->event_stats[i];
+    }
+    // Out of slots, lump everything else together
+    if (sched->num_event_stats == MAX_EVENT_STATS) {
+        sched->event_stats[MAX_EVENT_STATS - 1].name = "(other)";
+        return &sched->event_stats[MAX_EVENT_STATS - 1];
+    }
+    sched->event_stats[sched->num_event_stats].name = name;
+    return &sched->event_stats[sched->num_event_stats++];
+}
 
 static void update_next_event()
 {
     // Update next_event
-    next_event = (event_list == NULL) ? UINT64_MAX : event_list->scheduled_ns;
+    sched->next_event = (sched->event_list == NULL) ? UINT64_MAX : sched->event_list->scheduled_ns;
+
+}
+
+static void insert_event(struct event_t *event, int64_t scheduled, unsigned at_tail)
+{
+    event->scheduled_ns = scheduled;
 
+    struct event_t** next_ptr = &sched->event_list;
+
+    // Insert event into sorted list. Ties go in front, unless restoring
+    // a saved queue, where the saved order has to be kept.
+    while (*next_ptr && ((*next_ptr)->scheduled_ns < scheduled ||
+            (at_tail && (*next_ptr)->scheduled_ns == scheduled))) {
+        next_ptr = &((*next_ptr)->next);
+    }
+    event->next = *next_ptr;
+    *next_ptr = event;
+    event->queued = 1;
+    STAT_INC(sched_queue_depth);
+    if (++sched->queue_len > sched->max_queue_len)
+        sched->max_queue_len = sched->queue_len;
+
+    update_next_event();
+}
+
+void register_event(struct event_t *event)
+{
+    unsigned i;
+
+    for (i = 0; i < sched->num_registered_events; i++) {
+        if (sched->registered_events[i] == event)
+            return;
+        assert(strcmp(sched->registered_events[i]->name, event->name) != 0);
+    }
+    assert(sched->num_registered_events < MAX_REGISTERED_EVENTS);
+    sched->registered_events[sched->num_registered_events++] = event;
 }
 
 void schedule_event(struct event_t *event)
@@ -21,7 +125,7 @@ void schedule_event(struct event_t *event)
     int64_t now = get_current_time();
     int64_t scheduled = get_current_time() + event->delta_ns;
 
-    if (trace_schedule) {
+    if (sched->trace_schedule) {
         long now_seconds = now / ONE_SECOND_NS;
         long now_us = (now % (int64_t)ONE_SECOND_NS) / ONE_MICROSECOND_NS;
         double delta = (double)event->delta_ns / ONE_MICROSECOND_NS;
@@ -35,43 +139,41 @@ void schedule_event(struct event_t *event)
         }
     }
 
-    if (event->next != NULL) {
-        if (trace_schedule) {
+    if (event->queued) {
+        if (sched->trace_schedule) {
             fprintf(stderr, "%s was already scheduled.\n", event->name);
         }
         cancel_event(event);
     }
 
-    event->scheduled_ns = scheduled;
-
-    struct event_t** next_ptr = &event_list;
-
-    // Insert event into sorted list.
-    while (*next_ptr && (*next_ptr)->scheduled_ns < scheduled) {
-        next_ptr = &((*next_ptr)->next);
-    }
-    event->next = *next_ptr;
-    *next_ptr = event;
-
-    update_next_event();
+    insert_event(event, scheduled, 0);
 }
 
 void run_scheduler(uint64_t current_time, unsigned trace)
 {
-    trace_schedule = trace;
-    if (next_event > current_time)
+    sched->trace_schedule = trace;
+    if (sched->next_event > current_time)
         return;
 
-    assert(event_list);
+    assert(sched->event_list);
 
-    while (next_event <= current_time) {
+    while (sched->next_event <= current_time) {
         // Pop event
-        struct event_t* event = event_list;
-        event_list = event->next;
+        struct event_t* event = sched->event_list;
+        sched->event_list = event->next;
         event->next = NULL;
+        event->queued = 0;
         update_next_event();
+        STAT_ADD(sched_queue_depth, -1);
+        sched->queue_len--;
 
         int64_t late_ns = current_time - event->scheduled_ns;
+        STAT_INC(sched_dispatched);
+        STAT_ADD(sched_late_ns, late_ns);
+
+        if (event->stats == NULL)
+            event->stats = lookup_event_stats(event->name);
+        histogram_add(&event->stats->late, late_ns);
 
         if (trace) {
             long seconds = current_time / ONE_SECOND_NS;
@@ -88,9 +190,9 @@ void run_scheduler(uint64_t current_time, unsigned trace)
 
 void cancel_event(struct event_t *event)
 {
-    struct event_t** next_ptr = &event_list;
+    struct event_t** next_ptr = &sched->event_list;
 
-    if (trace_schedule) {
+    if (sched->trace_schedule) {
         int64_t now = get_current_time();
         long seconds = now / ONE_SECOND_NS;
         long us = (now % (int64_t)ONE_SECOND_NS) / ONE_MICROSECOND_NS;
@@ -104,7 +206,10 @@ void cancel_event(struct event_t *event)
         if (next == event) {
             *next_ptr = next->next;
             event->next = NULL;
+            event->queued = 0;
             update_next_event();
+            STAT_ADD(sched_queue_depth, -1);
+            sched->queue_len--;
             return;
         }
         next_ptr = &next->next;
@@ -113,7 +218,86 @@ void cancel_event(struct event_t *event)
 
 int64_t scheduler_next()
 {
-    if (event_list == NULL)
+    if (sched->event_list == NULL)
+        return -1;
+    return sched->next_event;
+}
+
+void scheduler_report(FILE *fp)
+{
+    char name[64];
+    unsigned i;
+
+    fprintf(fp, "Scheduler: max queue length %u\n", sched->max_queue_len);
+    for (i = 0; i < sched->num_event_stats; i++) {
+        snprintf(name, sizeof(name), "Event %s lateness",
+            sched->event_stats[i].name);
+        histogram_print(fp, name, &sched->event_stats[i].late);
+    }
+}
+
+/*
+ *	Snapshots: the queue is saved in order as (name, time) pairs and
+ *	rebuilt from the registered events.
+ */
+struct event_snapshot {
+    char name[24];
+    int64_t delta_ns;
+    int64_t scheduled_ns;
+};
+
+void scheduler_save_state(struct snapshot *s)
+{
+    struct event_snapshot saved[MAX_REGISTERED_EVENTS];
+    struct event_t *event;
+    unsigned n = 0;
+
+    memset(saved, 0, sizeof(saved));
+    for (event = sched->event_list; event != NULL; event = event->next) {
+        // Only registered events can be restored
+        unsigned i;
+        for (i = 0; i < sched->num_registered_events; i++)
+            if (sched->registered_events[i] == event)
+                break;
+        if (i == sched->num_registered_events) {
+            fprintf(stderr, "Snapshot: event %s is not registered, dropped\n",
+                event->name);
+            continue;
+        }
+        strncpy(saved[n].name, event->name, sizeof(saved[n].name) - 1);
+        saved[n].delta_ns = event->delta_ns;
+        saved[n].scheduled_ns = event->scheduled_ns;
+        n++;
+    }
+    snapshot_write_section(s, "SCHD", saved, n * sizeof(saved[0]));
+}
+
+int scheduler_load_state(struct snapshot *s)
+{
+    const struct event_snapshot *saved;
+    uint32_t len;
+    unsigned n, i, j;
+
+    saved = snapshot_find_section(s, "SCHD", &len);
+    if (saved == NULL || len % sizeof(*saved)) {
+        fprintf(stderr, "%s: bad or missing scheduler state\n", s->name);
         return -1;
-    return next_event;
+    }
+
+    while (sched->event_list)
+        cancel_event(sched->event_list);
+
+    n = len / sizeof(*saved);
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < sched->num_registered_events; j++)
+            if (strcmp(sched->registered_events[j]->name, saved[i].name) == 0)
+                break;
+        if (j == sched->num_registered_events) {
+            fprintf(stderr, "%s: unknown event %s\n", s->name, saved[i].name);
+            return -1;
+        }
+        sched->registered_events[j]->delta_ns = saved[i].delta_ns;
+        insert_event(sched->registered_events[j], saved[i].scheduled_ns, 1);
+    }
+    return 0;
 }
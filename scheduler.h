@@ -2,6 +2,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdio.h>
 
 #define ONE_SECOND_NS 1000000000.0
 #define ONE_MILISECOND_NS 1000000.0
@@ -9,6 +10,7 @@
 
 
 struct event_t;
+struct event_stats;
 
 // event callbacks get called with their event and how many ns have passed
 // since their scheduled event time.
@@ -23,10 +25,22 @@ struct event_t {
     // internal state
     struct event_t *next;
     int64_t scheduled_ns;
+    unsigned queued;
+    struct event_stats *stats;
 };
 
+struct scheduler_state;
+
+struct scheduler_state *scheduler_create(void);
+void scheduler_destroy(struct scheduler_state *s);
+void scheduler_bind(struct scheduler_state *s);
+
+// Events that are part of the machine state must be registered (with a
+// unique name) so that snapshots can save and restore them.
+void register_event(struct event_t *event);
 void schedule_event(struct event_t *event);
 void cancel_event(struct event_t *event);
 void run_scheduler(uint64_t current_time, unsigned trace);
 int64_t scheduler_next();
+void scheduler_report(FILE *fp);
 int64_t get_current_time();
@@ -0,0 +1,274 @@
+/*
+ *	Script mode (see script.h)
+ *
+ *	The script runs alongside the machine in emulated time. Output from
+ *	each unit is collected in a buffer that expect searches, and sent
+ *	text is handed to the MUX a byte at a time as the guest takes it, so
+ *	nothing depends on a terminal or on how fast the host runs.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mux.h"
+#include "scheduler.h"
+#include "script.h"
+
+#define SCRIPT_TEXT_LEN		256	/* Longest send or expect */
+#define SCRIPT_OUTPUT_LEN	4096	/* Output kept for expect */
+
+enum script_op { OP_UNIT, OP_TIMEOUT, OP_EXPECT, OP_SEND, OP_WAIT, OP_EXIT };
+
+struct script_cmd {
+	enum script_op op;
+	unsigned line;
+	int arg;			/* Unit, exit code */
+	int64_t ns;			/* Timeout, wait */
+	size_t len;
+	uint8_t text[SCRIPT_TEXT_LEN];
+};
+
+struct script_output {
+	uint8_t buf[SCRIPT_OUTPUT_LEN];
+	size_t len;
+	unsigned changed;		/* Since expect last looked */
+};
+
+static struct script_cmd *cmds;
+static unsigned ncmds;
+static const char *script_path;
+
+static unsigned pc;
+static unsigned unit;
+static int64_t timeout_ns = 10 * ONE_SECOND_NS;
+static int timeout_code = 1;
+static int64_t deadline;		/* Of the current expect or wait, or 0 */
+static struct script_output output[NUM_MUX_UNITS];
+
+static unsigned hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return 16;
+}
+
+int parse_escapes(const char *p, char *buf, size_t size, size_t *len)
+{
+	*len = 0;
+	while (*p && *p != '\n') {
+		char ch = *p++;
+
+		if (ch == '\\') {
+			ch = *p++;
+			switch (ch) {
+			case 'r':
+				ch = '\r';
+				break;
+			case 'n':
+				ch = '\n';
+				break;
+			case 't':
+				ch = '\t';
+				break;
+			case '\\':
+				break;
+			case 'x':
+				if (hexval(p[0]) > 15 || hexval(p[1]) > 15)
+					return -1;
+				ch = hexval(p[0]) << 4 | hexval(p[1]);
+				p += 2;
+				break;
+			default:
+				return -1;
+			}
+		}
+		if (*len == size)
+			return -1;
+		buf[(*len)++] = ch;
+	}
+	return 0;
+}
+
+/* Every byte a unit sends, see mux_set_tap() */
+static void script_tap(unsigned u, uint8_t c)
+{
+	struct script_output *o = &output[u];
+
+	/* Anything expect could still match is in the last SCRIPT_TEXT_LEN */
+	if (o->len == SCRIPT_OUTPUT_LEN) {
+		memmove(o->buf, o->buf + o->len - SCRIPT_TEXT_LEN, SCRIPT_TEXT_LEN);
+		o->len = SCRIPT_TEXT_LEN;
+	}
+	o->buf[o->len++] = c;
+	o->changed = 1;
+}
+
+/* Drop output up to the end of text, or return 0 if it hasn't been sent */
+static int script_match(struct script_output *o, const uint8_t *text, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + len <= o->len; i++) {
+		if (memcmp(o->buf + i, text, len) == 0) {
+			o->len -= i + len;
+			memmove(o->buf, o->buf + i + len, o->len);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int parse_line(struct script_cmd *c, char *p)
+{
+	char word[16];
+	double secs;
+	int n, len;
+
+	if (sscanf(p, "%15s%n", word, &len) != 1)
+		return -1;
+	p += len;
+	if (*p == ' ' || *p == '\t')
+		p++;
+
+	if (strcmp(word, "unit") == 0) {
+		c->op = OP_UNIT;
+		return sscanf(p, "%d", &c->arg) == 1 &&
+			c->arg >= 0 && c->arg < NUM_MUX_UNITS ? 0 : -1;
+	}
+	if (strcmp(word, "timeout") == 0) {
+		c->op = OP_TIMEOUT;
+		c->arg = 1;
+		n = sscanf(p, "%lf %d", &secs, &c->arg);
+		c->ns = secs * ONE_SECOND_NS;
+		return n >= 1 && secs >= 0 ? 0 : -1;
+	}
+	if (strcmp(word, "wait") == 0) {
+		c->op = OP_WAIT;
+		n = sscanf(p, "%lf", &secs);
+		c->ns = secs * ONE_SECOND_NS;
+		return n == 1 && secs >= 0 ? 0 : -1;
+	}
+	if (strcmp(word, "exit") == 0) {
+		c->op = OP_EXIT;
+		return sscanf(p, "%d", &c->arg) == 1 ? 0 : -1;
+	}
+	if (strcmp(word, "expect") == 0)
+		c->op = OP_EXPECT;
+	else if (strcmp(word, "send") == 0)
+		c->op = OP_SEND;
+	else
+		return -1;
+	if (parse_escapes(p, (char *)c->text, SCRIPT_TEXT_LEN, &c->len))
+		return -1;
+	return c->len ? 0 : -1;
+}
+
+int script_load(const char *path)
+{
+	char buf[SCRIPT_TEXT_LEN * 4 + 64];
+	unsigned line = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(buf, sizeof(buf), fp)) {
+		char *p = buf + strspn(buf, " \t");
+
+		line++;
+		if (*p == '#' || *p == '\n' || *p == 0)
+			continue;
+		cmds = realloc(cmds, (ncmds + 1) * sizeof(*cmds));
+		if (cmds == NULL) {
+			perror("script");
+			exit(1);
+		}
+		memset(&cmds[ncmds], 0, sizeof(*cmds));
+		cmds[ncmds].line = line;
+		if (parse_line(&cmds[ncmds], p)) {
+			fprintf(stderr, "%s:%u: bad command\n", path, line);
+			fclose(fp);
+			return -1;
+		}
+		/* The cards fitted are known by now, see -c */
+		if (cmds[ncmds].op == OP_UNIT && cmds[ncmds].arg >= mux_units()) {
+			fprintf(stderr, "%s:%u: no unit %d, %u are fitted\n",
+				path, line, cmds[ncmds].arg, mux_units());
+			fclose(fp);
+			return -1;
+		}
+		ncmds++;
+	}
+	fclose(fp);
+	script_path = path;
+	mux_set_tap(script_tap);
+	return 0;
+}
+
+int script_poll(void)
+{
+	struct script_cmd *c;
+	int64_t now;
+
+	while (pc < ncmds) {
+		c = &cmds[pc];
+		switch (c->op) {
+		case OP_UNIT:
+			unit = c->arg;
+			break;
+		case OP_TIMEOUT:
+			timeout_ns = c->ns;
+			timeout_code = c->arg;
+			break;
+		case OP_SEND:
+			/* One send at a time per unit, in order */
+			if (mux_injecting(unit))
+				return -1;
+			mux_inject(unit, c->text, c->len);
+			break;
+		case OP_EXPECT:
+			now = get_current_time();
+			if (deadline == 0)
+				deadline = timeout_ns ? now + timeout_ns : INT64_MAX;
+			if (!output[unit].changed || !script_match(&output[unit], c->text, c->len)) {
+				output[unit].changed = 0;
+				if (now < deadline)
+					return -1;
+				fprintf(stderr, "%s:%u: timed out waiting for \"%.*s\"\n",
+					script_path, c->line, (int)c->len, c->text);
+				return timeout_code;
+			}
+			deadline = 0;
+			break;
+		case OP_WAIT:
+			now = get_current_time();
+			if (deadline == 0)
+				deadline = now + c->ns;
+			if (now < deadline)
+				return -1;
+			deadline = 0;
+			break;
+		case OP_EXIT:
+			return c->arg;
+		}
+		pc++;
+	}
+	return 0;
+}
+
+int script_result(void)
+{
+	if (pc >= ncmds)
+		return 0;
+	fprintf(stderr, "%s:%u: machine stopped during the script\n",
+		script_path, cmds[pc].line);
+	return timeout_code;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ *	Script mode: drive the MUX units from an expect style script instead
+ *	of a terminal, one command per line:
+ *
+ *	unit <n>		MUX unit the following commands talk to (0)
+ *	timeout <secs> [<code>]	emulated time an expect may wait, 0 for
+ *				ever, and the exit code if it runs out (10, 1)
+ *	expect <text>		wait until the unit has sent text
+ *	send <text>		type text on the unit
+ *	wait <secs>		let emulated time pass
+ *	exit <code>		stop the emulator with this exit code
+ *
+ *	Blank lines and lines starting with '#' are ignored. Text is the rest
+ *	of the line and may use \r, \n, \t, \\ and \xHH escapes. Running off
+ *	the end of the script exits with code 0.
+ */
+
+int script_load(const char *path);
+
+/* Once per instruction. -1 while the script runs, then the exit code */
+int script_poll(void);
+
+/* The exit code for a machine that stopped before the script finished */
+int script_result(void);
+
+/*
+ * Copy the rest of the line p into buf, expanding the escapes above.
+ * Also used for farm files.
+ */
+int parse_escapes(const char *p, char *buf, size_t size, size_t *len);
@@ -0,0 +1,227 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scheduler.h"
+#include "snapshot.h"
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+};
+
+struct section_header {
+	char tag[4];
+	uint32_t len;
+};
+
+#define SECTION_ALIGN 8
+
+void snapshot_write_section(struct snapshot *s, const char *tag,
+			    const void *data, uint32_t len)
+{
+	static const uint8_t pad[SECTION_ALIGN];
+	struct section_header sh;
+
+	memcpy(sh.tag, tag, sizeof(sh.tag));
+	sh.len = len;
+	fwrite(&sh, sizeof(sh), 1, s->fp);
+	fwrite(data, len, 1, s->fp);
+	if (len % SECTION_ALIGN)
+		fwrite(pad, SECTION_ALIGN - len % SECTION_ALIGN, 1, s->fp);
+}
+
+/* Iterate over the sections with a given tag. *pos starts out as 0. */
+const void *snapshot_next_section(struct snapshot *s, const char *tag,
+				  uint32_t *len, size_t *pos)
+{
+	if (*pos == 0)
+		*pos = sizeof(struct snapshot_header);
+
+	while (*pos + sizeof(struct section_header) <= s->size) {
+		const struct section_header *sh = (const void *)(s->map + *pos);
+		const void *data;
+
+		*pos += sizeof(*sh);
+		if (sh->len > s->size - *pos)
+			break;
+		data = s->map + *pos;
+		*pos += (sh->len + SECTION_ALIGN - 1) & ~(SECTION_ALIGN - 1);
+		if (memcmp(sh->tag, tag, sizeof(sh->tag)) == 0) {
+			*len = sh->len;
+			return data;
+		}
+	}
+	return NULL;
+}
+
+const void *snapshot_find_section(struct snapshot *s, const char *tag,
+				  uint32_t *len)
+{
+	size_t pos = 0;
+
+	return snapshot_next_section(s, tag, len, &pos);
+}
+
+/* Copy out a section that must be exactly len bytes long */
+int snapshot_read_section(struct snapshot *s, const char *tag,
+			  void *data, uint32_t len)
+{
+	uint32_t found_len;
+	const void *p = snapshot_find_section(s, tag, &found_len);
+
+	if (p == NULL) {
+		fprintf(stderr, "%s: snapshot has no %.4s section\n", s->name, tag);
+		return -1;
+	}
+	if (found_len != len) {
+		fprintf(stderr, "%s: snapshot section %.4s is %u bytes, expected %u\n",
+			s->name, tag, found_len, len);
+		return -1;
+	}
+	memcpy(data, p, len);
+	return 0;
+}
+
+/* Written to a temporary name and renamed, so a reader never sees half
+   a snapshot */
+static int save(const char *path, const char *base, unsigned checkpoint)
+{
+	struct snapshot s = { .name = path, .base = base };
+	struct snapshot_header h;
+	char tmp[4096];
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	s.fp = fopen(tmp, "wb");
+	if (s.fp == NULL) {
+		perror(tmp);
+		return -1;
+	}
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	h.flags = base ? SNAPSHOT_INCREMENTAL : 0;
+	fwrite(&h, sizeof(h), 1, s.fp);
+	if (base) {
+		const char *p = strrchr(base, '/');
+		p = p ? p + 1 : base;
+		snapshot_write_section(&s, "BASE", p, strlen(p) + 1);
+	}
+
+	board_save_state(&s);
+	cpu6_save_state(&s);
+	dsk_save_state(&s);
+	mux_save_state(&s);
+	scheduler_save_state(&s);
+
+	if (ferror(s.fp) | fclose(s.fp)) {
+		fprintf(stderr, "%s: error writing snapshot\n", tmp);
+		unlink(tmp);
+		return -1;
+	}
+	if (rename(tmp, path) == -1) {
+		perror(path);
+		unlink(tmp);
+		return -1;
+	}
+	/* Part of the checkpoint chain, so the dirty page tracking starts
+	   again from here */
+	if (checkpoint)
+		board_checkpoint_saved();
+	return 0;
+}
+
+int snapshot_save(const char *path)
+{
+	return save(path, NULL, 0);
+}
+
+/* Save the next checkpoint of a chain, incremental over base unless that
+   is NULL */
+int snapshot_checkpoint(const char *path, const char *base)
+{
+	return save(path, base, 1);
+}
+
+#define MAX_SNAPSHOT_CHAIN	256
+
+static int load_chain(const char *path, unsigned depth);
+
+/* Load the base of an incremental snapshot, found next to it */
+static int load_base(struct snapshot *s, unsigned depth)
+{
+	const char *base, *slash;
+	char path[4096];
+	uint32_t len;
+
+	base = snapshot_find_section(s, "BASE", &len);
+	if (base == NULL || len == 0 || base[len - 1] != 0) {
+		fprintf(stderr, "%s: incremental snapshot has no base\n", s->name);
+		return -1;
+	}
+	slash = strrchr(s->name, '/');
+	if (slash)
+		snprintf(path, sizeof(path), "%.*s/%s",
+			 (int)(slash - s->name), s->name, base);
+	else
+		snprintf(path, sizeof(path), "%s", base);
+	s->base = base;
+	return load_chain(path, depth + 1);
+}
+
+static int load_chain(const char *path, unsigned depth)
+{
+	struct snapshot s = { .name = path };
+	const struct snapshot_header *h;
+	struct stat st;
+	int fd, r = -1;
+
+	if (depth > MAX_SNAPSHOT_CHAIN) {
+		fprintf(stderr, "%s: snapshot chain too long\n", path);
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		perror(path);
+		return -1;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof(*h)) {
+		fprintf(stderr, "%s: not a snapshot\n", path);
+		close(fd);
+		return -1;
+	}
+	s.size = st.st_size;
+	s.map = mmap(NULL, s.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (s.map == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+
+	h = (const void *)s.map;
+	if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic))) {
+		fprintf(stderr, "%s: not a snapshot\n", path);
+	} else if (h->version != SNAPSHOT_VERSION) {
+		fprintf(stderr, "%s: snapshot version %u, expected %u\n",
+			path, h->version, SNAPSHOT_VERSION);
+	} else if ((h->flags & SNAPSHOT_INCREMENTAL) && load_base(&s, depth)) {
+		/* Reported by load_base */
+	} else if (board_load_state(&s) == 0 && cpu6_load_state(&s) == 0
+		   && dsk_load_state(&s) == 0 && mux_load_state(&s) == 0
+		   && scheduler_load_state(&s) == 0) {
+		r = 0;
+	}
+
+	munmap((void *)s.map, s.size);
+	return r;
+}
+
+int snapshot_load(const char *path)
+{
+	return load_chain(path, 0);
+}
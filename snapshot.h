@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ *	Machine snapshots
+ *
+ *	A snapshot file is a small header followed by tagged sections, one
+ *	or more per emulated subsystem. Sections are in host byte order and
+ *	mirror the in-memory state, so a snapshot is only portable between
+ *	builds with the same SNAPSHOT_VERSION on the same kind of host.
+ *
+ *	Files are read through mmap, so restoring mostly costs the copies
+ *	into the machine state.
+ *
+ *	An incremental snapshot (SNAPSHOT_INCREMENTAL) names its base in a
+ *	BASE section and carries only the memory pages written since the
+ *	base was taken, plus all device state. Loading one loads the chain
+ *	of bases first. Bases are looked up in the directory of the snapshot
+ *	that refers to them.
+ */
+
+#define SNAPSHOT_MAGIC		"CENTSNAP"
+#define SNAPSHOT_VERSION	5
+
+/* Header flags */
+#define SNAPSHOT_INCREMENTAL	1
+
+struct snapshot {
+	/* Writing */
+	FILE *fp;
+	/* Reading */
+	const uint8_t *map;
+	size_t size;
+	const char *name;
+	/* Base snapshot if incremental, NULL for a full one */
+	const char *base;
+};
+
+int snapshot_save(const char *path);
+int snapshot_checkpoint(const char *path, const char *base);
+int snapshot_load(const char *path);
+
+void snapshot_write_section(struct snapshot *s, const char *tag,
+			    const void *data, uint32_t len);
+const void *snapshot_find_section(struct snapshot *s, const char *tag,
+				  uint32_t *len);
+const void *snapshot_next_section(struct snapshot *s, const char *tag,
+				  uint32_t *len, size_t *pos);
+int snapshot_read_section(struct snapshot *s, const char *tag,
+			  void *data, uint32_t len);
+
+/* Per subsystem state, implemented alongside each subsystem */
+void board_save_state(struct snapshot *s);
+int board_load_state(struct snapshot *s);
+void board_checkpoint_saved(void);
+void cpu6_save_state(struct snapshot *s);
+int cpu6_load_state(struct snapshot *s);
+void dsk_save_state(struct snapshot *s);
+int dsk_load_state(struct snapshot *s);
+void mux_save_state(struct snapshot *s);
+int mux_load_state(struct snapshot *s);
+void scheduler_save_state(struct snapshot *s);
+int scheduler_load_state(struct snapshot *s);
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "console.h"
+#include "scheduler.h"
+#include "stats.h"
+
+_Thread_local struct emu_stats *stats;
+
+struct emu_stats *stats_create(void)
+{
+	struct emu_stats *s = calloc(1, sizeof(*s));
+
+	if (s == NULL) {
+		perror("stats_create");
+		exit(1);
+	}
+	return s;
+}
+
+void stats_destroy(struct emu_stats *s)
+{
+	free(s);
+}
+
+void stats_bind(struct emu_stats *s)
+{
+	stats = s;
+}
+
+void stats_init(void)
+{
+	stats->start_ns = monotonic_time_ns();
+}
+
+/* Render a snapshot of all counters as "name value" lines. May be called
+   from any thread. */
+size_t stats_format(const struct emu_stats *s, char *buf, size_t len)
+{
+	uint64_t wall_ns = monotonic_time_ns() - s->start_ns;
+	int64_t emulated_ns = STAT_READ(s, emulated_ns);
+	uint64_t dispatched = STAT_READ(s, sched_dispatched);
+	size_t n = 0;
+	int i;
+
+#define EMIT(...) \
+	do { \
+		if (n < len) \
+			n += snprintf(buf + n, len - n, __VA_ARGS__); \
+	} while (0)
+
+	EMIT("instructions %llu\n", (unsigned long long)STAT_READ(s, instructions));
+	EMIT("emulated_ns %lld\n", (long long)emulated_ns);
+	EMIT("wall_ns %llu\n", (unsigned long long)wall_ns);
+	EMIT("emu_ratio %.4f\n", wall_ns ? (double)emulated_ns / wall_ns : 0.0);
+	EMIT("throttle_lag_ns %lld\n", (long long)STAT_READ(s, throttle_lag_ns));
+	EMIT("warping %llu\n", (unsigned long long)STAT_READ(s, warping));
+	EMIT("sched_queue_depth %llu\n",
+		(unsigned long long)STAT_READ(s, sched_queue_depth));
+	EMIT("sched_dispatched %llu\n", (unsigned long long)dispatched);
+	EMIT("sched_avg_late_ns %.1f\n",
+		dispatched ? (double)STAT_READ(s, sched_late_ns) / dispatched : 0.0);
+	for (i = 0; i < STAT_READ(s, mux_units); i++) {
+		EMIT("mux%d_rx_bytes %llu\n", i,
+			(unsigned long long)STAT_READ(s, mux_rx_bytes[i]));
+		EMIT("mux%d_tx_bytes %llu\n", i,
+			(unsigned long long)STAT_READ(s, mux_tx_bytes[i]));
+	}
+	EMIT("dsk_commands %llu\n", (unsigned long long)STAT_READ(s, dsk_commands));
+	EMIT("dsk_sectors %llu\n", (unsigned long long)STAT_READ(s, dsk_sectors));
+	for (i = 0; i < 16; i++) {
+		EMIT("irq%d_raised %llu\n", i,
+			(unsigned long long)STAT_READ(s, irq_raised[i]));
+		EMIT("irq%d_taken %llu\n", i,
+			(unsigned long long)STAT_READ(s, irq_taken[i]));
+	}
+#undef EMIT
+
+	return n < len ? n : len;
+}
+
+void histogram_add(struct histogram *h, int64_t ns)
+{
+	unsigned b = 0;
+
+	if (ns > 0) {
+		b = 64 - __builtin_clzll(ns);
+		if (b >= HIST_BUCKETS)
+			b = HIST_BUCKETS - 1;
+		h->sum += ns;
+	}
+	h->bucket[b]++;
+	h->count++;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+static const char *format_ns(char *buf, size_t len, double ns)
+{
+	if (ns >= ONE_SECOND_NS)
+		snprintf(buf, len, "%.3g s", ns / ONE_SECOND_NS);
+	else if (ns >= ONE_MILISECOND_NS)
+		snprintf(buf, len, "%.3g ms", ns / ONE_MILISECOND_NS);
+	else if (ns >= ONE_MICROSECOND_NS)
+		snprintf(buf, len, "%.3g us", ns / ONE_MICROSECOND_NS);
+	else
+		snprintf(buf, len, "%.3g ns", ns);
+	return buf;
+}
+
+void histogram_print(FILE *fp, const char *name, const struct histogram *h)
+{
+	char lo[16], hi[16], mean[16], max[16];
+	unsigned b;
+
+	fprintf(fp, "%s: %llu samples, mean %s, max %s\n", name,
+		(unsigned long long)h->count,
+		format_ns(mean, sizeof(mean), h->count ? (double)h->sum / h->count : 0),
+		format_ns(max, sizeof(max), h->max));
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		if (h->bucket[b] == 0)
+			continue;
+		if (b == 0)
+			fprintf(fp, "  %21s", "0");
+		else
+			fprintf(fp, "  [%8s, %8s)",
+				format_ns(lo, sizeof(lo), (double)(1ULL << (b - 1))),
+				format_ns(hi, sizeof(hi), (double)(1ULL << b)));
+		fprintf(fp, " %12llu %5.1f%%\n", (unsigned long long)h->bucket[b],
+			100.0 * h->bucket[b] / h->count);
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "mux.h"
+
+/*
+ *	Emulator health counters
+ *
+ *	Every counter has a single writer, the emulation thread, and may be
+ *	read at any time by other threads (the statistics endpoint). Updates
+ *	are relaxed loads and stores rather than read-modify-write cycles so
+ *	they cost no more than a plain increment and never block.
+ */
+struct emu_stats {
+	atomic_uint_least64_t instructions;
+	atomic_int_least64_t emulated_ns;
+	atomic_int_least64_t throttle_lag_ns;
+	atomic_uint_least64_t warping;		/* -M warp running flat out */
+
+	atomic_uint_least64_t sched_queue_depth;
+	atomic_uint_least64_t sched_dispatched;
+	atomic_uint_least64_t sched_late_ns;
+
+	atomic_uint_least64_t mux_units;	/* Fitted, of NUM_MUX_UNITS */
+	atomic_uint_least64_t mux_rx_bytes[NUM_MUX_UNITS];
+	atomic_uint_least64_t mux_tx_bytes[NUM_MUX_UNITS];
+
+	atomic_uint_least64_t dsk_commands;
+	atomic_uint_least64_t dsk_sectors;
+
+	atomic_uint_least64_t irq_raised[16];
+	atomic_uint_least64_t irq_taken[16];
+
+	uint64_t start_ns;		/* Host time at stats_init() */
+};
+
+/* Counters of the machine bound to this thread, see machine.h */
+extern _Thread_local struct emu_stats *stats;
+
+#define STAT_READ(s, field) \
+	atomic_load_explicit(&(s)->field, memory_order_relaxed)
+
+#define STAT_GET(field) STAT_READ(stats, field)
+
+#define STAT_SET(field, val) \
+	atomic_store_explicit(&stats->field, (val), memory_order_relaxed)
+
+#define STAT_ADD(field, val) \
+	STAT_SET(field, STAT_GET(field) + (val))
+
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+struct emu_stats *stats_create(void);
+void stats_destroy(struct emu_stats *s);
+void stats_bind(struct emu_stats *s);
+void stats_init(void);
+size_t stats_format(const struct emu_stats *s, char *buf, size_t len);
+
+/*
+ *	Log bucketed histogram of nanosecond durations
+ *
+ *	Bucket 0 counts zero (or negative) values, bucket n counts values in
+ *	[2^(n-1), 2^n) ns. Owned by a single thread, so plain integers.
+ */
+#define HIST_BUCKETS 48
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	int64_t max;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+void histogram_add(struct histogram *h, int64_t ns);
+void histogram_print(FILE *fp, const char *name, const struct histogram *h);
@@ -16,11 +16,4 @@
                 fputc('\n', stderr);                 \
         }
 
-#define WARN_PC(...)                                 \
-        do {                                         \
-                fprintf(stderr, "%04X ", cpu6_pc()); \
-		fprintf(stderr, __VA_ARGS__);        \
-                fputc('\n', stderr);                 \
-        } while (0);
-
 #endif